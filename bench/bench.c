@@ -0,0 +1,365 @@
+/* Benchmarks of the emulator core: host-side microbenchmarks of the hot
+ * paths, and tiny bare-metal guest programs run to completion the way
+ * --headless runs a guest. Each result is printed as one JSON object per
+ * line, so that runs can be compared by script.
+ *
+ * Usage: vulpinesystem-bench [--no-jit] [name...]
+ */
+
+#define _DEFAULT_SOURCE /* mkstemp */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/disk.h"
+#include "../src/semu.h"
+#if defined(JIT)
+#include "../src/jit.h"
+#endif
+
+/* Guest registers. */
+enum { ZERO, RA, SP, GP, TP, T0, T1, T2, S0, S1, A0, A1, A2, A3, A4, A5, A6, A7, S2 };
+
+#define R_TYPE(f7, rs2, rs1, f3, rd, op)                                   \
+    ((uint32_t) (f7) << 25 | (rs2) << 20 | (rs1) << 15 | (f3) << 12 |      \
+     (rd) << 7 | (op))
+#define I_TYPE(imm, rs1, f3, rd, op)                                       \
+    ((uint32_t) ((imm) &0xfff) << 20 | (rs1) << 15 | (f3) << 12 |          \
+     (rd) << 7 | (op))
+#define S_TYPE(imm, rs2, rs1, f3, op)                                      \
+    ((uint32_t) (((imm) >> 5) & 0x7f) << 25 | (rs2) << 20 | (rs1) << 15 | \
+     (f3) << 12 | ((imm) &0x1f) << 7 | (op))
+
+#define ADD(rd, a, b) R_TYPE(0, b, a, 0, rd, 0x33)
+#define SUB(rd, a, b) R_TYPE(0x20, b, a, 0, rd, 0x33)
+#define XOR(rd, a, b) R_TYPE(0, b, a, 4, rd, 0x33)
+#define ADDI(rd, a, imm) I_TYPE(imm, a, 0, rd, 0x13)
+#define SLLI(rd, a, sh) I_TYPE(sh, a, 1, rd, 0x13)
+#define LD(rd, imm, a) I_TYPE(imm, a, 3, rd, 0x03)
+#define SD(b, imm, a) S_TYPE(imm, b, a, 3, 0x23)
+#define SW(b, imm, a) S_TYPE(imm, b, a, 2, 0x23)
+#define CSRRW(rd, csr, a) I_TYPE(csr, a, 1, rd, 0x73)
+#define CSRRS(rd, csr, a) I_TYPE(csr, a, 2, rd, 0x73)
+#define ECALL 0x00000073
+#define MRET 0x30200073
+
+#define CSR_SATP 0x180
+#define CSR_MTVEC 0x305
+#define CSR_MEPC 0x341
+
+/* Branches and jumps to an instruction index, from the one at index at. */
+static uint32_t b_type(const int f3,
+                       const int rs1,
+                       const int rs2,
+                       const int at,
+                       const int to)
+{
+    int32_t off = (to - at) * 4;
+    return (uint32_t) ((off >> 12) & 1) << 31 | ((off >> 5) & 0x3f) << 25 |
+           rs2 << 20 | rs1 << 15 | f3 << 12 | ((off >> 1) & 0xf) << 8 |
+           ((off >> 11) & 1) << 7 | 0x63;
+}
+#define BNE(a, b, at, to) b_type(1, a, b, at, to)
+#define BLTU(a, b, at, to) b_type(6, a, b, at, to)
+
+static uint32_t j_type(const int rd, const int at, const int to)
+{
+    int32_t off = (to - at) * 4;
+    return (uint32_t) ((off >> 20) & 1) << 31 | ((off >> 1) & 0x3ff) << 21 |
+           ((off >> 11) & 1) << 20 | ((off >> 12) & 0xff) << 12 | rd << 7 |
+           0x6f;
+}
+
+/* Every program powers off with s1 (SYSCON_PASS) stored to s0. */
+#define POWEROFF SW(S1, 0, S0)
+
+static bool use_jit = true;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct cpu *machine_new(const uint32_t *code,
+                               const size_t len,
+                               struct disk_image *disk)
+{
+    struct ram *ram = ram_new(RAM_DEFAULT_SIZE, false);
+    if (!ram)
+        fatal("allocate RAM");
+    memcpy(ram->data, code, len * sizeof(uint32_t));
+    struct cpu *cpu = cpu_new(ram, RAM_BASE, disk);
+    bus_set_clock(cpu->bus, SCHED_CLOCK_CYCLES);
+    cpu->regs[S0] = SYSCON_BASE;
+    cpu->regs[S1] = SYSCON_PASS;
+#if defined(JIT)
+    if (use_jit)
+        cpu->jit = jit_new(false);
+#endif
+    return cpu;
+}
+
+/* The loop of --headless, for one hart. */
+static void machine_run(const char *name, struct cpu *cpu)
+{
+    const struct syscon *syscon = cpu->bus->syscon;
+    double start = now();
+    while (!syscon->off) {
+        exception_t e;
+        cpu_execute_block(cpu, CPU_HZ / 60, &e);
+        if (e != OK) {
+            cpu_take_trap(cpu, e, NONE);
+            if (exception_is_fatal(e))
+                fatal("run the guest program");
+        }
+        interrupt_t intr;
+        if ((intr = cpu_check_pending_interrupt(cpu)) != NONE)
+            cpu_take_trap(cpu, OK, intr);
+    }
+    double seconds = now() - start;
+
+    printf("{\"bench\":\"%s\",\"insns\":%" PRIu64
+           ",\"seconds\":%.6f,\"mips\":%.2f,\"ns_per_insn\":%.3f}\n",
+           name, cpu->cycle, seconds, cpu->cycle / seconds / 1e6,
+           seconds * 1e9 / cpu->cycle);
+}
+
+static void print_op(const char *name, const uint64_t ops, const double seconds)
+{
+    printf("{\"bench\":\"%s\",\"ops\":%" PRIu64
+           ",\"seconds\":%.6f,\"ns_per_op\":%.3f}\n",
+           name, ops, seconds, seconds * 1e9 / ops);
+}
+
+/* Integer ALU work in a tight loop. */
+static void bench_int_loop(void)
+{
+    const uint32_t code[] = {
+        ADDI(A1, A1, 1),        XOR(A2, A2, A1), ADD(A3, A3, A2),
+        SLLI(A4, A3, 3),        SUB(A5, A4, A1), ADDI(T0, T0, -1),
+        BNE(T0, ZERO, 6, 0),    POWEROFF,        j_type(ZERO, 8, 8),
+    };
+    struct cpu *cpu = machine_new(code, sizeof(code) / sizeof(code[0]), NULL);
+    cpu->regs[T0] = 20000000;
+    machine_run("guest-int-loop", cpu);
+}
+
+/* Copy 64 KiB with ld/sd, over and over. */
+static void bench_memcpy(void)
+{
+    const uint32_t code[] = {
+        ADDI(A3, A0, 0),      ADDI(A4, A1, 0),       ADD(A5, A0, A2),
+        LD(T1, 0, A3),        LD(T2, 8, A3),         SD(T1, 0, A4),
+        SD(T2, 8, A4),        ADDI(A3, A3, 16),      ADDI(A4, A4, 16),
+        BLTU(A3, A5, 9, 3),   ADDI(T0, T0, -1),      BNE(T0, ZERO, 11, 0),
+        POWEROFF,             j_type(ZERO, 13, 13),
+    };
+    struct cpu *cpu = machine_new(code, sizeof(code) / sizeof(code[0]), NULL);
+    cpu->regs[A0] = RAM_BASE + 0x100000;
+    cpu->regs[A1] = RAM_BASE + 0x200000;
+    cpu->regs[A2] = 64 * 1024;
+    cpu->regs[T0] = 2000;
+    machine_run("guest-memcpy", cpu);
+}
+
+/* Page tables for Sv39: gigapages mapping the MMIO space and RAM to
+ * themselves, and 512 pages at 0xc0000000 onto the 2 MiB past 4 MiB of
+ * RAM. Returns the value for satp.
+ */
+#define PT_ROOT (RAM_BASE + 0x300000)
+#define PT_L1 (PT_ROOT + PAGE_SIZE)
+#define PT_L0 (PT_ROOT + 2 * PAGE_SIZE)
+#define PT_VA 0xc0000000ULL
+#define PT_PAGES 512
+#define PTE_LEAF 0xcf      /* V, R, W, X, A, D */
+#define PTE_TABLE 0x01
+
+static uint64_t page_tables_new(struct bus *bus)
+{
+    bus_store(bus, PT_ROOT + 0 * 8, 64, (0ULL >> 12) << 10 | PTE_LEAF);
+    bus_store(bus, PT_ROOT + 2 * 8, 64, ((uint64_t) RAM_BASE >> 12) << 10 | PTE_LEAF);
+    bus_store(bus, PT_ROOT + 3 * 8, 64, (PT_L1 >> 12) << 10 | PTE_TABLE);
+    bus_store(bus, PT_L1, 64, (PT_L0 >> 12) << 10 | PTE_TABLE);
+    for (int i = 0; i < PT_PAGES; i++) {
+        uint64_t pa = RAM_BASE + 0x400000 + (uint64_t) i * PAGE_SIZE;
+        bus_store(bus, PT_L0 + i * 8, 64, (pa >> 12) << 10 | PTE_LEAF);
+    }
+    return 8ULL << 60 | PT_ROOT >> 12;
+}
+
+/* One load from each of 512 pages, twice the reach of the TLB. */
+static void bench_page_walk(void)
+{
+    const uint32_t code[] = {
+        CSRRW(ZERO, CSR_SATP, A1), ADDI(A3, A0, 0),        ADDI(A4, A2, 0),
+        LD(T1, 0, A3),             ADD(T2, T2, T1),        ADD(A3, A3, S2),
+        ADDI(A4, A4, -1),          BNE(A4, ZERO, 7, 3),    ADDI(T0, T0, -1),
+        BNE(T0, ZERO, 9, 1),       POWEROFF,               j_type(ZERO, 11, 11),
+    };
+    struct cpu *cpu = machine_new(code, sizeof(code) / sizeof(code[0]), NULL);
+    cpu->regs[A0] = PT_VA;
+    cpu->regs[A1] = page_tables_new(cpu->bus);
+    cpu->regs[A2] = PT_PAGES;
+    cpu->regs[S2] = PAGE_SIZE;
+    cpu->regs[T0] = 20000;
+    machine_run("guest-page-walk", cpu);
+}
+
+/* ecall from user mode, into a machine mode handler that returns at once. */
+static void bench_syscall(void)
+{
+    const uint32_t code[] = {
+        ECALL,                    ADDI(T0, T0, -1),     BNE(T0, ZERO, 2, 0),
+        POWEROFF,                 j_type(ZERO, 4, 4),   CSRRS(T1, CSR_MEPC, ZERO),
+        ADDI(T1, T1, 4),          CSRRW(ZERO, CSR_MEPC, T1),
+        MRET,
+    };
+    struct cpu *cpu = machine_new(code, sizeof(code) / sizeof(code[0]), NULL);
+    cpu->csrs[CSR_MTVEC] = RAM_BASE + 5 * 4;
+    cpu->mode = USER;
+    cpu->regs[T0] = 2000000;
+    machine_run("guest-syscall", cpu);
+}
+
+/* Decode and execute one addi at a time. */
+static void bench_dispatch(void)
+{
+    const uint32_t code[] = {POWEROFF};
+    struct cpu *cpu = machine_new(code, 1, NULL);
+    const uint64_t n = 20000000;
+    double start = now();
+    for (uint64_t i = 0; i < n; i++)
+        cpu_execute(cpu, ADDI(A0, A0, 1));
+    print_op("cpu_execute", n, now() - start);
+}
+
+static void bench_translate(void)
+{
+    const uint32_t code[] = {POWEROFF};
+    struct cpu *cpu = machine_new(code, 1, NULL);
+    cpu->csrs[CSR_SATP] = page_tables_new(cpu->bus);
+    cpu->pagetable = PT_ROOT;
+    cpu->enable_paging = true;
+
+    const uint64_t n = 20000000;
+    uint64_t pa, sum = 0;
+    double start = now();
+    for (uint64_t i = 0; i < n; i++) {
+        cpu_translate(cpu, PT_VA + (i % 64) * 8, LOAD_PAGE_FAULT, &pa);
+        sum += pa;
+    }
+    print_op("cpu_translate-hit", n, now() - start);
+
+    /* Pages i and i + TLB_SIZE share an entry, so every lookup misses. */
+    start = now();
+    for (uint64_t i = 0; i < n / 10; i++) {
+        cpu_translate(cpu, PT_VA + (i % PT_PAGES) * PAGE_SIZE,
+                      LOAD_PAGE_FAULT, &pa);
+        sum += pa;
+    }
+    print_op("cpu_translate-miss", n / 10, now() - start);
+    if (!sum)
+        fatal("translate");
+}
+
+static void bench_ram(void)
+{
+    const uint32_t code[] = {POWEROFF};
+    struct cpu *cpu = machine_new(code, 1, NULL);
+    struct ram *ram = cpu->bus->ram;
+    const uint64_t n = 50000000, span = 1024 * 1024;
+
+    uint64_t value, sum = 0;
+    double start = now();
+    for (uint64_t i = 0; i < n; i++) {
+        ram_load(ram, RAM_BASE + 0x100000 + (i * 8) % span, 64, &value);
+        sum += value;
+    }
+    print_op("ram_load", n, now() - start);
+
+    start = now();
+    for (uint64_t i = 0; i < n; i++)
+        ram_store(ram, RAM_BASE + 0x100000 + (i * 8) % span, 64, i + sum);
+    print_op("ram_store", n, now() - start);
+}
+
+/* 64 KiB requests through the disk registers, up to the queue depth at a
+ * time, against a scratch image.
+ */
+static void bench_disk(void)
+{
+    char path[] = "/tmp/vulpinesystem-bench-XXXXXX";
+    int fd = mkstemp(path);
+    const uint64_t size = 16 * 1024 * 1024, len = 64 * 1024;
+    if (fd < 0 || ftruncate(fd, size) < 0)
+        fatal("create the scratch disk image");
+    close(fd);
+    struct disk_image *image =
+        disk_open(path, NULL, DISK_FILE, DISK_SYNC_EXIT, DISK_SYNC_INTERVAL_MS);
+    unlink(path);
+    if (!image)
+        fatal("open the scratch disk image");
+
+    const uint32_t code[] = {POWEROFF};
+    struct cpu *cpu = machine_new(code, 1, image);
+    struct bus *bus = cpu->bus;
+    static const char *const names[] = {"disk-read", "disk-write"};
+    for (int direction = 0; direction < 2; direction++) {
+        const int n = 4096;
+        double start = now();
+        for (int i = 0; i < n; i++) {
+            bus_store(bus, DISK_BUFFER_ADDR_HIGH, 32, 0);
+            bus_store(bus, DISK_BUFFER_ADDR_LOW, 32, RAM_BASE + 0x100000);
+            bus_store(bus, DISK_BUFFER_LEN_HIGH, 32, 0);
+            bus_store(bus, DISK_BUFFER_LEN_LOW, 32, len);
+            bus_store(bus, DISK_SECTOR, 32, (i * len % size) / 512);
+            bus_store(bus, DISK_DIRECTION, 32, direction);
+            bus_store(bus, DISK_NOTIFY, 32, i);
+        }
+        disk_drain(bus->disk);
+        double seconds = now() - start;
+        printf("{\"bench\":\"%s\",\"ops\":%d,\"seconds\":%.6f,"
+               "\"ns_per_op\":%.3f,\"mb_per_s\":%.2f}\n",
+               names[direction], n, seconds, seconds * 1e9 / n,
+               n * len / seconds / 1e6);
+    }
+    disk_close(image);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} benches[] = {
+    {"dispatch", bench_dispatch},   {"translate", bench_translate},
+    {"ram", bench_ram},             {"disk", bench_disk},
+    {"int-loop", bench_int_loop},   {"memcpy", bench_memcpy},
+    {"page-walk", bench_page_walk}, {"syscall", bench_syscall},
+};
+#define N_BENCHES (int) (sizeof(benches) / sizeof(benches[0]))
+
+int main(int argc, char *argv[])
+{
+    int first = 1;
+    if (argc > 1 && !strcmp(argv[1], "--no-jit"))
+        use_jit = false, first++;
+
+    for (int i = 0; i < N_BENCHES; i++) {
+        bool wanted = first == argc;
+        for (int j = first; j < argc; j++)
+            wanted |= !strcmp(argv[j], benches[i].name);
+        if (wanted) {
+            benches[i].run();
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,416 @@
+#define _DEFAULT_SOURCE /* fdatasync */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "io.h"
+
+struct disk_ops {
+    bool (*read)(struct disk_image *image,
+                 void *buf,
+                 const uint64_t len,
+                 const uint64_t offset);
+    bool (*write)(struct disk_image *image,
+                  const void *buf,
+                  const uint64_t len,
+                  const uint64_t offset);
+    /* Push [offset, offset + len) to stable storage; len 0 means all. */
+    bool (*sync)(struct disk_image *image,
+                 const uint64_t offset,
+                 const uint64_t len);
+};
+
+struct disk_image {
+    const struct disk_ops *ops;
+    int fd;
+    uint8_t *map; /* DISK_MMAP only */
+    uint64_t size;
+
+    /* Overlay only: the read-only base image, and which of its clusters
+     * have been copied to the delta file (fd).
+     */
+    struct disk_image *base;
+    uint8_t *bitmap;
+    uint64_t bitmap_offset, data_offset;
+
+    enum disk_sync sync;
+    int interval_ms;
+    pthread_t sync_tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool closing;
+};
+
+static bool file_read(struct disk_image *image,
+                      void *buf,
+                      const uint64_t len,
+                      const uint64_t offset)
+{
+    int64_t done = read_at(image->fd, buf, len, offset);
+    if (done < 0)
+        return false;
+    memset((uint8_t *) buf + done, 0, len - done);
+    return true;
+}
+
+static bool file_write(struct disk_image *image,
+                       const void *buf,
+                       const uint64_t len,
+                       const uint64_t offset)
+{
+    return write_all(image->fd, buf, len, offset);
+}
+
+static bool file_sync(struct disk_image *image,
+                      const uint64_t offset,
+                      const uint64_t len)
+{
+    (void) offset, (void) len;
+    return fdatasync(image->fd) == 0;
+}
+
+static const struct disk_ops file_ops = {file_read, file_write, file_sync};
+
+static bool map_read(struct disk_image *image,
+                     void *buf,
+                     const uint64_t len,
+                     const uint64_t offset)
+{
+    uint64_t n = 0;
+    if (offset < image->size) {
+        n = len < image->size - offset ? len : image->size - offset;
+        memcpy(buf, image->map + offset, n);
+    }
+    memset((uint8_t *) buf + n, 0, len - n);
+    return true;
+}
+
+/* The mapping cannot grow, so writes past the end of the image fail. */
+static bool map_write(struct disk_image *image,
+                      const void *buf,
+                      const uint64_t len,
+                      const uint64_t offset)
+{
+    if (offset > image->size || len > image->size - offset)
+        return false;
+    memcpy(image->map + offset, buf, len);
+    return true;
+}
+
+static bool map_sync(struct disk_image *image,
+                     const uint64_t offset,
+                     const uint64_t len)
+{
+    uint64_t start = 0, end = image->size;
+    if (len) {
+        start = offset & ~((uint64_t) sysconf(_SC_PAGESIZE) - 1);
+        end = offset + len;
+    }
+    return msync(image->map + start, end - start, MS_SYNC) == 0;
+}
+
+static const struct disk_ops map_ops = {map_read, map_write, map_sync};
+
+/* A delta file holds a header, a bitmap of the clusters written so far and
+ * one slot per cluster of the base image at data_offset + cluster offset.
+ * A slot is only filled on the first write to its cluster, so the file
+ * stays sparse, and everything else is read from the base. The header is
+ * in host byte order.
+ */
+#define DISK_CLUSTER_SIZE 4096
+#define DELTA_MAGIC "VSDELTA"
+#define DELTA_VERSION 1
+
+struct delta_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t size; /* of the base image */
+};
+
+static inline bool cow_present(const struct disk_image *image,
+                               const uint64_t cluster)
+{
+    return image->bitmap[cluster / 8] & (1 << (cluster % 8));
+}
+
+static bool cow_read(struct disk_image *image,
+                     void *buf,
+                     const uint64_t len,
+                     const uint64_t offset)
+{
+    uint8_t *p = buf;
+    uint64_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint64_t n = DISK_CLUSTER_SIZE - pos % DISK_CLUSTER_SIZE;
+        if (n > len - done)
+            n = len - done;
+
+        bool ok;
+        if (pos < image->size && cow_present(image, pos / DISK_CLUSTER_SIZE))
+            ok = file_read(image, p + done, n, image->data_offset + pos);
+        else
+            ok = image->base->ops->read(image->base, p + done, n, pos);
+        if (!ok)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+/* Like the mmap backend, an overlay cannot grow past its base. */
+static bool cow_write(struct disk_image *image,
+                      const void *buf,
+                      const uint64_t len,
+                      const uint64_t offset)
+{
+    if (offset > image->size || len > image->size - offset)
+        return false;
+
+    const uint8_t *p = buf;
+    uint64_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done, cluster = pos / DISK_CLUSTER_SIZE;
+        uint64_t n = DISK_CLUSTER_SIZE - pos % DISK_CLUSTER_SIZE;
+        if (n > len - done)
+            n = len - done;
+
+        if (cow_present(image, cluster)) {
+            if (!file_write(image, p + done, n, image->data_offset + pos))
+                return false;
+            done += n;
+            continue;
+        }
+
+        /* First write to the cluster: copy it from the base, then record
+         * it in the bitmap once the data is in place.
+         */
+        uint8_t data[DISK_CLUSTER_SIZE];
+        uint64_t start = cluster * DISK_CLUSTER_SIZE;
+        if (!image->base->ops->read(image->base, data, DISK_CLUSTER_SIZE,
+                                    start))
+            return false;
+        memcpy(data + (pos - start), p + done, n);
+        if (!file_write(image, data, DISK_CLUSTER_SIZE,
+                        image->data_offset + start))
+            return false;
+
+        uint8_t *bits = &image->bitmap[cluster / 8];
+        *bits |= 1 << (cluster % 8);
+        if (!file_write(image, bits, 1, image->bitmap_offset + cluster / 8))
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+static const struct disk_ops cow_ops = {cow_read, cow_write, file_sync};
+
+static void *disk_sync_thread(void *priv)
+{
+    struct disk_image *image = (struct disk_image *) priv;
+
+    pthread_mutex_lock(&image->lock);
+    while (!image->closing) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += image->interval_ms / 1000;
+        ts.tv_nsec += (image->interval_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+            ts.tv_sec++, ts.tv_nsec -= 1000000000L;
+
+        pthread_cond_timedwait(&image->cond, &image->lock, &ts);
+        if (!image->closing)
+            image->ops->sync(image, 0, 0);
+    }
+    pthread_mutex_unlock(&image->lock);
+    return NULL;
+}
+
+static struct disk_image *image_open(const char *path,
+                                     const enum disk_backend backend,
+                                     const bool readonly)
+{
+    int fd = open(path, readonly ? O_RDONLY : O_RDWR);
+    if (fd < 0)
+        return NULL;
+
+    struct disk_image *image = calloc(1, sizeof(struct disk_image));
+    image->fd = fd;
+    image->ops = &file_ops;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        goto fail;
+    image->size = st.st_size;
+
+    if (backend == DISK_MMAP) {
+        if (image->size == 0)
+            goto fail;
+        image->map = mmap(NULL, image->size,
+                          readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+        if (image->map == MAP_FAILED)
+            goto fail;
+        image->ops = &map_ops;
+    }
+    return image;
+
+fail:
+    close(fd);
+    free(image);
+    return NULL;
+}
+
+/* Open the delta file at path over base, creating it if it is empty. */
+static struct disk_image *overlay_open(const char *path,
+                                       struct disk_image *base)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return NULL;
+
+    struct disk_image *image = calloc(1, sizeof(struct disk_image));
+    image->fd = fd;
+    image->ops = &cow_ops;
+    image->base = base;
+    image->size = base->size;
+
+    uint64_t clusters =
+        (image->size + DISK_CLUSTER_SIZE - 1) / DISK_CLUSTER_SIZE;
+    uint64_t bitmap_size = (clusters + 7) / 8;
+    image->bitmap = calloc(1, bitmap_size);
+    image->bitmap_offset = DISK_CLUSTER_SIZE;
+    image->data_offset =
+        image->bitmap_offset +
+        (bitmap_size + DISK_CLUSTER_SIZE - 1) / DISK_CLUSTER_SIZE *
+            DISK_CLUSTER_SIZE;
+
+    struct delta_header header;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        goto fail;
+
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+        header.version = DELTA_VERSION;
+        header.cluster_size = DISK_CLUSTER_SIZE;
+        header.size = image->size;
+        if (!file_write(image, &header, sizeof(header), 0) ||
+            ftruncate(fd, image->data_offset + clusters * DISK_CLUSTER_SIZE))
+            goto fail;
+    } else {
+        if (!file_read(image, &header, sizeof(header), 0) ||
+            memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) ||
+            header.version != DELTA_VERSION ||
+            header.cluster_size != DISK_CLUSTER_SIZE ||
+            header.size != image->size)
+            goto fail;
+        if (!file_read(image, image->bitmap, bitmap_size,
+                       image->bitmap_offset))
+            goto fail;
+    }
+    return image;
+
+fail:
+    close(fd);
+    free(image->bitmap);
+    free(image);
+    return NULL;
+}
+
+static void image_close(struct disk_image *image)
+{
+    if (image->map)
+        munmap(image->map, image->size);
+    if (image->base)
+        image_close(image->base);
+    close(image->fd);
+    free(image->bitmap);
+    free(image);
+}
+
+struct disk_image *disk_open(const char *path,
+                             const char *overlay,
+                             const enum disk_backend backend,
+                             const enum disk_sync sync,
+                             const int interval_ms)
+{
+    struct disk_image *image = image_open(path, backend, overlay != NULL);
+    if (!image)
+        return NULL;
+
+    if (overlay) {
+        struct disk_image *base = image;
+        if (!(image = overlay_open(overlay, base))) {
+            image_close(base);
+            return NULL;
+        }
+    }
+
+    image->sync = sync;
+    image->interval_ms = interval_ms;
+    if (sync == DISK_SYNC_PERIODIC) {
+        pthread_mutex_init(&image->lock, NULL);
+        pthread_cond_init(&image->cond, NULL);
+        pthread_create(&image->sync_tid, NULL, disk_sync_thread,
+                       (void *) image);
+    }
+    return image;
+}
+
+/* Whatever the policy, everything is written back here. */
+void disk_close(struct disk_image *image)
+{
+    if (image->sync == DISK_SYNC_PERIODIC) {
+        pthread_mutex_lock(&image->lock);
+        image->closing = true;
+        pthread_cond_signal(&image->cond);
+        pthread_mutex_unlock(&image->lock);
+        pthread_join(image->sync_tid, NULL);
+    }
+
+    image->ops->sync(image, 0, 0);
+    image_close(image);
+}
+
+bool disk_read(struct disk_image *image,
+               void *buf,
+               const uint64_t len,
+               const uint64_t offset)
+{
+    return image->ops->read(image, buf, len, offset);
+}
+
+bool disk_write(struct disk_image *image,
+                const void *buf,
+                const uint64_t len,
+                const uint64_t offset)
+{
+    if (!image->ops->write(image, buf, len, offset))
+        return false;
+    if (image->sync == DISK_SYNC_WRITE)
+        return image->ops->sync(image, offset, len);
+    return true;
+}
+
+bool disk_flush(struct disk_image *image)
+{
+    return image->ops->sync(image, 0, 0);
+}
+
+uint64_t disk_size(const struct disk_image *image)
+{
+    return image->size;
+}
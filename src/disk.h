@@ -0,0 +1,44 @@
+#pragma once
+
+/* Backing store of the virtual disk. The file backend reads and writes the
+ * image with pread()/pwrite(); the mmap backend maps the whole image and
+ * copies to and from the mapping. With an overlay, the image is opened
+ * read-only with either backend and written clusters go to a sparse delta
+ * file instead, so instances can share one base image.
+ */
+enum disk_backend { DISK_FILE, DISK_MMAP };
+
+/* When written data is pushed to stable storage: only when the image is
+ * closed, every sync interval, or after every write.
+ */
+enum disk_sync { DISK_SYNC_EXIT, DISK_SYNC_PERIODIC, DISK_SYNC_WRITE };
+
+#define DISK_SYNC_INTERVAL_MS 1000
+
+struct disk_image;
+
+/* overlay is the path of the delta file, or NULL to write the image in
+ * place.
+ */
+struct disk_image *disk_open(const char *path,
+                             const char *overlay,
+                             const enum disk_backend backend,
+                             const enum disk_sync sync,
+                             const int interval_ms);
+void disk_close(struct disk_image *image);
+
+/* Move len bytes at byte offset of the image. Reads past the end of the
+ * image return zeroes. Both return false on an I/O error.
+ */
+bool disk_read(struct disk_image *image,
+               void *buf,
+               const uint64_t len,
+               const uint64_t offset);
+bool disk_write(struct disk_image *image,
+                const void *buf,
+                const uint64_t len,
+                const uint64_t offset);
+
+/* Push everything written so far to stable storage, whatever the policy. */
+bool disk_flush(struct disk_image *image);
+uint64_t disk_size(const struct disk_image *image);
@@ -0,0 +1,297 @@
+#define _DEFAULT_SOURCE /* nanosleep */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "loader.h"
+#include "semu.h"
+#include "snapshot.h"
+#include "fleet.h"
+#if defined(JIT)
+#include "jit.h"
+#endif
+
+/* How long a thread naps once every machine it ran in a row was in wfi. */
+#define FLEET_NAP_NS 1000000
+
+enum machine_state { MACHINE_RUNNING, MACHINE_EXIT, MACHINE_LIMIT, MACHINE_FAULT };
+
+struct machine {
+    struct cpu *cpu;
+    struct disk_image *disk;
+    double synced; /* when the disk was last synced, with periodic sync */
+    int console_fd;
+    uint64_t retired;
+    enum machine_state state;
+    int code; /* exit code, or cause of the fault */
+};
+
+/* Machines waiting for a thread: the owner runs them from the front and
+ * puts them back at the end, others steal from the end.
+ */
+struct worker {
+    struct fleet *fleet;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    int *ring;
+    unsigned head, len;
+};
+
+struct fleet {
+    const struct fleet_config *config;
+    struct machine *machines;
+    struct worker *workers;
+    int nworkers;
+    int running; /* machines that have not stopped */
+};
+
+static void worker_push(struct worker *w, const int m)
+{
+    unsigned n = w->fleet->config->vms;
+    pthread_mutex_lock(&w->lock);
+    w->ring[(w->head + w->len++) % n] = m;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static int worker_pop(struct worker *w, const bool steal)
+{
+    unsigned n = w->fleet->config->vms;
+    int m = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->len && steal) {
+        m = w->ring[(w->head + --w->len) % n];
+    } else if (w->len) {
+        m = w->ring[w->head];
+        w->head = (w->head + 1) % n, w->len--;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return m;
+}
+
+/* The next machine for w to run, its own or stolen; -1 if there is none. */
+static int worker_take(struct worker *w)
+{
+    struct fleet *fleet = w->fleet;
+    int m = worker_pop(w, false);
+    int self = w - fleet->workers;
+    for (int i = 1; m < 0 && i < fleet->nworkers; i++)
+        m = worker_pop(&fleet->workers[(self + i) % fleet->nworkers], true);
+    return m;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void machine_setup(struct fleet *fleet, const int i)
+{
+    const struct fleet_config *config = fleet->config;
+    struct machine *m = &fleet->machines[i];
+    char path[4096];
+
+    struct ram *ram = ram_new(config->mem, config->thp);
+    if (!ram)
+        fatal("allocate RAM");
+    uint64_t entry = RAM_BASE;
+    if (config->kernel && !load_kernel(ram, config->kernel, &entry))
+        fatal("load kernel image");
+
+    if (config->disk) {
+        /* Every run starts from the base image. Periodic syncs are left to
+         * the worker rather than a thread per image.
+         */
+        snprintf(path, sizeof(path), "%s/vm%d.delta", config->dir, i);
+        if (unlink(path) < 0 && errno != ENOENT)
+            fatal("remove an old disk overlay");
+        m->disk = disk_open(config->disk, path, config->disk_backend,
+                            config->disk_sync == DISK_SYNC_PERIODIC
+                                ? DISK_SYNC_EXIT
+                                : config->disk_sync,
+                            config->disk_sync_interval);
+        if (!m->disk)
+            fatal("open disk image");
+        m->synced = now();
+    }
+
+    m->cpu = cpu_new_pooled(ram, entry, m->disk);
+    bus_set_clock(m->cpu->bus, config->clock);
+    if (config->restore && !snapshot_restore(m->cpu, config->restore))
+        fatal("restore the snapshot");
+
+    snprintf(path, sizeof(path), "%s/vm%d.console", config->dir, i);
+    if ((m->console_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        fatal("open console log");
+    uart_console(m->cpu->bus->uart, m->console_fd, config->console_flush);
+#if defined(JIT)
+    if (config->jit)
+        m->cpu->jit = jit_new(false);
+#endif
+}
+
+/* Run m for a quantum, or until its hart waits for an interrupt. Returns
+ * true once the machine has stopped.
+ */
+static bool machine_run(const struct fleet_config *config, struct machine *m)
+{
+    struct cpu *cpu = m->cpu;
+    struct syscon *syscon = cpu->bus->syscon;
+    int left = FLEET_QUANTUM;
+    if (config->max_insns && config->max_insns - m->retired < (uint64_t) left)
+        left = config->max_insns - m->retired;
+
+    while (left > 0 && !syscon->off) {
+        exception_t e;
+        int n = cpu_execute_block(cpu, left, &e);
+        left -= n, m->retired += n;
+        if (e != OK) {
+            cpu_take_trap(cpu, e, NONE);
+            if (exception_is_fatal(e)) {
+                m->state = MACHINE_FAULT, m->code = e;
+                return true;
+            }
+        }
+
+        interrupt_t intr;
+        if ((intr = cpu_check_pending_interrupt(cpu)) != NONE)
+            cpu_take_trap(cpu, OK, intr);
+        if (cpu->wfi)
+            break;
+    }
+    /* There is nowhere to save snapshots to. */
+    syscon->snapshot = false;
+
+    /* The machine has no threads of its own to do this meanwhile. */
+    uart_pump(cpu->bus->uart);
+    if (m->disk && config->disk_sync == DISK_SYNC_PERIODIC &&
+        now() - m->synced >= config->disk_sync_interval / 1e3) {
+        if (!disk_flush(m->disk))
+            fatal("sync the disk");
+        m->synced = now();
+    }
+
+    if (syscon->off)
+        m->state = MACHINE_EXIT, m->code = syscon->exit_code;
+    else if (config->max_insns && m->retired >= config->max_insns)
+        m->state = MACHINE_LIMIT;
+    return m->state != MACHINE_RUNNING;
+}
+
+static void machine_finish(const struct fleet *fleet, const int i)
+{
+    struct machine *m = &fleet->machines[i];
+    uart_close(m->cpu->bus->uart);
+    close(m->console_fd);
+    if (m->disk) {
+        disk_drain(m->cpu->bus->disk);
+        disk_close(m->disk);
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/vm%d.status", fleet->config->dir, i);
+    FILE *f = fopen(path, "w");
+    if (!f)
+        fatal("write a machine status");
+    if (m->state == MACHINE_EXIT)
+        fprintf(f, "exit %d\n", m->code);
+    else if (m->state == MACHINE_LIMIT)
+        fputs("limit\n", f);
+    else
+        fprintf(f, "fault %d\n", m->code);
+    if (fclose(f) == EOF)
+        fatal("write a machine status");
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct fleet *fleet = w->fleet;
+    const struct timespec nap = {0, FLEET_NAP_NS};
+    int idle = 0;
+
+    while (__atomic_load_n(&fleet->running, __ATOMIC_ACQUIRE) > 0) {
+        int i = worker_take(w);
+        if (i < 0) {
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        struct machine *m = &fleet->machines[i];
+        if (machine_run(fleet->config, m)) {
+            machine_finish(fleet, i);
+            __atomic_sub_fetch(&fleet->running, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        worker_push(w, i);
+
+        /* Rather than spin through idle machines, give host time a chance
+         * to reach their next event.
+         */
+        idle = m->cpu->wfi ? idle + 1 : 0;
+        if (idle >= fleet->config->vms) {
+            nanosleep(&nap, NULL);
+            idle = 0;
+        }
+    }
+    return NULL;
+}
+
+int fleet_run(const struct fleet_config *config)
+{
+    struct fleet fleet = {.config = config, .running = config->vms};
+    if (mkdir(config->dir, 0755) < 0 && errno != EEXIST)
+        fatal("create the machine directory");
+
+    fleet.machines = calloc(config->vms, sizeof(struct machine));
+    for (int i = 0; i < config->vms; i++)
+        machine_setup(&fleet, i);
+
+    fleet.nworkers = config->threads;
+    if (!fleet.nworkers && (fleet.nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        fleet.nworkers = 1;
+    if (fleet.nworkers > config->vms)
+        fleet.nworkers = config->vms;
+    fleet.workers = calloc(fleet.nworkers, sizeof(struct worker));
+    for (int i = 0; i < fleet.nworkers; i++) {
+        fleet.workers[i].fleet = &fleet;
+        fleet.workers[i].ring = malloc(config->vms * sizeof(int));
+        pthread_mutex_init(&fleet.workers[i].lock, NULL);
+    }
+    for (int i = 0; i < config->vms; i++)
+        worker_push(&fleet.workers[i % fleet.nworkers], i);
+
+    double start = now();
+    for (int i = 0; i < fleet.nworkers; i++)
+        pthread_create(&fleet.workers[i].tid, NULL, worker_thread,
+                       &fleet.workers[i]);
+    for (int i = 0; i < fleet.nworkers; i++)
+        pthread_join(fleet.workers[i].tid, NULL);
+    double elapsed = now() - start;
+
+    uint64_t total = 0;
+    int failed = 0;
+    for (int i = 0; i < config->vms; i++) {
+        const struct machine *m = &fleet.machines[i];
+        total += m->retired;
+        if (m->state != MACHINE_EXIT || m->code)
+            failed++;
+    }
+    fprintf(stderr,
+            "%d machines on %d threads: %" PRIu64
+            " instructions in %.2f s (%.2f MIPS), %d failed\n",
+            config->vms, fleet.nworkers, total, elapsed,
+            elapsed > 0 ? total / elapsed / 1e6 : 0.0, failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+/* Many independent machines in one process, for running test suites: each
+ * has one hart, its own RAM, devices and console, and they take turns on a
+ * pool of host threads, a quantum of instructions at a time. A thread runs
+ * the machines in its own queue in turn and steals from the others when it
+ * has none left. Machines have no host threads of their own, so that thread
+ * also serves their disk requests and writes out their consoles. Machines
+ * share the kernel (or snapshot) and the base disk image through the page
+ * cache, as both are mapped copy-on-write or read through a per-machine
+ * overlay.
+ *
+ * Machine i writes its console to <dir>/vm<i>.console, its disk writes to
+ * <dir>/vm<i>.delta, started afresh, and, when it stops, its outcome to
+ * <dir>/vm<i>.status: "exit <code>" when the guest powered off, "limit"
+ * when it reached max_insns, or "fault <cause>" on a fatal exception.
+ */
+#define FLEET_QUANTUM 100000
+
+struct fleet_config {
+    int vms, threads; /* threads 0 means one per online CPU */
+    const char *dir;
+
+    const char *kernel, *restore; /* exactly one is set */
+    uint64_t mem;
+    bool thp;
+
+    const char *disk; /* base image, or NULL */
+    enum disk_backend disk_backend;
+    enum disk_sync disk_sync;
+    int disk_sync_interval;
+
+    enum sched_clock clock;
+    enum uart_flush console_flush;
+    uint64_t max_insns; /* per machine; 0 means no limit */
+    bool jit;
+};
+
+/* Runs every machine to the end, then prints a summary to stderr. Returns
+ * 0 if all of them powered off with status 0, and 1 otherwise.
+ */
+int fleet_run(const struct fleet_config *config);
@@ -14,7 +14,26 @@
 
 extern struct cpu *cpu;
 
-void draw_framebuffer(struct Screen *screen) {
+/* Upload each run of scanlines the guest wrote since the last frame. */
+bool draw_framebuffer(struct Screen *screen) {
+    uint64_t lines[(FRAMEBUFFER_HEIGHT + 63) / 64];
+    if (!ram_take_dirty_lines(cpu->bus->ram, lines))
+        return false;
+
     SDL_Texture *texture = ScreenGetTexture(screen);
-    SDL_UpdateTexture(texture, NULL, &cpu->bus->ram->data[FRAMEBUFFER_BASE - RAM_BASE], FRAMEBUFFER_WIDTH * 4);
+    const uint8_t *fb = &cpu->bus->ram->data[FRAMEBUFFER_BASE - RAM_BASE];
+    int y = 0;
+    while (y < FRAMEBUFFER_HEIGHT) {
+        if (!(lines[y / 64] & (1ULL << (y % 64)))) {
+            y++;
+            continue;
+        }
+        int start = y;
+        while (y < FRAMEBUFFER_HEIGHT && (lines[y / 64] & (1ULL << (y % 64))))
+            y++;
+
+        SDL_Rect rect = {0, start, FRAMEBUFFER_WIDTH, y - start};
+        SDL_UpdateTexture(texture, &rect, fb + start * FRAMEBUFFER_PITCH, FRAMEBUFFER_PITCH);
+    }
+    return true;
 }
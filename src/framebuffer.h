@@ -2,7 +2,4 @@
 
 #include "screen.h"
 
-#define FRAMEBUFFER_WIDTH  640
-#define FRAMEBUFFER_HEIGHT 480
-
-void draw_framebuffer(struct Screen *screen);
+bool draw_framebuffer(struct Screen *screen);
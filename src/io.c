@@ -0,0 +1,52 @@
+#define _DEFAULT_SOURCE /* pread, pwrite */
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "io.h"
+
+int64_t read_at(const int fd,
+                void *buf,
+                const uint64_t len,
+                const uint64_t offset)
+{
+    uint8_t *p = buf;
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, p + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+bool read_all(const int fd,
+              void *buf,
+              const uint64_t len,
+              const uint64_t offset)
+{
+    return read_at(fd, buf, len, offset) == (int64_t) len;
+}
+
+bool write_all(const int fd,
+               const void *buf,
+               const uint64_t len,
+               const uint64_t offset)
+{
+    const uint8_t *p = buf;
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, p + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
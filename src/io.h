@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Positioned file I/O that retries interrupted and short transfers.
+ * read_at returns how much of [offset, offset + len) it read before the end
+ * of the file, or -1 on an error; read_all and write_all return false unless
+ * all of it was transferred.
+ */
+int64_t read_at(const int fd,
+                void *buf,
+                const uint64_t len,
+                const uint64_t offset);
+bool read_all(const int fd,
+              void *buf,
+              const uint64_t len,
+              const uint64_t offset);
+bool write_all(const int fd,
+               const void *buf,
+               const uint64_t len,
+               const uint64_t offset);
@@ -0,0 +1,966 @@
+// Dynamic binary translator from RV64IMA to x86-64. Compressed (RVC)
+// instructions are translated in their expanded form. F/D, CSR and system
+// instructions, and loads and stores outside RAM, hand the block back to the
+// interpreter at that instruction.
+
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "semu.h"
+#include "jit.h"
+
+#define MIN(a, b)               \
+    ({                          \
+        __typeof__(a) _a = (a); \
+        __typeof__(b) _b = (b); \
+        _a < _b ? _a : _b;      \
+    })
+
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+#define JIT_MAX_BLOCKS 16384
+
+/* Not an exception: translated code stopped in front of an instruction it
+ * cannot run, and the interpreter carries on from there.
+ */
+#define JIT_BAIL ((exception_t) 64)
+
+/* How translated code left, filled in by the code itself. */
+struct jit_exit {
+    exception_t e;
+    int index;           /* JIT_BAIL: instruction to resume at */
+    struct block *block; /* JIT_BAIL: block to resume in */
+    uint8_t *chain;      /* OK: unlinked jump taken to get out, or NULL */
+    uint64_t chain_pa;   /* OK: physical address that jump goes to */
+};
+
+/* Runs code with the given instruction budget and returns the number of
+ * instructions retired, counting one that raised an exception.
+ */
+typedef int (*jit_enter_t)(struct cpu *cpu,
+                           const void *code,
+                           int64_t budget,
+                           struct jit_exit *exit);
+
+struct jit {
+    uint8_t *code; /* JIT_CODE_SIZE bytes of executable memory */
+    size_t used, base; /* bytes in use, and used by the trampolines */
+    jit_enter_t enter;
+    const uint8_t *leave;
+
+    /* Translated code refers to copies of its decoded instructions, since
+     * the block cache may reuse a slot while code linked to the block it
+     * held can still run.
+     */
+    struct block *blocks;
+    int n_blocks;
+
+    /* Jump to link to the next block run, if that is the one it targets. */
+    uint8_t *chain;
+    uint64_t chain_pa;
+
+    bool diff;
+    struct jit_journal journal[2];
+
+    uint64_t translated, flushes, runs, bails, links, diffs;
+};
+
+static inline bool in_ram(const struct ram *ram, const uint64_t pa)
+{
+    return pa >= RAM_BASE && pa - RAM_BASE < ram->size;
+}
+
+/* Memory instructions as called from translated code. They give up before
+ * touching anything that is not RAM, so that MMIO side effects only ever
+ * happen in the interpreter.
+ */
+#define JIT_LOAD(name, size, type)                                          \
+    static exception_t jit_##name(struct cpu *cpu, const struct insn *insn) \
+    {                                                                       \
+        uint64_t pa, result;                                                \
+        uint64_t addr = cpu->regs[insn->rs1] + insn->imm;                   \
+        exception_t e = cpu_translate(cpu, addr, LOAD_PAGE_FAULT, &pa);     \
+        if (e != OK)                                                        \
+            return e;                                                       \
+        if (!in_ram(cpu->bus->ram, pa))                                     \
+            return JIT_BAIL;                                                \
+        if ((e = bus_load(cpu->bus, pa, size, &result)) != OK)              \
+            return e;                                                       \
+        cpu->regs[insn->rd] = (type) result;                                \
+        return OK;                                                          \
+    }
+
+#define JIT_STORE(name, size)                                               \
+    static exception_t jit_##name(struct cpu *cpu, const struct insn *insn) \
+    {                                                                       \
+        uint64_t pa;                                                        \
+        uint64_t addr = cpu->regs[insn->rs1] + insn->imm;                   \
+        exception_t e =                                                     \
+            cpu_translate(cpu, addr, STORE_AMO_PAGE_FAULT, &pa);            \
+        if (e != OK)                                                        \
+            return e;                                                       \
+        if (!in_ram(cpu->bus->ram, pa))                                     \
+            return JIT_BAIL;                                                \
+        return bus_store(cpu->bus, pa, size, cpu->regs[insn->rs2]);         \
+    }
+
+JIT_LOAD(lb, 8, int8_t)
+JIT_LOAD(lh, 16, int16_t)
+JIT_LOAD(lw, 32, int32_t)
+JIT_LOAD(ld, 64, uint64_t)
+JIT_LOAD(lbu, 8, uint8_t)
+JIT_LOAD(lhu, 16, uint16_t)
+JIT_LOAD(lwu, 32, uint32_t)
+JIT_STORE(sb, 8)
+JIT_STORE(sh, 16)
+JIT_STORE(sw, 32)
+JIT_STORE(sd, 64)
+
+/* Faults and misalignment are left for the handler to report. */
+static exception_t jit_amo(struct cpu *cpu, const struct insn *insn)
+{
+    uint64_t pa;
+    if (cpu_translate(cpu, cpu->regs[insn->rs1], STORE_AMO_PAGE_FAULT, &pa) ==
+            OK &&
+        !in_ram(cpu->bus->ram, pa))
+        return JIT_BAIL;
+    return insn->handler(cpu, insn);
+}
+
+#define AMO_HELPER(name) [OP_##name] = jit_amo,
+static const insn_handler_t mem_helpers[N_OPS] = {
+    [OP_lb] = jit_lb,   [OP_lh] = jit_lh,   [OP_lw] = jit_lw,
+    [OP_ld] = jit_ld,   [OP_lbu] = jit_lbu, [OP_lhu] = jit_lhu,
+    [OP_lwu] = jit_lwu, [OP_sb] = jit_sb,   [OP_sh] = jit_sh,
+    [OP_sw] = jit_sw,   [OP_sd] = jit_sd,
+    AMO_HELPER(lr_w) AMO_HELPER(sc_w) AMO_HELPER(lr_d) AMO_HELPER(sc_d)
+    AMO_HELPER(amoadd_w) AMO_HELPER(amoswap_w) AMO_HELPER(amoxor_w)
+    AMO_HELPER(amoor_w) AMO_HELPER(amoand_w) AMO_HELPER(amomin_w)
+    AMO_HELPER(amomax_w) AMO_HELPER(amominu_w) AMO_HELPER(amomaxu_w)
+    AMO_HELPER(amoadd_d) AMO_HELPER(amoswap_d) AMO_HELPER(amoxor_d)
+    AMO_HELPER(amoor_d) AMO_HELPER(amoand_d) AMO_HELPER(amomin_d)
+    AMO_HELPER(amomax_d) AMO_HELPER(amominu_d) AMO_HELPER(amomaxu_d)
+};
+#undef AMO_HELPER
+
+void jit_journal_store(struct jit_journal *journal,
+                       const struct ram *ram,
+                       const uint64_t addr,
+                       const uint64_t size,
+                       const uint64_t value)
+{
+    if (journal->len == JOURNAL_SIZE || !in_ram(ram, addr))
+        return;
+
+    uint64_t old = 0;
+    memcpy(&old, ram->data + addr - RAM_BASE, size / 8);
+    journal->stores[journal->len].addr = addr;
+    journal->stores[journal->len].size = size;
+    journal->stores[journal->len].old = old;
+    journal->stores[journal->len].value = value & (UINT64_MAX >> (64 - size));
+    journal->len++;
+}
+
+#if defined(__x86_64__)
+
+/* Code generation. Translated code runs with the struct cpu in rbx, the
+ * struct jit_exit in r15, the instructions retired so far in r13 and the
+ * budget in r14; rax, rcx and rdx are scratch. The guest PC in memory holds
+ * the address of the block's first instruction on entry and is brought up to
+ * date only before helper calls and exits.
+ */
+enum { RAX = 0, RCX = 1, RDX = 2 };
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5 };
+enum { CC_L = 0xc, CC_GE = 0xd, CC_G = 0xf };
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6 };
+enum { ALU_CMP = 7, SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+
+#define REG(r) ((uint32_t) (offsetof(struct cpu, regs) + 8 * (r)))
+#define PC ((uint32_t) offsetof(struct cpu, pc))
+#define EXIT(field) ((uint8_t) offsetof(struct jit_exit, field))
+
+struct emitter {
+    uint8_t *p, *end;
+    bool full;
+};
+
+static void emit_bytes(struct emitter *em, const uint8_t *bytes, size_t n)
+{
+    if ((size_t) (em->end - em->p) < n) {
+        em->full = true;
+        return;
+    }
+    memcpy(em->p, bytes, n);
+    em->p += n;
+}
+
+#define EMIT(em, ...)                                        \
+    emit_bytes(em, (const uint8_t[]){__VA_ARGS__},           \
+               sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(struct emitter *em, const uint32_t v)
+{
+    EMIT(em, v, v >> 8, v >> 16, v >> 24);
+}
+
+static void emit64(struct emitter *em, const uint64_t v)
+{
+    emit32(em, v);
+    emit32(em, v >> 32);
+}
+
+static void patch(uint8_t *rel, const uint8_t *target)
+{
+    int32_t v = target - (rel + 4);
+    memcpy(rel, &v, 4);
+}
+
+/* jmp/jcc rel32; returns the displacement so it can be patched later. */
+static uint8_t *emit_jmp(struct emitter *em, const uint8_t *target)
+{
+    EMIT(em, 0xe9);
+    uint8_t *rel = em->p;
+    emit32(em, 0);
+    if (!em->full && target)
+        patch(rel, target);
+    return rel;
+}
+
+static uint8_t *emit_jcc(struct emitter *em, const int cc)
+{
+    EMIT(em, 0x0f, 0x80 | cc);
+    uint8_t *rel = em->p;
+    emit32(em, 0);
+    return rel;
+}
+
+static void emit_bind(struct emitter *em, uint8_t *rel)
+{
+    if (!em->full)
+        patch(rel, em->p);
+}
+
+static void emit_mov_imm(struct emitter *em, const int host, const uint64_t v)
+{
+    EMIT(em, 0x48, 0xb8 | host);
+    emit64(em, v);
+}
+
+/* host = x[r] */
+static void emit_load(struct emitter *em, const int host, const int r)
+{
+    if (r == 0) {
+        EMIT(em, 0x31, 0xc0 | host << 3 | host);
+        return;
+    }
+    EMIT(em, 0x48, 0x8b, 0x83 | host << 3);
+    emit32(em, REG(r));
+}
+
+/* x[r] = host */
+static void emit_store(struct emitter *em, const int host, const int r)
+{
+    if (r == 0)
+        return;
+    EMIT(em, 0x48, 0x89, 0x83 | host << 3);
+    emit32(em, REG(r));
+}
+
+static void emit_zero_x0(struct emitter *em)
+{
+    EMIT(em, 0x48, 0xc7, 0x83);
+    emit32(em, REG(0));
+    emit32(em, 0);
+}
+
+/* op rax, rcx and op rax, imm32; the 32-bit forms operate on eax. */
+static void emit_alu(struct emitter *em, const bool w, const int alu)
+{
+    static const uint8_t opcodes[8] = {
+        [ALU_ADD] = 0x01, [ALU_OR] = 0x09,  [ALU_AND] = 0x21,
+        [ALU_SUB] = 0x29, [ALU_XOR] = 0x31, [ALU_CMP] = 0x39,
+    };
+    if (w)
+        EMIT(em, 0x48);
+    EMIT(em, opcodes[alu], 0xc8);
+}
+
+static void emit_alu_imm(struct emitter *em,
+                         const bool w,
+                         const int alu,
+                         const int32_t imm)
+{
+    if (w)
+        EMIT(em, 0x48);
+    EMIT(em, 0x81, 0xc0 | alu << 3);
+    emit32(em, imm);
+}
+
+static void emit_shift(struct emitter *em, const bool w, const int op)
+{
+    if (w)
+        EMIT(em, 0x48);
+    EMIT(em, 0xd3, 0xc0 | op << 3);
+}
+
+static void emit_shift_imm(struct emitter *em,
+                           const bool w,
+                           const int op,
+                           const int n)
+{
+    if (w)
+        EMIT(em, 0x48);
+    EMIT(em, 0xc1, 0xc0 | op << 3, n);
+}
+
+/* rax = (int32_t) eax */
+static void emit_sext32(struct emitter *em)
+{
+    EMIT(em, 0x48, 0x63, 0xc0);
+}
+
+/* rax = flag */
+static void emit_setcc(struct emitter *em, const int cc)
+{
+    EMIT(em, 0x0f, 0x90 | cc, 0xc0, 0x0f, 0xb6, 0xc0);
+}
+
+static void emit_add_rax(struct emitter *em, const int64_t v)
+{
+    if (v == (int32_t) v) {
+        emit_alu_imm(em, true, ALU_ADD, v);
+    } else {
+        emit_mov_imm(em, RCX, v);
+        emit_alu(em, true, ALU_ADD);
+    }
+}
+
+static void emit_add_pc(struct emitter *em, const int32_t delta)
+{
+    if (!delta)
+        return;
+    EMIT(em, 0x48, 0x81, 0x83);
+    emit32(em, PC);
+    emit32(em, delta);
+}
+
+/* rax = address of the instruction at off, given that cpu->pc holds the
+ * block start plus synced.
+ */
+static void emit_pc(struct emitter *em, const int synced, const int64_t off)
+{
+    EMIT(em, 0x48, 0x8b, 0x83);
+    emit32(em, PC);
+    emit_add_rax(em, off - synced);
+}
+
+static void emit_sub_retired(struct emitter *em, const int n)
+{
+    if (!n)
+        return;
+    EMIT(em, 0x49, 0x81, 0xed);
+    emit32(em, n);
+}
+
+static void emit_call(struct emitter *em,
+                      const insn_handler_t fn,
+                      const struct insn *insn)
+{
+    EMIT(em, 0x48, 0x89, 0xdf); /* mov rdi, rbx */
+    EMIT(em, 0x48, 0xbe);       /* mov rsi, insn */
+    emit64(em, (uintptr_t) insn);
+    emit_mov_imm(em, RAX, (uintptr_t) fn);
+    EMIT(em, 0xff, 0xd0); /* call rax */
+}
+
+static void emit_leave_ok(const struct jit *jit, struct emitter *em)
+{
+    EMIT(em, 0x49, 0xc7, 0x47, EXIT(chain));
+    emit32(em, 0);
+    EMIT(em, 0x41, 0xc7, 0x47, EXIT(e));
+    emit32(em, OK);
+    emit_jmp(em, jit->leave);
+}
+
+/* Hand the block over to the interpreter at insns[i]; cpu->pc must point at
+ * that instruction.
+ */
+static void emit_bail(const struct jit *jit,
+                      struct emitter *em,
+                      const struct block *block,
+                      const int i)
+{
+    emit_sub_retired(em, block->len - i);
+    EMIT(em, 0x41, 0xc7, 0x47, EXIT(e));
+    emit32(em, JIT_BAIL);
+    EMIT(em, 0x41, 0xc7, 0x47, EXIT(index));
+    emit32(em, i);
+    emit_mov_imm(em, RAX, (uintptr_t) block);
+    EMIT(em, 0x49, 0x89, 0x47, EXIT(block));
+    emit_jmp(em, jit->leave);
+}
+
+/* Continue at block start + target. Targets in the same page are reached
+ * through a jump that starts out leaving to the dispatcher and is linked to
+ * the target's code once that exists. Such a link never needs undoing on
+ * address translation changes: both ends sit in one page, whatever virtual
+ * page it is mapped at.
+ */
+static void emit_goto(const struct jit *jit,
+                      struct emitter *em,
+                      const struct block *block,
+                      const int synced,
+                      const int64_t target)
+{
+    emit_add_pc(em, target - synced);
+
+    int64_t in_page = (int64_t) (block->pa % PAGE_SIZE) + target;
+    if (in_page < 0 || in_page >= PAGE_SIZE || target % 2) {
+        emit_leave_ok(jit, em);
+        return;
+    }
+
+    uint8_t *rel = emit_jmp(em, NULL);
+    emit_bind(em, rel);
+    emit_mov_imm(em, RAX, (uintptr_t) rel);
+    EMIT(em, 0x49, 0x89, 0x47, EXIT(chain));
+    emit_mov_imm(em, RAX, block->pa + target);
+    EMIT(em, 0x49, 0x89, 0x47, EXIT(chain_pa));
+    EMIT(em, 0x41, 0xc7, 0x47, EXIT(e));
+    emit32(em, OK);
+    emit_jmp(em, jit->leave);
+}
+
+static void emit_trampolines(struct jit *jit, struct emitter *em)
+{
+    jit->enter = (jit_enter_t) em->p;
+    EMIT(em, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+    EMIT(em, 0x48, 0x89, 0xfb); /* mov rbx, rdi */
+    EMIT(em, 0x49, 0x89, 0xd6); /* mov r14, rdx */
+    EMIT(em, 0x49, 0x89, 0xcf); /* mov r15, rcx */
+    EMIT(em, 0x45, 0x31, 0xed); /* xor r13d, r13d */
+    emit_zero_x0(em);
+    EMIT(em, 0xff, 0xe6); /* jmp rsi */
+
+    jit->leave = em->p;
+    EMIT(em, 0x44, 0x89, 0xe8); /* mov eax, r13d */
+    EMIT(em, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+}
+
+static bool is_alu_op(const uint8_t op)
+{
+    switch (op) {
+    case OP_lui: case OP_auipc: case OP_addi: case OP_slti: case OP_sltiu:
+    case OP_xori: case OP_ori: case OP_andi: case OP_slli: case OP_srli:
+    case OP_srai: case OP_addiw: case OP_slliw: case OP_srliw: case OP_sraiw:
+    case OP_add: case OP_sub: case OP_sll: case OP_slt: case OP_sltu:
+    case OP_xor: case OP_srl: case OP_sra: case OP_or: case OP_and:
+    case OP_addw: case OP_subw: case OP_sllw: case OP_srlw: case OP_sraw:
+    case OP_mul: case OP_mulw: case OP_mulh: case OP_mulhu: case OP_mulhsu:
+    case OP_div: case OP_divu: case OP_rem: case OP_remu: case OP_divw:
+    case OP_divuw: case OP_remw: case OP_remuw:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_translated(const uint8_t op)
+{
+    switch (op) {
+    case OP_fence: case OP_beq: case OP_bne: case OP_blt: case OP_bge:
+    case OP_bltu: case OP_bgeu: case OP_jal: case OP_jalr:
+        return true;
+    default:
+        return is_alu_op(op) || mem_helpers[op];
+    }
+}
+
+/* Register-only instructions that never fault. */
+static void emit_alu_insn(struct emitter *em,
+                          const struct insn *insn,
+                          const int synced,
+                          const int off)
+{
+    static const uint8_t alu_imm[N_OPS] = {
+        [OP_addi] = ALU_ADD, [OP_xori] = ALU_XOR,
+        [OP_ori] = ALU_OR,   [OP_andi] = ALU_AND,
+    };
+    static const uint8_t alu[N_OPS] = {
+        [OP_add] = ALU_ADD,  [OP_sub] = ALU_SUB,  [OP_xor] = ALU_XOR,
+        [OP_or] = ALU_OR,    [OP_and] = ALU_AND,  [OP_addw] = ALU_ADD,
+        [OP_subw] = ALU_SUB,
+    };
+    static const uint8_t shift[N_OPS] = {
+        [OP_slli] = SHIFT_SHL,  [OP_srli] = SHIFT_SHR,  [OP_srai] = SHIFT_SAR,
+        [OP_slliw] = SHIFT_SHL, [OP_srliw] = SHIFT_SHR, [OP_sraiw] = SHIFT_SAR,
+        [OP_sll] = SHIFT_SHL,   [OP_srl] = SHIFT_SHR,   [OP_sra] = SHIFT_SAR,
+        [OP_sllw] = SHIFT_SHL,  [OP_srlw] = SHIFT_SHR,  [OP_sraw] = SHIFT_SAR,
+    };
+
+    switch (insn->op) {
+    case OP_lui:
+        EMIT(em, 0x48, 0xc7, 0x83);
+        emit32(em, REG(insn->rd));
+        emit32(em, insn->imm);
+        return;
+    case OP_auipc:
+        emit_pc(em, synced, off + (int64_t) insn->imm);
+        break;
+    case OP_addi: case OP_xori: case OP_ori: case OP_andi:
+        emit_load(em, RAX, insn->rs1);
+        emit_alu_imm(em, true, alu_imm[insn->op], insn->imm);
+        break;
+    case OP_slti: case OP_sltiu:
+        emit_load(em, RAX, insn->rs1);
+        emit_alu_imm(em, true, ALU_CMP, insn->imm);
+        emit_setcc(em, insn->op == OP_slti ? CC_L : CC_B);
+        break;
+    case OP_slli: case OP_srli: case OP_srai:
+        emit_load(em, RAX, insn->rs1);
+        emit_shift_imm(em, true, shift[insn->op], insn->imm);
+        break;
+    case OP_addiw:
+        emit_load(em, RAX, insn->rs1);
+        emit_alu_imm(em, false, ALU_ADD, insn->imm);
+        emit_sext32(em);
+        break;
+    case OP_slliw: case OP_srliw: case OP_sraiw:
+        emit_load(em, RAX, insn->rs1);
+        emit_shift_imm(em, false, shift[insn->op], insn->imm);
+        emit_sext32(em);
+        break;
+    case OP_add: case OP_sub: case OP_xor: case OP_or: case OP_and:
+        emit_load(em, RAX, insn->rs1);
+        emit_load(em, RCX, insn->rs2);
+        emit_alu(em, true, alu[insn->op]);
+        break;
+    case OP_addw: case OP_subw:
+        emit_load(em, RAX, insn->rs1);
+        emit_load(em, RCX, insn->rs2);
+        emit_alu(em, false, alu[insn->op]);
+        emit_sext32(em);
+        break;
+    case OP_sll: case OP_srl: case OP_sra:
+        emit_load(em, RAX, insn->rs1);
+        emit_load(em, RCX, insn->rs2);
+        emit_shift(em, true, shift[insn->op]);
+        break;
+    case OP_sllw: case OP_srlw: case OP_sraw:
+        emit_load(em, RAX, insn->rs1);
+        emit_load(em, RCX, insn->rs2);
+        emit_shift(em, false, shift[insn->op]);
+        emit_sext32(em);
+        break;
+    case OP_slt: case OP_sltu:
+        emit_load(em, RAX, insn->rs1);
+        emit_load(em, RCX, insn->rs2);
+        emit_alu(em, true, ALU_CMP);
+        emit_setcc(em, insn->op == OP_slt ? CC_L : CC_B);
+        break;
+    case OP_mul:
+        emit_load(em, RAX, insn->rs1);
+        emit_load(em, RCX, insn->rs2);
+        EMIT(em, 0x48, 0x0f, 0xaf, 0xc1); /* imul rax, rcx */
+        break;
+    case OP_mulw:
+        emit_load(em, RAX, insn->rs1);
+        emit_load(em, RCX, insn->rs2);
+        EMIT(em, 0x0f, 0xaf, 0xc1); /* imul eax, ecx */
+        emit_sext32(em);
+        break;
+    case OP_mulh: case OP_mulhu:
+        emit_load(em, RAX, insn->rs1);
+        emit_load(em, RCX, insn->rs2);
+        /* imul rcx / mul rcx, then take rdx */
+        EMIT(em, 0x48, 0xf7, insn->op == OP_mulh ? 0xe9 : 0xe1);
+        EMIT(em, 0x48, 0x89, 0xd0);
+        break;
+    default:
+        /* The rest of M is rare enough to stay in its handler. */
+        emit_call(em, insn->handler, insn);
+        return;
+    }
+    emit_store(em, RAX, insn->rd);
+}
+
+static const void *jit_emit_block(struct jit *jit,
+                                  struct emitter *em,
+                                  const struct cpu *cpu,
+                                  const struct block *block)
+{
+    static const uint8_t branch_cc[N_OPS] = {
+        [OP_beq] = CC_E,  [OP_bne] = CC_NE,  [OP_blt] = CC_L,
+        [OP_bge] = CC_GE, [OP_bltu] = CC_B, [OP_bgeu] = CC_AE,
+    };
+    const uint32_t *gen =
+        &cpu->bus->ram->page_gen[(block->pa - RAM_BASE) / PAGE_SIZE];
+    const uint8_t *code = em->p;
+    uint8_t *fault[BLOCK_MAX_INSNS] = {NULL};
+    uint8_t *stale[2];
+    int synced = 0;
+
+    /* Entry, also when linked to: the page must not have been written since
+     * decoding, and the whole block must fit into the budget.
+     */
+    emit_mov_imm(em, RAX, (uintptr_t) gen);
+    EMIT(em, 0x81, 0x38); /* cmp dword [rax], gen */
+    emit32(em, block->gen);
+    stale[0] = emit_jcc(em, CC_NE);
+    EMIT(em, 0x49, 0x8d, 0x85); /* lea rax, [r13 + len] */
+    emit32(em, block->len);
+    EMIT(em, 0x4c, 0x39, 0xf0); /* cmp rax, r14 */
+    stale[1] = emit_jcc(em, CC_G);
+    EMIT(em, 0x49, 0x89, 0xc5); /* mov r13, rax */
+
+    uint32_t i;
+    int off, next = 0;
+    for (i = 0; i < block->len; i++) {
+        const struct insn *insn = &block->insns[i];
+        off = next, next += insn->len;
+
+        if (!is_translated(insn->op)) {
+            emit_add_pc(em, off - synced);
+            emit_bail(jit, em, block, i);
+            break;
+        }
+
+        if (is_alu_op(insn->op)) {
+            if (insn->rd)
+                emit_alu_insn(em, insn, synced, off);
+            continue;
+        }
+
+        if (mem_helpers[insn->op]) {
+            emit_add_pc(em, next - synced);
+            synced = next;
+            emit_call(em, mem_helpers[insn->op], insn);
+            EMIT(em, 0x83, 0xf8, 0xff); /* cmp eax, OK */
+            fault[i] = emit_jcc(em, CC_NE);
+            if (insn->rd == 0)
+                emit_zero_x0(em);
+            continue;
+        }
+
+        switch (insn->op) {
+        case OP_fence:
+            continue;
+        case OP_beq: case OP_bne: case OP_blt:
+        case OP_bge: case OP_bltu: case OP_bgeu: {
+            emit_load(em, RAX, insn->rs1);
+            emit_load(em, RCX, insn->rs2);
+            emit_alu(em, true, ALU_CMP);
+            uint8_t *taken = emit_jcc(em, branch_cc[insn->op]);
+            emit_goto(jit, em, block, synced, next);
+            emit_bind(em, taken);
+            emit_goto(jit, em, block, synced, off + (int64_t) insn->imm);
+            break;
+        }
+        case OP_jal:
+            if (insn->rd) {
+                emit_pc(em, synced, next);
+                emit_store(em, RAX, insn->rd);
+            }
+            emit_goto(jit, em, block, synced, off + (int64_t) insn->imm);
+            break;
+        case OP_jalr:
+            emit_load(em, RCX, insn->rs1);
+            EMIT(em, 0x48, 0x81, 0xc1); /* add rcx, imm */
+            emit32(em, insn->imm);
+            EMIT(em, 0x48, 0x83, 0xe1, 0xfe); /* and rcx, ~1 */
+            if (insn->rd) {
+                emit_pc(em, synced, next);
+                emit_store(em, RAX, insn->rd);
+            }
+            EMIT(em, 0x48, 0x89, 0x8b); /* mov [rbx + pc], rcx */
+            emit32(em, PC);
+            emit_leave_ok(jit, em);
+            break;
+        }
+        break;
+    }
+    if (i == block->len)
+        emit_goto(jit, em, block, synced, next);
+
+    /* A memory helper failed: either a real exception, or the access was not
+     * to RAM and the interpreter has to redo it.
+     */
+    for (i = 0; i < block->len; i++) {
+        if (!fault[i])
+            continue;
+        emit_bind(em, fault[i]);
+        emit_add_pc(em, -block->insns[i].len); /* back at the instruction */
+        EMIT(em, 0x3d); /* cmp eax, JIT_BAIL */
+        emit32(em, JIT_BAIL);
+        uint8_t *bail = emit_jcc(em, CC_E);
+        emit_sub_retired(em, block->len - (i + 1));
+        EMIT(em, 0x41, 0x89, 0x47, EXIT(e)); /* mov [r15 + e], eax */
+        emit_jmp(em, jit->leave);
+        emit_bind(em, bail);
+        emit_bail(jit, em, block, i);
+    }
+
+    emit_bind(em, stale[0]);
+    emit_bind(em, stale[1]);
+    emit_leave_ok(jit, em);
+    return code;
+}
+
+static bool jit_host_init(struct jit *jit)
+{
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED)
+        return false;
+
+    struct emitter em = {jit->code, jit->code + JIT_CODE_SIZE, false};
+    emit_trampolines(jit, &em);
+    jit->used = jit->base = em.p - jit->code;
+    return true;
+}
+
+#else
+
+static bool jit_host_init(struct jit *jit)
+{
+    (void) jit;
+    return false;
+}
+
+#endif
+
+struct jit *jit_new(bool diff)
+{
+    struct jit *jit = calloc(1, sizeof(struct jit));
+    if (!jit_host_init(jit)) {
+        fprintf(stderr, "JIT: not supported on this host, interpreting\n");
+        free(jit);
+        return NULL;
+    }
+    jit->blocks = calloc(JIT_MAX_BLOCKS, sizeof(struct block));
+    jit->diff = diff;
+    return jit;
+}
+
+/* Drop every translation. Nothing translated is running at this point. */
+static void jit_flush(struct jit *jit, struct cpu *cpu)
+{
+    for (int i = 0; i < BCACHE_SIZE; i++)
+        cpu->bcache->blocks[i].code = NULL;
+    jit->used = jit->base;
+    jit->n_blocks = 0;
+    jit->chain = NULL;
+    jit->flushes++;
+}
+
+static const void *jit_translate(struct jit *jit,
+                                 struct cpu *cpu,
+                                 const struct block *block)
+{
+#if defined(__x86_64__)
+    if (!is_translated(block->insns[0].op))
+        return NULL;
+
+    for (int tries = 0; tries < 2; tries++) {
+        if (jit->n_blocks == JIT_MAX_BLOCKS)
+            jit_flush(jit, cpu);
+
+        struct block *copy = &jit->blocks[jit->n_blocks];
+        *copy = *block;
+
+        struct emitter em = {jit->code + jit->used,
+                             jit->code + JIT_CODE_SIZE, false};
+        const void *code = jit_emit_block(jit, &em, cpu, copy);
+        if (!em.full) {
+            jit->n_blocks++;
+            jit->used = em.p - jit->code;
+            jit->translated++;
+            return code;
+        }
+        jit_flush(jit, cpu);
+    }
+#else
+    (void) jit, (void) cpu, (void) block;
+#endif
+    return NULL;
+}
+
+static void jit_mismatch(const struct cpu *cpu,
+                         const struct block *block,
+                         const uint64_t *regs,
+                         const uint64_t pc,
+                         const uint64_t *reserved,
+                         const exception_t e,
+                         const exception_t ie)
+{
+    fprintf(stderr, "JIT: block at pa %#" PRIx64 " differs from interpreter\n",
+            block->pa);
+    fprintf(stderr, "  exception: jit %d, interpreter %d\n", e, ie);
+    if (pc != cpu->pc)
+        fprintf(stderr, "  pc: jit %#" PRIx64 ", interpreter %#" PRIx64 "\n",
+                pc, cpu->pc);
+    for (int r = 1; r < N_REG; r++) {
+        if (regs[r] != cpu->regs[r])
+            fprintf(stderr,
+                    "  x%d: jit %#" PRIx64 ", interpreter %#" PRIx64 "\n", r,
+                    regs[r], cpu->regs[r]);
+    }
+    if (reserved[0] != cpu->reserved_addr ||
+        reserved[1] != cpu->reserved_value)
+        fprintf(stderr,
+                "  reservation: jit %#" PRIx64 "/%#" PRIx64
+                ", interpreter %#" PRIx64 "/%#" PRIx64 "\n",
+                reserved[0], reserved[1], cpu->reserved_addr,
+                cpu->reserved_value);
+    abort();
+}
+
+static bool journal_equal(const struct jit_journal *a,
+                          const struct jit_journal *b)
+{
+    if (a->len != b->len)
+        return false;
+    for (int i = 0; i < a->len; i++) {
+        if (a->stores[i].addr != b->stores[i].addr ||
+            a->stores[i].size != b->stores[i].size ||
+            a->stores[i].value != b->stores[i].value)
+            return false;
+    }
+    return true;
+}
+
+/* Run block's translation on its own, undo it, run the interpreter over the
+ * same instructions from the same state and compare the two.
+ */
+static int jit_diff_block(struct cpu *cpu,
+                          struct block *block,
+                          const int budget,
+                          exception_t *e)
+{
+    struct jit *jit = cpu->jit;
+    struct ram *ram = cpu->bus->ram;
+    uint64_t regs[N_REG], pc = cpu->pc;
+    uint64_t reserved[2] = {cpu->reserved_addr, cpu->reserved_value};
+    memcpy(regs, cpu->regs, sizeof(regs));
+
+    /* A budget of one block keeps the code from running linked blocks. */
+    struct jit_exit exit;
+    jit->journal[0].len = 0;
+    ram->journal = &jit->journal[0];
+    int n = jit->enter(cpu, block->code, block->len, &exit);
+    ram->journal = NULL;
+    jit->runs++;
+
+    uint64_t jit_regs[N_REG], jit_pc = cpu->pc;
+    uint64_t jit_reserved[2] = {cpu->reserved_addr, cpu->reserved_value};
+    memcpy(jit_regs, cpu->regs, sizeof(jit_regs));
+    for (int i = jit->journal[0].len - 1; i >= 0; i--)
+        memcpy(ram->data + jit->journal[0].stores[i].addr - RAM_BASE,
+               &jit->journal[0].stores[i].old,
+               jit->journal[0].stores[i].size / 8);
+    memcpy(cpu->regs, regs, sizeof(regs));
+    cpu->pc = pc;
+    cpu->reserved_addr = reserved[0], cpu->reserved_value = reserved[1];
+
+    bool bailed = exit.e == JIT_BAIL;
+    exception_t ie;
+    jit->journal[1].len = 0;
+    ram->journal = &jit->journal[1];
+    int in = cpu_run_block(cpu, block, 0, bailed ? exit.index : n, &ie);
+    ram->journal = NULL;
+    jit->diffs++;
+
+    exception_t je = bailed ? OK : exit.e;
+    if (in != (bailed ? exit.index : n) || ie != je || cpu->pc != jit_pc ||
+        memcmp(cpu->regs + 1, jit_regs + 1, sizeof(regs) - sizeof(regs[0])) ||
+        cpu->reserved_addr != jit_reserved[0] ||
+        cpu->reserved_value != jit_reserved[1] ||
+        !journal_equal(&jit->journal[0], &jit->journal[1]))
+        jit_mismatch(cpu, block, jit_regs, jit_pc, jit_reserved, je, ie);
+
+    if (bailed) {
+        jit->bails++;
+        return in + cpu_run_block(cpu, block, exit.index, budget - in, e);
+    }
+    *e = ie;
+    return in;
+}
+
+int jit_execute_block(struct cpu *cpu,
+                      struct block *block,
+                      const int budget,
+                      exception_t *e)
+{
+    struct jit *jit = cpu->jit;
+
+    if (!block->code) {
+        if (block->heat < JIT_THRESHOLD) {
+            block->heat++;
+            return cpu_run_block(cpu, block, 0, budget, e);
+        }
+        if (!(block->code = jit_translate(jit, cpu, block))) {
+            block->heat = 0;
+            return cpu_run_block(cpu, block, 0, budget, e);
+        }
+    }
+    if ((int) block->len > budget)
+        return cpu_run_block(cpu, block, 0, budget, e);
+
+    /* The last run left through a jump to this block: link it. */
+    if (jit->chain) {
+        if (jit->chain_pa == block->pa) {
+            patch(jit->chain, block->code);
+            jit->links++;
+        }
+        jit->chain = NULL;
+    }
+
+    if (jit->diff)
+        return jit_diff_block(cpu, block, budget, e);
+
+    struct jit_exit exit;
+    int n = jit->enter(cpu, block->code, MIN(budget, JIT_MAX_RUN), &exit);
+    jit->runs++;
+
+    if (exit.e == JIT_BAIL) {
+        jit->bails++;
+        return n + cpu_run_block(cpu, exit.block, exit.index, budget - n, e);
+    }
+    if ((*e = exit.e) == OK && exit.chain) {
+        jit->chain = exit.chain;
+        jit->chain_pa = exit.chain_pa;
+    }
+    return n;
+}
+
+/* In JSON, a member of the enclosing object, preceded by a comma. */
+void jit_print_stats(const struct jit *jit,
+                     FILE *f,
+                     const enum stats_format format)
+{
+    if (format == STATS_JSON) {
+        fprintf(f,
+                ",\"jit\":{\"translated\":%" PRIu64 ",\"runs\":%" PRIu64
+                ",\"handed_back\":%" PRIu64 ",\"links\":%" PRIu64
+                ",\"flushes\":%" PRIu64 ",\"checked\":%" PRIu64 "}",
+                jit->translated, jit->runs, jit->bails, jit->links,
+                jit->flushes, jit->diffs);
+        return;
+    }
+    fprintf(f,
+            "JIT: %" PRIu64 " blocks translated, %" PRIu64 " runs, %" PRIu64
+            " handed back, %" PRIu64 " links, %" PRIu64 " flushes\n",
+            jit->translated, jit->runs, jit->bails, jit->links,
+            jit->flushes);
+    if (jit->diff)
+        fprintf(f, "JIT: %" PRIu64 " blocks checked against interpreter\n",
+                jit->diffs);
+}
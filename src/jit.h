@@ -0,0 +1,44 @@
+#pragma once
+
+/* Dynamic binary translator. Blocks that have been interpreted JIT_THRESHOLD
+ * times are translated to host code, which keeps the guest registers in
+ * cpu->regs and jumps straight into the code of the next block when it lies
+ * in the same page. Instructions it does not translate (CSR and system
+ * instructions, fence.i, illegal encodings) and MMIO accesses hand the rest
+ * of the block back to the interpreter.
+ */
+#define JIT_THRESHOLD 64
+
+/* Upper bound on instructions run in translated code per call, so that
+ * pending interrupts are still polled now and then.
+ */
+#define JIT_MAX_RUN 4096
+
+/* Stores to RAM made while diffing a block, in program order. */
+#define JOURNAL_SIZE (2 * BLOCK_MAX_INSNS)
+
+struct jit_journal {
+    int len;
+    struct {
+        uint64_t addr, size, old, value;
+    } stores[JOURNAL_SIZE];
+};
+
+struct jit;
+
+/* Returns NULL if the host is not supported. In diff mode every translated
+ * block is also replayed by the interpreter and the results are compared.
+ */
+struct jit *jit_new(bool diff);
+int jit_execute_block(struct cpu *cpu,
+                      struct block *block,
+                      const int budget,
+                      exception_t *e);
+void jit_journal_store(struct jit_journal *journal,
+                       const struct ram *ram,
+                       const uint64_t addr,
+                       const uint64_t size,
+                       const uint64_t value);
+void jit_print_stats(const struct jit *jit,
+                     FILE *f,
+                     const enum stats_format format);
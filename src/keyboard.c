@@ -1,4 +1,6 @@
+#if !defined(NO_SDL)
 #include <SDL.h>
+#endif
 #include <getopt.h>
 #include <math.h>
 #include <stdarg.h>
@@ -10,52 +12,38 @@
 
 #include "keyboard.h"
 
-typedef struct node_s {
-    struct node_s *prev;
-    struct node_s *next;
-    keycode_t code;
-} node_t;
+keycode_t key_take(struct keyboard *kbd) {
+    unsigned h = __atomic_load_n(&kbd->head, __ATOMIC_RELAXED);
+    if (h == __atomic_load_n(&kbd->tail, __ATOMIC_ACQUIRE)) return 0;
 
-static node_t *head = NULL;
-static node_t *tail = NULL;
-
-keycode_t key_take(void) {
-    node_t *node = head;
-
-    if (node == NULL) {
-        return 0;
-    }
+    keycode_t code = kbd->queue[h % KEY_QUEUE_SIZE];
+    __atomic_store_n(&kbd->head, h + 1, __ATOMIC_RELEASE);
+    return code;
+}
 
-    if (node == tail) {
-        head = NULL;
-        tail = NULL;
-    } else {
-        head = node->next;
-        head->prev = NULL;
-    }
+bool key_pending(struct keyboard *kbd) {
+    return __atomic_load_n(&kbd->tail, __ATOMIC_ACQUIRE) !=
+           __atomic_load_n(&kbd->head, __ATOMIC_RELAXED);
+}
 
-    keycode_t code = node->code;
-    return free(node), code;
+unsigned key_dropped(struct keyboard *kbd) {
+    return __atomic_load_n(&kbd->dropped, __ATOMIC_RELAXED);
 }
 
-void key_put(keycode_t code) {
+void key_put(struct keyboard *kbd, keycode_t code) {
     if (code == 0) abort();
 
-    node_t *node = malloc(sizeof(node_t));
-
-    node->prev = tail;
-    node->next = NULL;
-    node->code = code;
-
-    if (head == NULL) {
-        head = node;
-    } else {
-        tail->next = node;
+    unsigned t = __atomic_load_n(&kbd->tail, __ATOMIC_RELAXED);
+    if (t - __atomic_load_n(&kbd->head, __ATOMIC_ACQUIRE) == KEY_QUEUE_SIZE) {
+        __atomic_fetch_add(&kbd->dropped, 1, __ATOMIC_RELAXED);
+        return;
     }
 
-    tail = node;
+    kbd->queue[t % KEY_QUEUE_SIZE] = code;
+    __atomic_store_n(&kbd->tail, t + 1, __ATOMIC_RELEASE);
 }
 
+#if !defined(NO_SDL)
 static const keycode_t key_map[SDL_NUM_SCANCODES] = {
     [SDL_SCANCODE_ESCAPE] = 0x01,
     [SDL_SCANCODE_1] = 0x02,
@@ -148,13 +136,4 @@ keycode_t key_convert(int sdlcode) {
     if (sdlcode < 0 || sdlcode > SDL_NUM_SCANCODES) return 0;
     return key_map[sdlcode];
 }
-
-void key_pressed(int sdlcode) {
-    keycode_t code = key_convert(sdlcode);
-    if (code) key_put(code);
-}
-
-void key_released(int sdlcode) {
-    keycode_t code = key_convert(sdlcode) | 0x80;
-    if (code) key_put(code);
-}
+#endif
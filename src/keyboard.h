@@ -1,10 +1,27 @@
 #pragma once
 
+#include <stdbool.h>
+
 typedef unsigned char keycode_t;
 
-keycode_t key_take(void);
-void key_put(keycode_t code);
+/* The keys a machine has not read yet. Keys are put by the event thread and
+ * taken by the hart reading KBD_GET (under the bus lock when there are
+ * several harts), so a ring with one producer and one consumer needs no
+ * lock. When it is full, new keys are dropped and counted, as a keyboard
+ * controller would.
+ */
+#define KEY_QUEUE_SIZE 256
+
+struct keyboard {
+    keycode_t queue[KEY_QUEUE_SIZE];
+    unsigned head, tail; /* free running indices */
+    unsigned dropped;
+};
+
+/* key_take returns 0 when there are no keys. */
+keycode_t key_take(struct keyboard *kbd);
+void key_put(struct keyboard *kbd, keycode_t code);
+bool key_pending(struct keyboard *kbd);
+unsigned key_dropped(struct keyboard *kbd);
 
 keycode_t key_convert(int sdlcode);
-void key_pressed(int sdlcode);
-void key_released(int sdlcode);
@@ -0,0 +1,111 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "semu.h"
+#include "io.h"
+#include "loader.h"
+
+#if !defined(EM_RISCV)
+#define EM_RISCV 243
+#endif
+
+static inline bool fits_in_ram(const struct ram *ram,
+                               const uint64_t addr,
+                               const uint64_t len)
+{
+    return addr >= RAM_BASE && addr - RAM_BASE <= ram->size &&
+           len <= ram->size - (addr - RAM_BASE);
+}
+
+/* Copy [offset, offset + len) of the file to addr. The host pages that the
+ * range covers entirely are mapped over RAM instead, when the file offset
+ * and the address agree modulo the host page size; only the partial pages
+ * at either end are read.
+ */
+static bool load_segment(struct ram *ram,
+                         const int fd,
+                         const uint64_t offset,
+                         const uint64_t addr,
+                         const uint64_t len)
+{
+    uint8_t *dst = ram->data + (addr - RAM_BASE);
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t head = len, body = 0;
+    if ((uintptr_t) dst % page == offset % page) {
+        head = -(uintptr_t) dst % page;
+        if (head > len)
+            head = len;
+        body = (len - head) / page * page;
+    }
+
+    if (body && mmap(dst + head, body, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED, fd, offset + head) == MAP_FAILED)
+        return false;
+    uint64_t tail = head + body;
+    return read_all(fd, dst, head, offset) &&
+           read_all(fd, dst + tail, len - tail, offset + tail);
+}
+
+static bool load_elf(struct ram *ram,
+                     const int fd,
+                     const Elf64_Ehdr *ehdr,
+                     uint64_t *entry)
+{
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+        ehdr->e_machine != EM_RISCV ||
+        ehdr->e_phentsize != sizeof(Elf64_Phdr))
+        return false;
+
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        Elf64_Phdr phdr;
+        if (!read_all(fd, &phdr, sizeof(phdr),
+                      ehdr->e_phoff + i * sizeof(phdr)))
+            return false;
+        if (phdr.p_type != PT_LOAD)
+            continue;
+
+        /* RAM starts out zeroed, which takes care of .bss. */
+        if (phdr.p_filesz > phdr.p_memsz ||
+            !fits_in_ram(ram, phdr.p_paddr, phdr.p_memsz) ||
+            !load_segment(ram, fd, phdr.p_offset, phdr.p_paddr,
+                          phdr.p_filesz))
+            return false;
+    }
+    *entry = ehdr->e_entry;
+    return true;
+}
+
+bool load_kernel(struct ram *ram, const char *path, uint64_t *entry)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    bool ok = false;
+    struct stat st;
+    Elf64_Ehdr ehdr;
+    if (fstat(fd, &st) < 0)
+        goto out;
+    if ((uint64_t) st.st_size >= sizeof(ehdr) &&
+        read_all(fd, &ehdr, sizeof(ehdr), 0) &&
+        !memcmp(ehdr.e_ident, ELFMAG, SELFMAG)) {
+        ok = load_elf(ram, fd, &ehdr, entry);
+    } else {
+        *entry = RAM_BASE;
+        ok = fits_in_ram(ram, RAM_BASE, st.st_size) &&
+             load_segment(ram, fd, 0, RAM_BASE, st.st_size);
+    }
+
+out:
+    close(fd); /* the mappings stay */
+    return ok;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+struct ram;
+
+/* Load the kernel at path into RAM and set *entry to where it starts. An
+ * ELF file has its PT_LOAD segments placed at their physical addresses;
+ * anything else is taken as a raw image for RAM_BASE. File contents are
+ * mapped copy-on-write rather than copied where the page offsets allow, so
+ * RAM the kernel never touches is never read in.
+ *
+ * Returns false if the file cannot be read or does not fit in RAM.
+ */
+bool load_kernel(struct ram *ram, const char *path, uint64_t *entry);
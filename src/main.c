@@ -1,59 +1,561 @@
+#define _DEFAULT_SOURCE /* clock_gettime */
+
+#if !defined(NO_SDL)
 #include <SDL.h>
+#endif
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "disk.h"
+#include "loader.h"
+#include "profile.h"
+#include "replay.h"
+#if !defined(NO_SDL)
 #include "framebuffer.h"
 #include "keyboard.h"
 #include "screen.h"
+#endif
 #include "semu.h"
+#include "snapshot.h"
+#include "fleet.h"
+#if defined(JIT)
+#include "jit.h"
+#endif
 
 #define FPS 60
-#define TPF 1
-#define TPS (FPS * TPF)
 
-struct cpu *cpu;
+/* Instructions a hart runs between checks for shutdown. */
+#define CPU_SLICE (CPU_HZ / FPS)
+
+#define MAX_PROFILE_SYMBOLS 16
+
+struct cpu *cpu; /* hart 0 */
+struct cpu *harts[MAX_HARTS];
+int nharts = 1;
+const char *snapshot_path;
+struct profile *profile;
+struct replay *replay;
+pthread_t hart_tids[MAX_HARTS];
 
 uint32_t tick_start;
 uint32_t tick_end;
-int ticks = 0;
 bool done = false;
 
+/* The first fatal exception of any hart, which stops them all. */
+exception_t fatal_exception = OK;
+
+/* Stop after this many instructions; 0 means no limit. */
+uint64_t max_insns = 0;
+uint64_t retired = 0;
+
+/* Statistics are printed on exit, and by hart 0 on SIGUSR1. */
+enum stats_format stats_format = STATS_TEXT;
+FILE *stats_out;
+double start_time;
+bool stats_requested = false;
+
 void main_loop(void);
-void execute_instruction(void);
+void screen_loop(void);
+void start_harts(void);
+void join_harts(void);
+void *cpu_thread(void *arg);
+int execute_block(struct cpu *cpu, int budget);
+void print_stats(void);
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options] <kernel image or ELF> [<disk image>]\n"
+           "       %s [options] --restore=SNAPSHOT [<disk image>]\n",
+           prog, prog);
+    printf("  --disk-backend=file|mmap       how the disk image is accessed\n"
+           "  --disk-sync=exit|periodic|write\n"
+           "                                 when disk writes are synced\n"
+           "  --disk-sync-interval=MS        period of --disk-sync=periodic\n"
+           "  --disk-overlay=PATH            keep the disk image read-only and\n"
+           "                                 write to a delta file at PATH\n"
+           "  --headless                     no window, run until the guest\n"
+           "                                 powers off\n"
+           "  --max-insns=N                  stop after N instructions\n"
+           "  --harts=N                      number of harts (1-%d)\n"
+           "  --mem=SIZE                     guest RAM, in bytes or with a K, M\n"
+           "                                 or G suffix (8M by default)\n"
+           "  --thp                          back guest RAM with transparent\n"
+           "                                 huge pages\n"
+           "  --mtime=host|cycles            what mtime counts: host time or\n"
+           "                                 instructions retired by hart 0\n"
+           "  --snapshot=PATH                save a snapshot to PATH when the guest\n"
+           "                                 asks for one, or when stopped\n"
+           "  --restore=PATH                 start from the snapshot at PATH\n"
+           "  --record=PATH                  log UART input, keys and disk\n"
+           "                                 completions to PATH\n"
+           "  --replay=PATH                  feed the inputs logged at PATH to\n"
+           "                                 the guest instead of the host's\n"
+           "  --console=PATH                 write console output to PATH\n"
+           "  --console-flush=line|idle|exit\n"
+           "                                 when console output is written\n"
+           "  --profile=PATH                 write a guest profile to PATH, as\n"
+           "                                 collapsed stacks\n"
+           "  --profile-every=N              sample every N instructions\n"
+           "                                 (10000 by default)\n"
+           "  --profile-hz=HZ                sample HZ times per host second\n"
+           "                                 instead\n"
+           "  --profile-stack                sample frame pointer backtraces\n"
+           "  --profile-symbols=ELF          symbolize user mode samples with\n"
+           "                                 ELF (may be repeated)\n"
+           "  --stats=text|json              format of the statistics printed\n"
+           "                                 on exit and on SIGUSR1\n"
+           "  --stats-file=PATH              append statistics to PATH instead\n"
+           "                                 of stderr\n"
+           "  --vms=N                        run N headless machines in this\n"
+           "                                 process\n"
+           "  --vm-threads=N                 host threads they share (one per\n"
+           "                                 CPU by default)\n"
+           "  --vm-dir=DIR                   where their consoles, disk\n"
+           "                                 overlays and statuses go\n",
+           MAX_HARTS);
+#if defined(JIT)
+    printf("  --no-jit     only interpret\n"
+           "  --jit-diff   check every translated block against the "
+           "interpreter\n");
+#endif
+}
 
-int main(int argc, char *argv[]) {
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-        fatal("initialize SDL");
-        return 1;
+/* A size in bytes, optionally suffixed with K, M or G; 0 if malformed. */
+static uint64_t parse_size(const char *arg) {
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+    switch (*end) {
+    case 'G':
+        size <<= 10;
+        /* fall through */
+    case 'M':
+        size <<= 10;
+        /* fall through */
+    case 'K':
+        size <<= 10;
+        end++;
+        break;
     }
+    return *end ? 0 : size;
+}
 
-    SDL_ShowCursor(SDL_DISABLE);
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void request_stats(int sig) {
+    (void) sig;
+    __atomic_store_n(&stats_requested, true, __ATOMIC_RELAXED);
+}
 
-    if (argc < 2) {
-        printf("Usage: %s <raw kernel image> [<disk image>]\n", argv[0]);
+int main(int argc, char *argv[]) {
+#if defined(NO_SDL)
+    bool headless = true;
+#else
+    bool headless = false;
+#endif
+#if defined(JIT)
+    bool use_jit = true, jit_diff = false;
+#endif
+    enum disk_backend disk_backend = DISK_FILE;
+    enum disk_sync disk_sync = DISK_SYNC_EXIT;
+    int disk_sync_interval = DISK_SYNC_INTERVAL_MS;
+    const char *disk_overlay = NULL;
+    const char *console = NULL;
+    const char *restore = NULL;
+    const char *record = NULL, *replay_path = NULL;
+    enum uart_flush console_flush = UART_FLUSH_LINE;
+    enum sched_clock clock = SCHED_CLOCK_HOST;
+    uint64_t mem = RAM_DEFAULT_SIZE;
+    bool thp = false;
+    const char *profile_path = NULL;
+    const char *profile_symbols[MAX_PROFILE_SYMBOLS];
+    int nprofile_symbols = 0;
+    uint64_t profile_every = 10000;
+    int profile_hz = 0;
+    bool profile_stack = false;
+    const char *stats_path = NULL;
+    int vms = 0, vm_threads = 0;
+    const char *vm_dir = ".";
+
+    static const struct option options[] = {
+        {"disk-backend", required_argument, NULL, 'b'},
+        {"disk-sync", required_argument, NULL, 's'},
+        {"disk-sync-interval", required_argument, NULL, 'i'},
+        {"disk-overlay", required_argument, NULL, 'o'},
+        {"headless", no_argument, NULL, 'H'},
+        {"max-insns", required_argument, NULL, 'm'},
+        {"harts", required_argument, NULL, 'c'},
+        {"mtime", required_argument, NULL, 't'},
+        {"mem", required_argument, NULL, 'M'},
+        {"thp", no_argument, NULL, 'T'},
+        {"snapshot", required_argument, NULL, 'S'},
+        {"restore", required_argument, NULL, 'r'},
+        {"record", required_argument, NULL, 'R'},
+        {"replay", required_argument, NULL, 'P'},
+        {"console", required_argument, NULL, 'l'},
+        {"console-flush", required_argument, NULL, 'f'},
+        {"profile", required_argument, NULL, 'p'},
+        {"profile-every", required_argument, NULL, 'e'},
+        {"profile-hz", required_argument, NULL, 'z'},
+        {"profile-stack", no_argument, NULL, 'k'},
+        {"profile-symbols", required_argument, NULL, 'y'},
+        {"stats", required_argument, NULL, 'x'},
+        {"stats-file", required_argument, NULL, 'X'},
+        {"vms", required_argument, NULL, 'V'},
+        {"vm-threads", required_argument, NULL, 'W'},
+        {"vm-dir", required_argument, NULL, 'D'},
+#if defined(JIT)
+        {"no-jit", no_argument, NULL, 'n'},
+        {"jit-diff", no_argument, NULL, 'd'},
+#endif
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            if (!strcmp(optarg, "file")) {
+                disk_backend = DISK_FILE;
+            } else if (!strcmp(optarg, "mmap")) {
+                disk_backend = DISK_MMAP;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 's':
+            if (!strcmp(optarg, "exit")) {
+                disk_sync = DISK_SYNC_EXIT;
+            } else if (!strcmp(optarg, "periodic")) {
+                disk_sync = DISK_SYNC_PERIODIC;
+            } else if (!strcmp(optarg, "write")) {
+                disk_sync = DISK_SYNC_WRITE;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'i':
+            if ((disk_sync_interval = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'o':
+            disk_overlay = optarg;
+            break;
+        case 'H':
+            headless = true;
+            break;
+        case 'm':
+            max_insns = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            nharts = atoi(optarg);
+            if (nharts < 1 || nharts > MAX_HARTS) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 't':
+            if (!strcmp(optarg, "host")) {
+                clock = SCHED_CLOCK_HOST;
+            } else if (!strcmp(optarg, "cycles")) {
+                clock = SCHED_CLOCK_CYCLES;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'M':
+            mem = parse_size(optarg);
+            if (mem < RAM_MIN_SIZE || mem % PAGE_SIZE) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'T':
+            thp = true;
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        case 'r':
+            restore = optarg;
+            break;
+        case 'R':
+            record = optarg;
+            break;
+        case 'P':
+            replay_path = optarg;
+            break;
+        case 'l':
+            console = optarg;
+            break;
+        case 'f':
+            if (!strcmp(optarg, "line")) {
+                console_flush = UART_FLUSH_LINE;
+            } else if (!strcmp(optarg, "idle")) {
+                console_flush = UART_FLUSH_IDLE;
+            } else if (!strcmp(optarg, "exit")) {
+                console_flush = UART_FLUSH_EXIT;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'p':
+            profile_path = optarg;
+            break;
+        case 'e':
+            if ((profile_every = strtoull(optarg, NULL, 0)) == 0) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'z':
+            if ((profile_hz = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'k':
+            profile_stack = true;
+            break;
+        case 'y':
+            if (nprofile_symbols == MAX_PROFILE_SYMBOLS) {
+                usage(argv[0]);
+                return 2;
+            }
+            profile_symbols[nprofile_symbols++] = optarg;
+            break;
+        case 'x':
+            if (!strcmp(optarg, "text")) {
+                stats_format = STATS_TEXT;
+            } else if (!strcmp(optarg, "json")) {
+                stats_format = STATS_JSON;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'X':
+            stats_path = optarg;
+            break;
+        case 'V':
+            if ((vms = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'W':
+            if ((vm_threads = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'D':
+            vm_dir = optarg;
+            break;
+#if defined(JIT)
+        case 'n':
+            use_jit = false;
+            break;
+        case 'd':
+            jit_diff = true;
+            break;
+#endif
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if ((!restore && optind >= argc) || argc - optind > (restore ? 1 : 2) ||
+        (record && replay_path)) {
+        usage(argv[0]);
         return 2;
     }
 
-    FILE *f = fopen(argv[1], "rb");
-    if (!f)
-        fatal("open raw kernel image");
+    /* The machines of a pool only have their own consoles and disk
+     * overlays.
+     */
+    if (vms) {
+        if (nharts > 1 || snapshot_path || record || replay_path ||
+            profile_path || console || disk_overlay)
+            fatal("combine --vms with per-process machine options");
+#if defined(JIT)
+        if (jit_diff)
+            fatal("combine --vms with --jit-diff");
+#endif
+        struct fleet_config config = {
+            .vms = vms,
+            .threads = vm_threads,
+            .dir = vm_dir,
+            .kernel = restore ? NULL : argv[optind++],
+            .restore = restore,
+            .mem = mem,
+            .thp = thp,
+            .disk = optind < argc ? argv[optind] : NULL,
+            .disk_backend = disk_backend,
+            .disk_sync = disk_sync,
+            .disk_sync_interval = disk_sync_interval,
+            .clock = clock,
+            .console_flush = console_flush,
+            .max_insns = max_insns,
+#if defined(JIT)
+            .jit = use_jit,
+#endif
+        };
+        return fleet_run(&config);
+    }
 
-    uint8_t *binary = NULL;
-    size_t fsize = read_file(f, &binary);
-    fclose(f);
+    struct ram *ram = ram_new(mem, thp);
+    if (!ram)
+        fatal("allocate RAM");
+    uint64_t entry = RAM_BASE;
+    const char *kernel = restore ? NULL : argv[optind++];
+    if (kernel && !load_kernel(ram, kernel, &entry))
+        fatal("load kernel image");
+
+    if (profile_path) {
+        profile = profile_new(profile_every, profile_hz, profile_stack,
+                              nharts);
+        /* A raw kernel image has no symbols. */
+        if (kernel)
+            profile_add_symbols(profile, kernel, true);
+        for (int i = 0; i < nprofile_symbols; i++)
+            if (!profile_add_symbols(profile, profile_symbols[i], false))
+                fatal("read profile symbols");
+    }
 
-    if (argc == 3) {
-        f = fopen(argv[2], "r+b");
-        if (!f)
+    struct disk_image *disk = NULL;
+    if (optind < argc) {
+        disk = disk_open(argv[optind], disk_overlay, disk_backend, disk_sync,
+                         disk_sync_interval);
+        if (!disk)
             fatal("open disk image");
     }
 
-    cpu = cpu_new(binary, fsize, f);
-    free(binary);
+    cpu = harts[0] = cpu_new(ram, entry, disk);
+    for (int i = 1; i < nharts; i++)
+        harts[i] = cpu_new_hart(cpu, i);
+    /* Inputs can only be replayed at the same instructions if nothing else
+     * depends on host timing.
+     */
+    if (record || replay_path) {
+        if (nharts > 1)
+            fatal("record or replay with more than one hart");
+        clock = SCHED_CLOCK_CYCLES;
+    }
+    bus_set_clock(cpu->bus, clock);
+    if ((snapshot_path || restore) && nharts > 1)
+        fatal("use snapshots with more than one hart");
+    if (restore && !snapshot_restore(cpu, restore))
+        fatal("restore the snapshot");
+    if (record || replay_path) {
+        if (!(replay = replay_new(record ? record : replay_path, record)))
+            fatal(record ? "create the replay log" : "read the replay log");
+        bus_set_replay(cpu->bus, replay);
+    }
+
+    int console_fd = STDOUT_FILENO;
+    if (console &&
+        (console_fd = open(console, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        fatal("open console log");
+    uart_console(cpu->bus->uart, console_fd, console_flush);
+#if defined(JIT)
+    /* The store journal of diff mode is shared by all harts. */
+    if (jit_diff && nharts > 1)
+        fatal("use --jit-diff with more than one hart");
+    for (int i = 0; use_jit && i < nharts; i++)
+        harts[i]->jit = jit_new(jit_diff);
+#endif
+
+    stats_out = stderr;
+    if (stats_path && !(stats_out = fopen(stats_path, "a")))
+        fatal("open statistics file");
+    struct sigaction sa = {.sa_handler = request_stats, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    start_time = now();
+    if (profile)
+        profile_start(profile);
+    if (headless) {
+        start_harts();
+        join_harts();
+    } else {
+#if !defined(NO_SDL)
+        screen_loop();
+#endif
+    }
+    if (fatal_exception != OK) {
+        uart_close(cpu->bus->uart);
+        printf("fatal exception while %s instruction!",
+               fatal_exception == INSTRUCTION_ACCESS_FAULT ? "fetching"
+                                                           : "executing");
+        exit(0);
+    }
+    print_stats();
+
+    if (profile && !profile_write(profile, profile_path))
+        fatal("write the profile");
+    if (snapshot_path && !cpu->bus->syscon->off &&
+        !snapshot_save(cpu, snapshot_path))
+        fatal("save the snapshot");
+    if (replay) {
+        if (record && !cpu->bus->syscon->off)
+            replay_log(replay, REPLAY_END, cpu->cycle, NULL, 0);
+        if (!replay_close(replay))
+            fatal(record ? "write the replay log" : "replay the recording");
+    }
+    uart_close(cpu->bus->uart);
+    if (console)
+        close(console_fd);
+    if (stats_out != stderr)
+        fclose(stats_out);
+    if (disk) {
+        disk_drain(cpu->bus->disk);
+        disk_close(disk);
+    }
+    return cpu->bus->syscon->off ? cpu->bus->syscon->exit_code : 0;
+}
+
+#if !defined(NO_SDL)
+/* Keys go through the bus, which records them or, when replaying, drops
+ * them.
+ */
+static void key_pressed(int sdlcode) {
+    keycode_t code = key_convert(sdlcode);
+    if (code) bus_put_key(cpu->bus, code);
+}
+
+static void key_released(int sdlcode) {
+    keycode_t code = key_convert(sdlcode) | 0x80;
+    if (code) bus_put_key(cpu->bus, code);
+}
+
+/* The harts run on their own threads while this one draws and handles
+ * events, at display rate.
+ */
+void screen_loop(void) {
+    if (SDL_Init(SDL_INIT_VIDEO) != 0)
+        fatal("initialize SDL");
+
+    SDL_ShowCursor(SDL_DISABLE);
 
     ScreenCreate(
         FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT,
@@ -68,14 +570,14 @@ int main(int argc, char *argv[]) {
     ScreenInit();
     ScreenDraw();
 
-    tick_start = SDL_GetTicks();
-    tick_end = SDL_GetTicks();
+    start_harts();
 
-    while (!done) {
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        tick_start = SDL_GetTicks();
         main_loop();
 
         tick_end = SDL_GetTicks();
-        int delay = 1000/TPS - (tick_end - tick_start);
+        int delay = 1000/FPS - (tick_end - tick_start);
         if (delay > 0) {
             SDL_Delay(delay);
         } else {
@@ -83,69 +585,130 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    fclose(f);
-    return 0;
+    join_harts();
 }
 
 void main_loop(void) {
-    int dt = SDL_GetTicks() - tick_start;
-    tick_start = SDL_GetTicks();
-    if (!dt)
-        dt = 1;
-
-    int cycles_per_tick = CPU_HZ / TPS / dt;
-    int extra_cycles = CPU_HZ / TPS - (cycles_per_tick * dt);
-
-    for (int i = 0; i < dt; i++) {
+#if defined(STATS)
+    double start = now();
+    ScreenDraw();
+    cpu->bus->stats->frames++;
+    cpu->bus->stats->draw_ns += (now() - start) * 1e9;
+#else
+    ScreenDraw();
+#endif
+    if (ScreenProcessEvents())
+        __atomic_store_n(&done, true, __ATOMIC_RELAXED);
+}
+#endif
 
-        int cycles_left = cycles_per_tick;
+void start_harts(void) {
+    for (int i = 0; i < nharts; i++)
+        pthread_create(&hart_tids[i], NULL, cpu_thread, harts[i]);
+}
 
-        if (i == dt - 1)
-            cycles_left += extra_cycles;
+void join_harts(void) {
+    for (int i = 0; i < nharts; i++)
+        pthread_join(hart_tids[i], NULL);
+}
 
-        while (cycles_left > 0) {
-            execute_instruction();
-            cycles_left--;
+/* Runs a hart until the window is closed, the guest powers off or max_insns
+ * is reached.
+ */
+void *cpu_thread(void *arg) {
+    struct cpu *hart = arg;
+    const struct syscon *syscon = hart->bus->syscon;
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        int slice = CPU_SLICE;
+        uint64_t total = __atomic_load_n(&retired, __ATOMIC_RELAXED);
+        if (max_insns && total < max_insns && max_insns - total < (uint64_t) slice)
+            slice = max_insns - total;
+
+        int cycles_left = slice;
+        while (cycles_left > 0 && !syscon->off && !syscon->snapshot &&
+               !__atomic_load_n(&done, __ATOMIC_RELAXED) &&
+               !__atomic_load_n(&stats_requested, __ATOMIC_RELAXED))
+            cycles_left -= execute_block(hart, cycles_left);
+        total = __atomic_add_fetch(&retired, slice - cycles_left,
+                                   __ATOMIC_RELAXED);
+
+        if (hart->hartid == 0 &&
+            __atomic_exchange_n(&stats_requested, false, __ATOMIC_RELAXED))
+            print_stats();
+
+        if (syscon->snapshot) {
+            if (snapshot_path && !snapshot_save(hart, snapshot_path))
+                fatal("save the snapshot");
+            hart->bus->syscon->snapshot = false;
         }
-    }
 
-    if ((ticks % TPF) == 0) {
-        ScreenDraw();
+        if (syscon->off || (max_insns && total >= max_insns))
+            __atomic_store_n(&done, true, __ATOMIC_RELAXED);
     }
-
-    done = ScreenProcessEvents();
-
-    ticks++;
+    return NULL;
 }
 
-void execute_instruction(void) {
-    // fetch instruction
-    uint64_t insn;
-    exception_t e;
-    if ((e = cpu_fetch(cpu, &insn)) != OK) {
-        cpu_take_trap(cpu, e, NONE);
-        if (exception_is_fatal(e)) {
-            printf("fatal exception while fetching instruction!");
-            exit(0);
+/* The counters of other harts may be read while they run. */
+void print_stats(void) {
+    uint64_t total = __atomic_load_n(&retired, __ATOMIC_RELAXED);
+    double elapsed = now() - start_time;
+    double mips = elapsed > 0 ? total / elapsed / 1e6 : 0.0;
+    unsigned dropped = 0;
+#if !defined(NO_SDL)
+    dropped = key_dropped(cpu->bus->kbd);
+#endif
+
+    FILE *f = stats_out;
+    if (stats_format == STATS_JSON) {
+        fprintf(f,
+                "{\"instructions\":%" PRIu64 ",\"seconds\":%.6f,"
+                "\"mips\":%.2f,\"keys_dropped\":%u,\"harts\":[",
+                total, elapsed, mips, dropped);
+        for (int i = 0; i < nharts; i++) {
+            if (i)
+                fputc(',', f);
+            cpu_print_stats(harts[i], f, STATS_JSON);
         }
-        insn = 0;
+        fputc(']', f);
+        bus_print_stats(cpu->bus, f, STATS_JSON);
+        fputs("}\n", f);
+    } else {
+        fprintf(f, "%" PRIu64 " instructions in %.2f s (%.2f MIPS)\n", total,
+                elapsed, mips);
+        for (int i = 0; i < nharts; i++) {
+            if (nharts > 1)
+                fprintf(f, "Hart %d:\n", i);
+            cpu_print_stats(harts[i], f, STATS_TEXT);
+        }
+        bus_print_stats(cpu->bus, f, STATS_TEXT);
+        if (dropped)
+            fprintf(f, "%u keys dropped\n", dropped);
     }
+    fflush(f);
+}
 
-    //printf("%" PRIX64 ": %" PRIX64 "\n", cpu->pc, insn);
-
-    // advance pc
-    cpu->pc += 4;
-
-    // decode and execute
-    if ((e = cpu_execute(cpu, insn)) != OK) {
+int execute_block(struct cpu *cpu, int budget) {
+    exception_t e;
+    int retired = cpu_execute_block(cpu, budget, &e);
+    if (profile)
+        profile_sample(profile, cpu);
+    if (e != OK) {
         cpu_take_trap(cpu, e, NONE);
+        /* The other harts may still be using the bus, so leave the
+         * report to the main thread once they have stopped.
+         */
         if (exception_is_fatal(e)) {
-            printf("fatal exception while executing instruction!");
-            exit(0);
+            exception_t none = OK;
+            __atomic_compare_exchange_n(&fatal_exception, &none, e, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            __atomic_store_n(&done, true, __ATOMIC_RELAXED);
+            return retired;
         }
     }
 
     interrupt_t intr;
     if ((intr = cpu_check_pending_interrupt(cpu)) != NONE)
         cpu_take_trap(cpu, OK, intr);
+
+    return retired;
 }
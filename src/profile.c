@@ -0,0 +1,392 @@
+#define _DEFAULT_SOURCE /* clock_nanosleep, open_memstream */
+
+#include <elf.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "semu.h"
+#include "io.h"
+#include "profile.h"
+
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_MAX_ELFS 16
+#define PROFILE_MIN_SLOTS 1024
+
+struct symbol {
+    uint64_t addr, size;
+    char *name;
+};
+
+struct symtab {
+    struct symbol *syms; /* sorted by address */
+    size_t len;
+};
+
+/* One distinct stack, innermost frame first: the PC, then the return
+ * addresses.
+ */
+struct stack {
+    uint64_t count;
+    uint8_t mode, depth;
+    uint64_t pcs[PROFILE_MAX_DEPTH];
+};
+
+struct profile {
+    uint64_t every;
+    int hz;
+    bool stack;
+    int nharts;
+
+    uint64_t next[MAX_HARTS]; /* cycle of the next sample */
+    bool due[MAX_HARTS];      /* set by the timer thread */
+
+    /* A user PC is looked up in each user table in turn. */
+    struct symtab kernel, user[PROFILE_MAX_ELFS];
+    int nuser;
+
+    /* Open-addressed, at most half full. */
+    pthread_mutex_t lock;
+    struct stack *slots;
+    size_t nslots, nstacks;
+    uint64_t samples;
+
+    pthread_t tid;
+    bool running, stopping;
+};
+
+static void *read_section(const int fd, const Elf64_Shdr *shdr)
+{
+    void *data = malloc(shdr->sh_size + 1);
+    if (!read_all(fd, data, shdr->sh_size, shdr->sh_offset)) {
+        free(data);
+        return NULL;
+    }
+    ((char *) data)[shdr->sh_size] = 0;
+    return data;
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+    const struct symbol *x = a, *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* Functions and code labels from the symbol table. RISC-V mapping symbols
+ * ($x, $d) say nothing about where functions are and are skipped.
+ */
+static bool symtab_load(struct symtab *tab, const int fd)
+{
+    Elf64_Ehdr ehdr;
+    if (!read_all(fd, &ehdr, sizeof(ehdr), 0) ||
+        memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+        ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr.e_shentsize != sizeof(Elf64_Shdr))
+        return false;
+
+    Elf64_Shdr *shdrs = calloc(ehdr.e_shnum, sizeof(Elf64_Shdr));
+    bool ok = read_all(fd, shdrs, ehdr.e_shnum * sizeof(Elf64_Shdr),
+                       ehdr.e_shoff);
+    for (int i = 0; ok && i < ehdr.e_shnum; i++) {
+        if (shdrs[i].sh_type != SHT_SYMTAB || shdrs[i].sh_link >= ehdr.e_shnum)
+            continue;
+        Elf64_Sym *syms = read_section(fd, &shdrs[i]);
+        char *strs = read_section(fd, &shdrs[shdrs[i].sh_link]);
+        size_t n = shdrs[i].sh_size / sizeof(Elf64_Sym);
+        size_t strs_size = shdrs[shdrs[i].sh_link].sh_size;
+        if (!syms || !strs) {
+            ok = false;
+        } else {
+            tab->syms = realloc(tab->syms,
+                                (tab->len + n) * sizeof(struct symbol));
+            for (size_t j = 0; j < n; j++) {
+                int type = ELF64_ST_TYPE(syms[j].st_info);
+                if ((type != STT_FUNC && type != STT_NOTYPE) ||
+                    syms[j].st_shndx == SHN_UNDEF ||
+                    syms[j].st_shndx >= SHN_LORESERVE ||
+                    syms[j].st_name == 0 || syms[j].st_name >= strs_size)
+                    continue;
+                const char *name = strs + syms[j].st_name;
+                if (name[0] == '$' || name[0] == '.')
+                    continue;
+                tab->syms[tab->len++] = (struct symbol){
+                    syms[j].st_value, syms[j].st_size, strdup(name)};
+            }
+        }
+        free(syms);
+        free(strs);
+    }
+    free(shdrs);
+    qsort(tab->syms, tab->len, sizeof(struct symbol), symbol_cmp);
+    return ok;
+}
+
+/* The closest symbol at or below addr, unless addr is past its end. */
+static const char *symtab_lookup(const struct symtab *tab, const uint64_t addr)
+{
+    size_t lo = 0, hi = tab->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tab->syms[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    const struct symbol *sym = &tab->syms[lo - 1];
+    if (sym->size && addr - sym->addr >= sym->size)
+        return NULL;
+    return sym->name;
+}
+
+struct profile *profile_new(const uint64_t every,
+                            const int hz,
+                            const bool stack,
+                            const int nharts)
+{
+    struct profile *prof = calloc(1, sizeof(struct profile));
+    prof->every = every;
+    prof->hz = hz;
+    prof->stack = stack;
+    prof->nharts = nharts;
+    for (int i = 0; i < MAX_HARTS; i++)
+        prof->next[i] = every;
+    pthread_mutex_init(&prof->lock, NULL);
+    prof->nslots = PROFILE_MIN_SLOTS;
+    prof->slots = calloc(prof->nslots, sizeof(struct stack));
+    return prof;
+}
+
+bool profile_add_symbols(struct profile *prof,
+                         const char *path,
+                         const bool kernel)
+{
+    if (!kernel && prof->nuser == PROFILE_MAX_ELFS)
+        return false;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct symtab tab = {NULL, 0};
+    bool ok = symtab_load(&tab, fd);
+    close(fd);
+    if (!ok) {
+        for (size_t i = 0; i < tab.len; i++)
+            free(tab.syms[i].name);
+        free(tab.syms);
+        return false;
+    }
+
+    if (kernel)
+        prof->kernel = tab;
+    else
+        prof->user[prof->nuser++] = tab;
+    return true;
+}
+
+static void *profile_timer_thread(void *priv)
+{
+    struct profile *prof = (struct profile *) priv;
+    long period = 1000000000L / prof->hz;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    while (!__atomic_load_n(&prof->stopping, __ATOMIC_RELAXED)) {
+        ts.tv_nsec += period;
+        while (ts.tv_nsec >= 1000000000L)
+            ts.tv_sec++, ts.tv_nsec -= 1000000000L;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        for (int i = 0; i < prof->nharts; i++)
+            __atomic_store_n(&prof->due[i], true, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+void profile_start(struct profile *prof)
+{
+    if (prof->hz > 0) {
+        prof->running = true;
+        pthread_create(&prof->tid, NULL, profile_timer_thread, (void *) prof);
+    }
+}
+
+/* Guest memory is read through the hart's own translation, and only from
+ * RAM, so that the walk has no side effects on devices.
+ */
+static bool profile_load(struct cpu *cpu, const uint64_t addr, uint64_t *value)
+{
+    uint64_t pa;
+    if (addr % 8 ||
+        cpu_translate(cpu, addr, LOAD_PAGE_FAULT, &pa) != OK ||
+        pa < RAM_BASE || pa - RAM_BASE > cpu->bus->ram->size - 8)
+        return false;
+    return bus_load(cpu->bus, pa, 64, value) == OK;
+}
+
+static uint64_t stack_hash(const struct stack *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ s->mode;
+    for (int i = 0; i < s->depth; i++)
+        h = (h ^ s->pcs[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static bool stack_equal(const struct stack *a, const struct stack *b)
+{
+    return a->mode == b->mode && a->depth == b->depth &&
+           !memcmp(a->pcs, b->pcs, a->depth * sizeof(uint64_t));
+}
+
+static void profile_insert(struct profile *prof,
+                           struct stack *slots,
+                           const size_t nslots,
+                           const struct stack *s)
+{
+    size_t i = stack_hash(s) & (nslots - 1);
+    while (slots[i].count && !stack_equal(&slots[i], s))
+        i = (i + 1) & (nslots - 1);
+    if (!slots[i].count) {
+        slots[i] = *s;
+        slots[i].count = 0;
+        prof->nstacks++;
+    }
+    slots[i].count += s->count;
+}
+
+static void profile_record(struct profile *prof, const struct stack *s)
+{
+    pthread_mutex_lock(&prof->lock);
+    if (2 * (prof->nstacks + 1) > prof->nslots) {
+        size_t nslots = prof->nslots * 2;
+        struct stack *slots = calloc(nslots, sizeof(struct stack));
+        prof->nstacks = 0;
+        for (size_t i = 0; i < prof->nslots; i++)
+            if (prof->slots[i].count)
+                profile_insert(prof, slots, nslots, &prof->slots[i]);
+        free(prof->slots);
+        prof->slots = slots;
+        prof->nslots = nslots;
+    }
+    profile_insert(prof, prof->slots, prof->nslots, s);
+    prof->samples++;
+    pthread_mutex_unlock(&prof->lock);
+}
+
+void profile_sample(struct profile *prof, struct cpu *cpu)
+{
+    int hart = cpu->hartid;
+    if (prof->hz > 0) {
+        if (!__atomic_load_n(&prof->due[hart], __ATOMIC_RELAXED))
+            return;
+        __atomic_store_n(&prof->due[hart], false, __ATOMIC_RELAXED);
+    } else {
+        if (cpu->cycle < prof->next[hart])
+            return;
+        prof->next[hart] = cpu->cycle + prof->every;
+    }
+
+    struct stack s = {.count = 1, .mode = cpu->mode, .depth = 1};
+    s.pcs[0] = cpu->pc;
+
+    /* A caller's frame is above its callee's on the stack. */
+    uint64_t fp = cpu->regs[8], ra, prev;
+    while (prof->stack && s.depth < PROFILE_MAX_DEPTH &&
+           profile_load(cpu, fp - 8, &ra) &&
+           profile_load(cpu, fp - 16, &prev) && ra) {
+        s.pcs[s.depth++] = ra;
+        if (prev <= fp)
+            break;
+        fp = prev;
+    }
+    profile_record(prof, &s);
+}
+
+static const char *const mode_names[] = {
+    [USER] = "user",
+    [SUPERVISOR] = "supervisor",
+    [MACHINE] = "machine",
+};
+
+/* A return address is looked up one byte back, within the call, in case
+ * the call was the last instruction of its function.
+ */
+static const char *profile_frame(const struct profile *prof,
+                                 const int mode,
+                                 const uint64_t pc,
+                                 const bool ret,
+                                 char buf[static 19])
+{
+    const char *name = NULL;
+    if (mode != USER)
+        name = symtab_lookup(&prof->kernel, pc - ret);
+    for (int i = 0; mode == USER && !name && i < prof->nuser; i++)
+        name = symtab_lookup(&prof->user[i], pc - ret);
+    if (!name) {
+        snprintf(buf, 19, "0x%" PRIx64, pc);
+        name = buf;
+    }
+    return name;
+}
+
+struct line {
+    char *text;
+    uint64_t count;
+};
+
+static int line_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct line *) a)->text,
+                  ((const struct line *) b)->text);
+}
+
+/* Stacks that only differ in PCs within the same functions are merged. */
+bool profile_write(struct profile *prof, const char *path)
+{
+    if (prof->running) {
+        __atomic_store_n(&prof->stopping, true, __ATOMIC_RELAXED);
+        pthread_join(prof->tid, NULL);
+        prof->running = false;
+    }
+
+    struct line *lines = calloc(prof->nstacks + 1, sizeof(struct line));
+    size_t nlines = 0;
+    for (size_t i = 0; i < prof->nslots; i++) {
+        const struct stack *s = &prof->slots[i];
+        if (!s->count)
+            continue;
+
+        char *text;
+        size_t size;
+        FILE *f = open_memstream(&text, &size);
+        fputs(mode_names[s->mode] ? mode_names[s->mode] : "unknown", f);
+        for (int j = s->depth - 1; j >= 0; j--) {
+            char buf[19];
+            fprintf(f, ";%s",
+                    profile_frame(prof, s->mode, s->pcs[j], j > 0, buf));
+        }
+        fclose(f);
+        lines[nlines++] = (struct line){text, s->count};
+    }
+    qsort(lines, nlines, sizeof(struct line), line_cmp);
+
+    FILE *f = fopen(path, "w");
+    for (size_t i = 0; i < nlines; i++) {
+        uint64_t count = lines[i].count;
+        while (i + 1 < nlines && !strcmp(lines[i].text, lines[i + 1].text)) {
+            free(lines[i].text);
+            count += lines[++i].count;
+        }
+        if (f)
+            fprintf(f, "%s %" PRIu64 "\n", lines[i].text, count);
+        free(lines[i].text);
+    }
+    free(lines);
+    return f && fclose(f) == 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+/* Guest profiler. Each hart is sampled between blocks, either every so many
+ * instructions it retires or at a fixed rate in host time, recording its
+ * privilege mode, PC and, optionally, a backtrace that follows the frame
+ * pointer (s0) chain as laid out by GCC: return address at fp - 8, caller's
+ * frame pointer at fp - 16.
+ *
+ * Samples are symbolized when written: machine and supervisor mode PCs
+ * against the kernel ELF, user mode PCs against the user program ELFs, in
+ * the order they were added. The output is in the collapsed stack format
+ * of flamegraph.pl, one line per distinct stack, outermost frame first.
+ */
+struct cpu;
+struct profile;
+
+/* With hz 0, a hart is sampled every `every` instructions. */
+struct profile *profile_new(const uint64_t every,
+                            const int hz,
+                            const bool stack,
+                            const int nharts);
+/* False if the file cannot be read or is not an ELF file. */
+bool profile_add_symbols(struct profile *prof,
+                         const char *path,
+                         const bool kernel);
+void profile_start(struct profile *prof);
+/* Called between blocks; takes a sample if one is due. */
+void profile_sample(struct profile *prof, struct cpu *cpu);
+/* Stops sampling and writes the profile out. */
+bool profile_write(struct profile *prof, const char *path);
+
@@ -0,0 +1,251 @@
+#define _DEFAULT_SOURCE /* getline */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+
+#define REPLAY_HEADER "# VulpineSystem replay 1\n"
+
+static const char *const kind_names[] = {
+    [REPLAY_UART] = "uart",
+    [REPLAY_KEY] = "key",
+    [REPLAY_DISK] = "disk",
+    [REPLAY_END] = "end",
+};
+
+struct replay {
+    bool record;
+    FILE *f; /* the log being written */
+    bool failed;
+
+    /* Replaying: the whole log, with the data of all events in one buffer,
+     * and where the next input and the next disk event are.
+     */
+    struct replay_event *events;
+    size_t len, next, next_disk;
+    uint8_t *data;
+    bool diverged;
+
+    /* Recording: keys the front end has put since hart 0 last looked. */
+    pthread_mutex_t lock;
+    uint8_t keys[REPLAY_MAX_DATA];
+    uint32_t nkeys;
+};
+
+static int hex_digit(const char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Parse one line of the log, keeping its data at the end of *data. */
+static bool replay_parse(const char *line,
+                         struct replay_event *ev,
+                         uint8_t **data,
+                         size_t *data_len)
+{
+    char *end;
+    ev->cycle = strtoull(line, &end, 10);
+    if (end == line || *end != ' ')
+        return false;
+    line = end + 1;
+
+    int kind = -1;
+    for (int i = 0; i < (int) (sizeof(kind_names) / sizeof(kind_names[0]));
+         i++) {
+        size_t n = strlen(kind_names[i]);
+        if (!strncmp(line, kind_names[i], n) &&
+            (line[n] == ' ' || line[n] == '\n' || !line[n])) {
+            kind = i, line += n;
+            break;
+        }
+    }
+    if (kind < 0)
+        return false;
+    ev->kind = kind, ev->len = 0, ev->data = NULL;
+    if (*line == ' ')
+        line++;
+
+    if (kind == REPLAY_DISK) {
+        ev->len = strtoul(line, &end, 10);
+        return end != line;
+    }
+    if (kind == REPLAY_END)
+        return true;
+
+    size_t start = *data_len;
+    while (hex_digit(line[0]) >= 0 && hex_digit(line[1]) >= 0) {
+        if (ev->len == REPLAY_MAX_DATA)
+            return false;
+        *data = realloc(*data, *data_len + 1);
+        (*data)[(*data_len)++] = hex_digit(line[0]) << 4 | hex_digit(line[1]);
+        ev->len++, line += 2;
+    }
+    ev->data = (const uint8_t *) (uintptr_t) start; /* fixed up after */
+    return ev->len > 0;
+}
+
+static bool replay_load(struct replay *replay, FILE *f)
+{
+    char *line = NULL;
+    size_t cap = 0, events_cap = 0, data_len = 0;
+    bool ok = true;
+    while (ok && getline(&line, &cap, f) > 0) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (replay->len == events_cap) {
+            events_cap = events_cap ? 2 * events_cap : 256;
+            replay->events = realloc(replay->events,
+                                     events_cap * sizeof(struct replay_event));
+        }
+        struct replay_event *ev = &replay->events[replay->len];
+        ok = replay_parse(line, ev, &replay->data, &data_len) &&
+             (!replay->len || ev->cycle >= ev[-1].cycle);
+        replay->len++;
+    }
+    free(line);
+
+    for (size_t i = 0; i < replay->len; i++)
+        if (replay->events[i].len && replay->events[i].kind != REPLAY_DISK)
+            replay->events[i].data =
+                replay->data + (uintptr_t) replay->events[i].data;
+    return ok;
+}
+
+struct replay *replay_new(const char *path, const bool record)
+{
+    struct replay *replay = calloc(1, sizeof(struct replay));
+    replay->record = record;
+    pthread_mutex_init(&replay->lock, NULL);
+
+    FILE *f = fopen(path, record ? "w" : "r");
+    if (!f)
+        goto fail;
+    if (record) {
+        /* A line at a time, so that a run that is killed keeps its log. */
+        replay->f = f;
+        setvbuf(f, NULL, _IOLBF, 0);
+        fputs(REPLAY_HEADER, f);
+        return replay;
+    }
+    bool ok = replay_load(replay, f);
+    fclose(f);
+    if (ok)
+        return replay;
+
+fail:
+    free(replay->events);
+    free(replay->data);
+    free(replay);
+    return NULL;
+}
+
+bool replay_recording(const struct replay *replay)
+{
+    return replay->record;
+}
+
+void replay_log(struct replay *replay,
+                const enum replay_kind kind,
+                const uint64_t cycle,
+                const uint8_t *data,
+                const uint32_t len)
+{
+    FILE *f = replay->f;
+    fprintf(f, "%" PRIu64 " %s", cycle, kind_names[kind]);
+    if (kind == REPLAY_DISK) {
+        fprintf(f, " %" PRIu32, len);
+    } else if (len) {
+        fputc(' ', f);
+        for (uint32_t i = 0; i < len; i++)
+            fprintf(f, "%02x", data[i]);
+    }
+    if (fputc('\n', f) == EOF)
+        replay->failed = true;
+}
+
+/* Keys beyond REPLAY_MAX_DATA would overflow the keyboard queue anyway. */
+void replay_stage_key(struct replay *replay, const uint8_t code)
+{
+    pthread_mutex_lock(&replay->lock);
+    if (replay->nkeys < REPLAY_MAX_DATA)
+        replay->keys[replay->nkeys++] = code;
+    pthread_mutex_unlock(&replay->lock);
+}
+
+uint32_t replay_take_keys(struct replay *replay, uint8_t *codes)
+{
+    pthread_mutex_lock(&replay->lock);
+    uint32_t n = replay->nkeys;
+    memcpy(codes, replay->keys, n);
+    replay->nkeys = 0;
+    pthread_mutex_unlock(&replay->lock);
+    return n;
+}
+
+/* Disk events are only compared, so they are skipped here. */
+static size_t replay_skip_disk(const struct replay *replay, size_t i)
+{
+    while (i < replay->len && replay->events[i].kind == REPLAY_DISK)
+        i++;
+    return i;
+}
+
+const struct replay_event *replay_next(struct replay *replay,
+                                       const uint64_t now)
+{
+    replay->next = replay_skip_disk(replay, replay->next);
+    if (replay->next == replay->len || replay->events[replay->next].cycle > now)
+        return NULL;
+    return &replay->events[replay->next++];
+}
+
+uint64_t replay_due(const struct replay *replay)
+{
+    size_t i = replay_skip_disk(replay, replay->next);
+    return i < replay->len ? replay->events[i].cycle : UINT64_MAX;
+}
+
+void replay_disk(struct replay *replay,
+                 const uint64_t cycle,
+                 const uint32_t count)
+{
+    if (replay->record) {
+        replay_log(replay, REPLAY_DISK, cycle, NULL, count);
+        return;
+    }
+
+    size_t i = replay->next_disk;
+    while (i < replay->len && replay->events[i].kind != REPLAY_DISK)
+        i++;
+    bool same = i < replay->len && replay->events[i].cycle == cycle &&
+                replay->events[i].len == count;
+    replay->next_disk = i < replay->len ? i + 1 : i;
+    if (!same && !replay->diverged) {
+        fprintf(stderr,
+                "replay: disk requests retired at instruction %" PRIu64
+                " differ from the recording\n",
+                cycle);
+        replay->diverged = true;
+    }
+}
+
+bool replay_close(struct replay *replay)
+{
+    bool ok = !replay->failed && !replay->diverged;
+    if (replay->f && fclose(replay->f) == EOF)
+        ok = false;
+    free(replay->events);
+    free(replay->data);
+    free(replay);
+    return ok;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+/* Record and replay of what reaches the machine from outside: bytes arriving
+ * at the UART and keys, each stamped with the number of instructions hart 0
+ * had retired when the guest could first see it, plus disk completions,
+ * which the cycle clock already makes reproducible and which are only
+ * compared, to tell when a replay has gone its own way. The log is text, one
+ * event per line:
+ *
+ *     <cycle> uart <hex bytes>
+ *     <cycle> key <hex scancodes>
+ *     <cycle> disk <requests retired>
+ *     <cycle> end
+ *
+ * where end marks the point at which the recorded run was stopped.
+ */
+#define REPLAY_MAX_DATA 256
+
+enum replay_kind { REPLAY_UART, REPLAY_KEY, REPLAY_DISK, REPLAY_END };
+
+struct replay_event {
+    uint64_t cycle;
+    enum replay_kind kind;
+    uint32_t len; /* bytes of data, or requests retired for REPLAY_DISK */
+    const uint8_t *data;
+};
+
+struct replay;
+
+/* Start a log at path to record into, or read one to replay; NULL on an I/O
+ * error or a malformed log.
+ */
+struct replay *replay_new(const char *path, const bool record);
+bool replay_recording(const struct replay *replay);
+
+/* Recording: append an event, and hold keys from the front end until hart 0
+ * takes them (into codes, of room for REPLAY_MAX_DATA).
+ */
+void replay_log(struct replay *replay,
+                const enum replay_kind kind,
+                const uint64_t cycle,
+                const uint8_t *data,
+                const uint32_t len);
+void replay_stage_key(struct replay *replay, const uint8_t code);
+uint32_t replay_take_keys(struct replay *replay, uint8_t *codes);
+
+/* Replaying: the next UART, key or end event that is due at now, if any, and
+ * the cycle at which the next one is due, or UINT64_MAX.
+ */
+const struct replay_event *replay_next(struct replay *replay,
+                                       const uint64_t now);
+uint64_t replay_due(const struct replay *replay);
+
+/* count disk requests have been retired at cycle: logged when recording,
+ * and compared with the log when replaying.
+ */
+void replay_disk(struct replay *replay,
+                 const uint64_t cycle,
+                 const uint32_t count);
+
+/* Returns false if the log could not be written or the replay diverged. */
+bool replay_close(struct replay *replay);
@@ -17,6 +17,7 @@ int WindowWidth = 0;
 int WindowHeight = 0;
 
 bool ScreenFirstDraw = true;
+bool ScreenExposed = false;
 
 SDL_Window *ScreenWindow;
 SDL_Renderer *ScreenRenderer;
@@ -51,7 +52,10 @@ void ScreenInit() {
 }
 
 void ScreenDraw() {
-    MainScreen.Draw(&MainScreen);
+    /* Skip presenting when nothing changed and the window is intact. */
+    if (!MainScreen.Draw(&MainScreen) && !ScreenFirstDraw && !ScreenExposed)
+        return;
+    ScreenExposed = false;
 
     SDL_Rect screenrect = {
         .w = MainScreen.Width,
@@ -100,6 +104,8 @@ int ScreenProcessEvents() {
             }
 
             case SDL_WINDOWEVENT: {
+                if (event.window.event == SDL_WINDOWEVENT_EXPOSED)
+                    ScreenExposed = true;
                 break;
             }
 
@@ -1,10 +1,12 @@
 #pragma once
 
 #include <SDL.h>
+#include <stdbool.h>
 
 struct Screen;
 
-typedef void (*ScreenDrawF)(struct Screen *screen);
+/* Returns false if the texture is unchanged. */
+typedef bool (*ScreenDrawF)(struct Screen *screen);
 typedef void (*ScreenKeyPressedF)(int sdl_scancode);
 typedef void (*ScreenKeyReleasedF)(int sdl_scancode);
 typedef void (*ScreenMousePressedF)(int button);
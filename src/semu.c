@@ -1,6 +1,12 @@
 // CPU emulator is a modified version of semu, written by Jim Huang (jserv)
 // https://github.com/jserv/semu
 
+#define _DEFAULT_SOURCE /* pthread_condattr_setclock, MAP_ANONYMOUS */
+
+#include <errno.h>
+#include <fenv.h>
+#include <inttypes.h>
+#include <math.h>
 #include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -8,27 +14,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "disk.h"
 #include "keyboard.h"
+#include "replay.h"
 #include "semu.h"
 #include "mul128.h"
-
-/* Range check
- * For any variable range checking:
- *     if (x >= minx && x <= maxx) ...
- * it is faster to use bit operation:
- *     if ((signed)((x - minx) | (maxx - x)) >= 0) ...
- */
-#define RANGE_CHECK(x, minx, size) \
-    ((int32_t) ((x - minx) | (minx + size - 1 - x)) >= 0)
+#if defined(JIT)
+#include "jit.h"
+#endif
 
 /* CSR is Control Status Register representation in RISC-V privileged
  * architecture.
  */
 
+/* Unprivileged floating-point CSRs: fflags and frm are fields of fcsr. */
+enum { FFLAGS = 0x001, FRM, FCSR };
+
 /* Machine level CSRs */
-enum { MSTATUS = 0x300, MEDELEG = 0x302, MIDELEG, MIE, MTVEC };
+enum { MHARTID = 0xf14 };
+enum { MSTATUS = 0x300, MISA, MEDELEG, MIDELEG, MIE, MTVEC };
 enum { MEPC = 0x341, MCAUSE, MTVAL, MIP };
 
 /* Supervisor level CSRs */
@@ -38,7 +46,18 @@ enum { SEPC = 0x141, SCAUSE, STVAL, SIP, SATP = 0x180 };
 enum { MIP_SSIP = 1ULL << 1, MIP_MSIP = 1ULL << 3, MIP_STIP = 1ULL << 5 };
 enum { MIP_MTIP = 1ULL << 7, MIP_SEIP = 1ULL << 9, MIP_MEIP = 1ULL << 11 };
 
-#define PAGE_SIZE 4096 /* should be configurable */
+/* The FP state field of mstatus, also seen through sstatus, and SD, which
+ * summarizes it: off (FP instructions are illegal), initial, clean or dirty.
+ */
+#define MSTATUS_FS (3ULL << 13)
+#define MSTATUS_FS_INITIAL (1ULL << 13)
+#define MSTATUS_SD (1ULL << 63)
+
+/* RV64 with the I, M, A, F, D, C, S and U extensions. */
+#define MISA_VALUE                                                          \
+    (2ULL << 62 | 1 << ('I' - 'A') | 1 << ('M' - 'A') | 1 << ('A' - 'A') | \
+     1 << ('F' - 'A') | 1 << ('D' - 'A') | 1 << ('C' - 'A') |              \
+     1 << ('S' - 'A') | 1 << ('U' - 'A'))
 
 #define MAX(a, b)               \
     ({                          \
@@ -74,35 +93,172 @@ bool exception_is_fatal(const exception_t e)
     }
 }
 
-struct ram *ram_new(const uint8_t *code, const size_t code_size)
+/* RAM is only reserved here, and backed by the host as the guest touches
+ * it. With huge set, the reservation is aligned for, and asks for,
+ * transparent huge pages, so that a guest walking much of its RAM takes
+ * fewer host TLB misses.
+ */
+struct ram *ram_new(const uint64_t size, const bool huge)
 {
+    uint64_t align = huge ? RAM_HUGE_PAGE_SIZE : 0;
+    uint8_t *map = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    uint8_t *data = map;
+    if (huge) {
+        uint64_t skip = -(uintptr_t) map % RAM_HUGE_PAGE_SIZE;
+        data = map + skip;
+        if (skip)
+            munmap(map, skip);
+        munmap(data + size, align - skip);
+#if defined(MADV_HUGEPAGE)
+        madvise(data, size, MADV_HUGEPAGE);
+#endif
+    }
+
     struct ram *ram = calloc(1, sizeof(struct ram));
-    ram->data = calloc(RAM_SIZE, 1);
-    memcpy(ram->data, code, code_size);
+    ram->data = data;
+    ram->size = size;
+    ram->page_gen = calloc(size / PAGE_SIZE, sizeof(uint32_t));
+    memset(ram->fb_dirty, 0xff, sizeof(ram->fb_dirty));
     return ram;
 }
 
+#define FB_INDEX (FRAMEBUFFER_BASE - RAM_BASE)
+#define FB_SIZE (FRAMEBUFFER_PITCH * FRAMEBUFFER_HEIGHT)
+
+static void ram_mark_framebuffer(struct ram *ram,
+                                 const uint64_t index,
+                                 const uint64_t len)
+{
+    uint64_t start = index > FB_INDEX ? index - FB_INDEX : 0;
+    uint64_t end = index + len - FB_INDEX;
+    if (end > FB_SIZE)
+        end = FB_SIZE;
+    /* Release, so that the render thread sees the pixels once it sees the
+     * bit. A store that skipped the RMW on a bit already set could land
+     * after the render thread cleared it, so always do the RMW.
+     */
+    for (uint64_t y = start / FRAMEBUFFER_PITCH;
+         y <= (end - 1) / FRAMEBUFFER_PITCH; y++)
+        __atomic_fetch_or(&ram->fb_dirty[y / 64], 1ULL << (y % 64),
+                          __ATOMIC_RELEASE);
+}
+
+/* Invalidate the decoded blocks of any page in [index, index + len). */
+static inline void ram_mark_code(struct ram *ram,
+                                 const uint64_t index,
+                                 const uint64_t len)
+{
+    for (uint64_t p = index / PAGE_SIZE; p <= (index + len - 1) / PAGE_SIZE;
+         p++) {
+        if (ram->page_gen[p] & 1)
+            ram->page_gen[p]++;
+    }
+}
+
+/* Note the framebuffer lines [index, index + len) covers. Call this after
+ * the data is in place.
+ */
+static inline void ram_mark_pixels(struct ram *ram,
+                                   const uint64_t index,
+                                   const uint64_t len)
+{
+    if (index < FB_INDEX + FB_SIZE && index + len > FB_INDEX)
+        ram_mark_framebuffer(ram, index, len);
+}
+
+/* Bookkeeping after [index, index + len) of RAM has been written. */
+static inline void ram_mark_written(struct ram *ram,
+                                    const uint64_t index,
+                                    const uint64_t len)
+{
+    ram_mark_code(ram, index, len);
+    ram_mark_pixels(ram, index, len);
+}
+
+/* Move the dirty framebuffer lines to lines[] and clear them. Returns false
+ * if no line was written.
+ */
+bool ram_take_dirty_lines(struct ram *ram, uint64_t lines[])
+{
+    bool any = false;
+    for (size_t i = 0; i < sizeof(ram->fb_dirty) / sizeof(uint64_t); i++) {
+        lines[i] = ram->fb_dirty[i]
+                       ? __atomic_exchange_n(&ram->fb_dirty[i], 0,
+                                             __ATOMIC_ACQUIRE)
+                       : 0;
+        any |= lines[i] != 0;
+    }
+    return any;
+}
+
+/* RAM is little-endian, like the guest. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LE16(x) __builtin_bswap16(x)
+#define LE32(x) __builtin_bswap32(x)
+#define LE64(x) __builtin_bswap64(x)
+#else
+#define LE16(x) (x)
+#define LE32(x) (x)
+#define LE64(x) (x)
+#endif
+
+/* Bookkeeping before value is stored at [addr, addr + size / 8) of RAM. The
+ * framebuffer lines are marked by ram_did_store, once the value has landed.
+ */
+static inline void ram_will_store(struct ram *ram,
+                                  const uint64_t addr,
+                                  const uint64_t size,
+                                  const uint64_t value)
+{
+#if defined(JIT)
+    if (ram->journal)
+        jit_journal_store(ram->journal, ram, addr, size, value);
+#else
+    (void) value;
+#endif
+    ram_mark_code(ram, addr - RAM_BASE, size / 8);
+}
+
+static inline void ram_did_store(struct ram *ram,
+                                 const uint64_t addr,
+                                 const uint64_t size)
+{
+    ram_mark_pixels(ram, addr - RAM_BASE, size / 8);
+}
+
+/* The caller checks that [addr, addr + size / 8) lies in RAM. */
 exception_t ram_load(const struct ram *ram,
                      const uint64_t addr,
                      const uint64_t size,
                      uint64_t *result)
 {
-    uint64_t index = addr - RAM_BASE, tmp = 0;
+    const uint8_t *p = ram->data + (addr - RAM_BASE);
     switch (size) {
-    case 64:
-        tmp |= (uint64_t) (ram->data[index + 7]) << 56;
-        tmp |= (uint64_t) (ram->data[index + 6]) << 48;
-        tmp |= (uint64_t) (ram->data[index + 5]) << 40;
-        tmp |= (uint64_t) (ram->data[index + 4]) << 32;
-    case 32:
-        tmp |= (uint64_t) (ram->data[index + 3]) << 24;
-        tmp |= (uint64_t) (ram->data[index + 2]) << 16;
-    case 16:
-        tmp |= (uint64_t) (ram->data[index + 1]) << 8;
     case 8:
-        tmp |= (uint64_t) (ram->data[index + 0]) << 0;
-        *result = tmp;
+        *result = *p;
+        return OK;
+    case 16: {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        *result = LE16(v);
+        return OK;
+    }
+    case 32: {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        *result = LE32(v);
+        return OK;
+    }
+    case 64: {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        *result = LE64(v);
         return OK;
+    }
     default:
         return LOAD_ACCESS_FAULT;
     }
@@ -113,24 +269,32 @@ exception_t ram_store(struct ram *ram,
                       const uint64_t size,
                       const uint64_t value)
 {
-    uint64_t index = addr - RAM_BASE;
+    uint8_t *p = ram->data + (addr - RAM_BASE);
+    ram_will_store(ram, addr, size, value);
     switch (size) {
-    case 64:
-        ram->data[index + 7] = (value >> 56) & 0xff;
-        ram->data[index + 6] = (value >> 48) & 0xff;
-        ram->data[index + 5] = (value >> 40) & 0xff;
-        ram->data[index + 4] = (value >> 32) & 0xff;
-    case 32:
-        ram->data[index + 3] = (value >> 24) & 0xff;
-        ram->data[index + 2] = (value >> 16) & 0xff;
-    case 16:
-        ram->data[index + 1] = (value >> 8) & 0xff;
     case 8:
-        ram->data[index + 0] = (value >> 0) & 0xff;
-        return OK;
+        *p = value;
+        break;
+    case 16: {
+        uint16_t v = LE16((uint16_t) value);
+        memcpy(p, &v, sizeof(v));
+        break;
+    }
+    case 32: {
+        uint32_t v = LE32((uint32_t) value);
+        memcpy(p, &v, sizeof(v));
+        break;
+    }
+    case 64: {
+        uint64_t v = LE64(value);
+        memcpy(p, &v, sizeof(v));
+        break;
+    }
     default:
         return STORE_AMO_ACCESS_FAULT;
     }
+    ram_did_store(ram, addr, size);
+    return OK;
 }
 
 void fatal(const char *msg)
@@ -139,9 +303,167 @@ void fatal(const char *msg)
     exit(1);
 }
 
-struct clint *clint_new()
+/* mtime follows host time at CPU_HZ, whatever pace the guest runs at. */
+static uint64_t host_ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * CPU_HZ +
+           (uint64_t) ts.tv_nsec * CPU_HZ / 1000000000;
+}
+
+static struct sched *sched_new(void)
+{
+    struct sched *sched = calloc(1, sizeof(struct sched));
+    for (int i = 0; i < N_EVENTS; i++)
+        sched->pos[i] = -1;
+    sched->next = UINT64_MAX;
+    pthread_mutex_init(&sched->lock, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    return sched;
+}
+
+static inline uint64_t sched_now(const struct sched *sched)
+{
+    if (sched->clock == SCHED_CLOCK_CYCLES)
+        return __atomic_load_n(&sched->cycles, __ATOMIC_RELAXED);
+    return host_ticks();
+}
+
+static inline void sched_swap(struct sched *sched, const int i, const int j)
+{
+    struct event tmp = sched->heap[i];
+    sched->heap[i] = sched->heap[j], sched->heap[j] = tmp;
+    sched->pos[sched->heap[i].id] = i, sched->pos[sched->heap[j].id] = j;
+}
+
+/* Restore the heap order around index i after its deadline changed. */
+static void sched_sift(struct sched *sched, int i)
+{
+    while (i > 0 && sched->heap[i].when < sched->heap[(i - 1) / 2].when) {
+        sched_swap(sched, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < sched->len && sched->heap[l].when < sched->heap[min].when)
+            min = l;
+        if (r < sched->len && sched->heap[r].when < sched->heap[min].when)
+            min = r;
+        if (min == i)
+            break;
+        sched_swap(sched, i, min);
+        i = min;
+    }
+}
+
+static void sched_remove(struct sched *sched, const int id)
+{
+    int i = sched->pos[id];
+    if (i < 0)
+        return;
+    sched->pos[id] = -1;
+    if (i != --sched->len) {
+        sched->heap[i] = sched->heap[sched->len];
+        sched->pos[sched->heap[i].id] = i;
+        sched_sift(sched, i);
+    }
+}
+
+/* Make every hart look for interrupts after its current block. */
+static inline void sched_kick(struct sched *sched)
+{
+    for (int i = 0; i < MAX_HARTS; i++)
+        __atomic_store_n(&sched->pending[i], 1, __ATOMIC_RELEASE);
+}
+
+static inline void sched_publish(struct sched *sched)
+{
+    __atomic_store_n(&sched->next, sched->len ? sched->heap[0].when : UINT64_MAX,
+                     __ATOMIC_RELEASE);
+    sched_kick(sched);
+    __atomic_store_n(&sched->posts, sched->posts + 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&sched->wake);
+}
+
+/* Wake the harts in wfi to look for interrupts, outside the heap. */
+static void sched_wake(struct sched *sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    sched_publish(sched);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/* Make id due at when. If it is already pending, it keeps the earlier
+ * deadline unless replace is set. UINT64_MAX cancels it.
+ */
+static void sched_set(struct sched *sched,
+                      const int id,
+                      const uint64_t when,
+                      const bool replace)
+{
+    pthread_mutex_lock(&sched->lock);
+    int i = sched->pos[id];
+    if (when == UINT64_MAX) {
+        sched_remove(sched, id);
+    } else if (i < 0) {
+        i = sched->len++;
+        sched->heap[i] = (struct event){when, id};
+        sched->pos[id] = i;
+        sched_sift(sched, i);
+    } else if (replace || when < sched->heap[i].when) {
+        sched->heap[i].when = when;
+        sched_sift(sched, i);
+    }
+    sched_publish(sched);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/* Take the earliest event that is due at now, or return -1. */
+static int sched_pop(struct sched *sched, const uint64_t now)
+{
+    int id = -1;
+    pthread_mutex_lock(&sched->lock);
+    if (sched->len && sched->heap[0].when <= now) {
+        id = sched->heap[0].id;
+        sched_remove(sched, id);
+        sched_publish(sched);
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return id;
+}
+
+struct clint *clint_new(struct sched *sched)
+{
+    struct clint *clint = calloc(1, sizeof(struct clint));
+    clint->sched = sched;
+    clint->mtime_base = sched_now(sched);
+    for (int i = 0; i < MAX_HARTS; i++)
+        clint->mtimecmp[i] = UINT64_MAX;
+    return clint;
+}
+
+/* Schedule the timer of a hart for when mtime reaches its mtimecmp, or
+ * raise MTIP right away if it already has.
+ */
+static void clint_arm(struct clint *clint, const int hart)
 {
-    return calloc(1, sizeof(struct clint));
+    /* mtime may be ahead of the clock, after a write or a restore, so the
+     * deadline is taken relative to it.
+     */
+    uint64_t now = sched_now(clint->sched), mtime = now - clint->mtime_base;
+    uint64_t when = UINT64_MAX, mtimecmp = clint->mtimecmp[hart];
+    bool due = mtimecmp <= mtime;
+    if (!due && mtimecmp - mtime <= UINT64_MAX - now)
+        when = now + (mtimecmp - mtime);
+
+    __atomic_store_n(&clint->mtip[hart], due, __ATOMIC_RELAXED);
+    sched_set(clint->sched, EVENT_TIMER + hart, due ? UINT64_MAX : when, true);
 }
 
 static inline exception_t clint_load(const struct clint *clint,
@@ -149,19 +471,22 @@ static inline exception_t clint_load(const struct clint *clint,
                                      const uint64_t size,
                                      uint64_t *result)
 {
+    if (addr >= CLINT_MSIP && addr < CLINT_MSIP + 4 * MAX_HARTS) {
+        if (size != 32)
+            return LOAD_ACCESS_FAULT;
+        *result = clint->msip[(addr - CLINT_MSIP) / 4];
+        return OK;
+    }
+
     if (size != 64)
         return LOAD_ACCESS_FAULT;
 
-    switch (addr) {
-    case CLINT_MTIMECMP:
-        *result = clint->mtimecmp;
-        break;
-    case CLINT_MTIME:
-        *result = clint->mtime;
-        break;
-    default:
+    if (addr >= CLINT_MTIMECMP && addr < CLINT_MTIMECMP + 8 * MAX_HARTS)
+        *result = clint->mtimecmp[(addr - CLINT_MTIMECMP) / 8];
+    else if (addr == CLINT_MTIME)
+        *result = sched_now(clint->sched) - clint->mtime_base;
+    else
         *result = 0;
-    }
     return OK;
 }
 
@@ -170,25 +495,64 @@ static inline exception_t clint_store(struct clint *clint,
                                       const uint64_t size,
                                       const uint64_t value)
 {
+    if (addr >= CLINT_MSIP && addr < CLINT_MSIP + 4 * MAX_HARTS) {
+        if (size != 32)
+            return STORE_AMO_ACCESS_FAULT;
+        __atomic_store_n(&clint->msip[(addr - CLINT_MSIP) / 4], value & 1,
+                         __ATOMIC_RELAXED);
+        sched_wake(clint->sched);
+        return OK;
+    }
+
     if (size != 64)
         return STORE_AMO_ACCESS_FAULT;
 
-    switch (addr) {
-    case CLINT_MTIMECMP:
-        clint->mtimecmp = value;
-        break;
-    case CLINT_MTIME:
-        clint->mtime = value;
-        break;
+    if (addr >= CLINT_MTIMECMP && addr < CLINT_MTIMECMP + 8 * MAX_HARTS) {
+        int hart = (addr - CLINT_MTIMECMP) / 8;
+        clint->mtimecmp[hart] = value;
+        clint_arm(clint, hart);
+    } else if (addr == CLINT_MTIME) {
+        clint->mtime_base = sched_now(clint->sched) - value;
+        for (int i = 0; i < MAX_HARTS; i++)
+            clint_arm(clint, i);
     }
     return OK;
 }
 
+/* Raise or clear MSIP and MTIP of a hart from its CLINT registers. */
+static void clint_update(const struct clint *clint,
+                         const int hart,
+                         uint64_t *mip)
+{
+    if (__atomic_load_n(&clint->msip[hart], __ATOMIC_RELAXED))
+        *mip |= MIP_MSIP;
+    else
+        *mip &= ~MIP_MSIP;
+
+    if (__atomic_load_n(&clint->mtip[hart], __ATOMIC_RELAXED))
+        *mip |= MIP_MTIP;
+    else
+        *mip &= ~MIP_MTIP;
+}
+
 struct plic *plic_new()
 {
     return calloc(1, sizeof(struct plic));
 }
 
+/* The hart whose context addr falls in, for a register at base + hart *
+ * stride, or -1.
+ */
+static inline int plic_context(const uint64_t addr,
+                               const uint64_t base,
+                               const uint64_t stride)
+{
+    if (addr < base || (addr - base) % stride)
+        return -1;
+    uint64_t hart = (addr - base) / stride;
+    return hart < MAX_HARTS ? (int) hart : -1;
+}
+
 exception_t plic_load(const struct plic *plic,
                       const uint64_t addr,
                       const uint64_t size,
@@ -197,22 +561,17 @@ exception_t plic_load(const struct plic *plic,
     if (size != 32)
         return LOAD_ACCESS_FAULT;
 
-    switch (addr) {
-    case PLIC_PENDING:
+    int hart;
+    if (addr == PLIC_PENDING)
         *result = plic->pending;
-        break;
-    case PLIC_SENABLE:
-        *result = plic->senable;
-        break;
-    case PLIC_SPRIORITY:
-        *result = plic->spriority;
-        break;
-    case PLIC_SCLAIM:
-        *result = plic->sclaim;
-        break;
-    default:
+    else if ((hart = plic_context(addr, PLIC_SENABLE, 0x100)) >= 0)
+        *result = plic->senable[hart];
+    else if ((hart = plic_context(addr, PLIC_SPRIORITY, 0x2000)) >= 0)
+        *result = plic->spriority[hart];
+    else if ((hart = plic_context(addr, PLIC_SCLAIM, 0x2000)) >= 0)
+        *result = plic->sclaim[hart];
+    else
         *result = 0;
-    }
     return OK;
 }
 
@@ -224,61 +583,257 @@ exception_t plic_store(struct plic *plic,
     if (size != 32)
         return STORE_AMO_ACCESS_FAULT;
 
-    switch (addr) {
-    case PLIC_PENDING:
+    int hart;
+    if (addr == PLIC_PENDING)
         plic->pending = value;
-        break;
-    case PLIC_SENABLE:
-        plic->senable = value;
-        break;
-    case PLIC_SPRIORITY:
-        plic->spriority = value;
-        break;
-    case PLIC_SCLAIM:
-        plic->sclaim = value;
-        break;
-    }
+    else if ((hart = plic_context(addr, PLIC_SENABLE, 0x100)) >= 0)
+        plic->senable[hart] = value;
+    else if ((hart = plic_context(addr, PLIC_SPRIORITY, 0x2000)) >= 0)
+        plic->spriority[hart] = value;
+    else if ((hart = plic_context(addr, PLIC_SCLAIM, 0x2000)) >= 0)
+        plic->sclaim[hart] = value;
     return OK;
 }
 
+static inline unsigned uart_fifo_len(const struct uart *uart)
+{
+    return uart->fifo_tail - uart->fifo_head;
+}
+
+/* Blocks until stdin has input or the UART is closed, then moves as much
+ * input as fits into the FIFO. Once stdin reaches EOF, or fails, only the
+ * wake pipe is watched. When recording, input is staged instead, for hart 0 to move
+ * into the FIFO when it next polls; when replaying, it is dropped.
+ */
 static void *uart_thread_func(void *priv)
 {
     struct uart *uart = (struct uart *) priv;
+    struct pollfd pfd[2] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {uart->wake[0], POLLIN, 0},
+    };
+
     while (1) {
-        struct pollfd pfd = {0, POLLIN, 0};
-        poll(&pfd, 1, 0);
-        if (!(pfd.revents & POLLIN))
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[1].revents)
+            break;
+        if (!pfd[0].revents)
             continue;
-
-        char c;
-        if (read(STDIN_FILENO, &c, 1) <= 0) /* an error or EOF */
+        if (pfd[0].revents & POLLNVAL) {
+            pfd[0].fd = -1; /* stdin is closed */
             continue;
+        }
 
         pthread_mutex_lock(&uart->lock);
-        while ((uart->data[UART_LSR - UART_BASE] & UART_LSR_RX) == 1)
+        while (uart_fifo_len(uart) + uart->stage_len == UART_FIFO_SIZE &&
+               !uart->closing)
             pthread_cond_wait(&uart->cond, &uart->lock);
+        bool closing = uart->closing;
+        unsigned room = UART_FIFO_SIZE - uart_fifo_len(uart) - uart->stage_len;
+        pthread_mutex_unlock(&uart->lock);
+        if (closing)
+            break;
 
-        uart->data[0] = c;
-        uart->interrupting = true;
-        uart->data[UART_LSR - UART_BASE] |= UART_LSR_RX;
+        /* Only this thread adds to the FIFO, so the room can only grow. */
+        uint8_t buf[UART_FIFO_SIZE];
+        ssize_t n = read(STDIN_FILENO, buf, room);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0) {
+            pfd[0].fd = -1; /* EOF, or an error that will not go away */
+            continue;
+        }
+        const struct replay *replay = uart->sched->replay;
+        if (replay && !replay_recording(replay))
+            continue;
+
+        pthread_mutex_lock(&uart->lock);
+        if (replay) {
+            memcpy(uart->stage + uart->stage_len, buf, n);
+            uart->stage_len += n;
+        } else {
+            for (ssize_t i = 0; i < n; i++)
+                uart->fifo[uart->fifo_tail++ % UART_FIFO_SIZE] = buf[i];
+            uart->data[UART_LSR - UART_BASE] |= UART_LSR_RX;
+        }
         pthread_mutex_unlock(&uart->lock);
+        sched_set(uart->sched, EVENT_UART, 0, false);
+    }
+    return NULL;
+}
+
+static inline unsigned uart_tx_len(const struct uart *uart)
+{
+    return uart->tx_tail - uart->tx_head;
+}
+
+static void uart_write(const int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) /* the console went away, drop the output */
+            return;
+        buf += n, len -= n;
     }
+}
+
+static void *uart_tx_thread_func(void *priv)
+{
+    struct uart *uart = (struct uart *) priv;
+
+    pthread_mutex_lock(&uart->lock);
+    while (1) {
+        if (!uart->tx_kick && !uart->closing) {
+            if (uart_tx_len(uart) == 0 || uart->tx_flush == UART_FLUSH_EXIT) {
+                pthread_cond_wait(&uart->tx_cond, &uart->lock);
+                continue; /* the first byte only starts the idle timer */
+            } else {
+                /* Flush once a whole UART_TX_IDLE_MS passes without
+                 * output; any byte written meanwhile starts it over.
+                 */
+                unsigned tail = uart->tx_tail;
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += UART_TX_IDLE_MS * 1000000L;
+                if (ts.tv_nsec >= 1000000000L)
+                    ts.tv_sec++, ts.tv_nsec -= 1000000000L;
+                int r = 0;
+                while (r != ETIMEDOUT && !uart->tx_kick && !uart->closing &&
+                       uart->tx_flush != UART_FLUSH_EXIT)
+                    r = pthread_cond_timedwait(&uart->tx_cond, &uart->lock,
+                                               &ts);
+                if (!uart->tx_kick && !uart->closing &&
+                    (uart->tx_tail != tail ||
+                     uart->tx_flush == UART_FLUSH_EXIT))
+                    continue;
+            }
+        }
+        uart->tx_kick = false;
+
+        unsigned len = uart_tx_len(uart);
+        if (len == 0) {
+            if (uart->closing)
+                break;
+            continue;
+        }
+
+        /* Only this thread drains the ring, so the bytes stay put while
+         * they are written out without the lock.
+         */
+        unsigned start = uart->tx_head % UART_TX_SIZE;
+        if (len > UART_TX_SIZE - start)
+            len = UART_TX_SIZE - start;
+        int fd = uart->tx_fd;
+        pthread_mutex_unlock(&uart->lock);
+        uart_write(fd, &uart->tx[start], len);
+        pthread_mutex_lock(&uart->lock);
 
-    /* should not reach here */
+        uart->tx_head += len;
+        pthread_cond_broadcast(&uart->tx_room);
+    }
+    pthread_mutex_unlock(&uart->lock);
     return NULL;
 }
 
-struct uart *uart_new()
+struct uart *uart_new(struct sched *sched)
 {
     struct uart *uart = calloc(1, sizeof(struct uart));
+    uart->sched = sched;
     uart->data[UART_LSR - UART_BASE] |= UART_LSR_TX;
     pthread_mutex_init(&uart->lock, NULL);
     pthread_cond_init(&uart->cond, NULL);
+    pthread_cond_init(&uart->tx_cond, NULL);
+    pthread_cond_init(&uart->tx_room, NULL);
+    uart->tx_fd = STDOUT_FILENO;
+    uart->tx_flush = UART_FLUSH_LINE;
 
+    /* A pooled UART reads no input, stdin being no one's, and its output
+     * is written by uart_pump.
+     */
+    if (sched->pooled)
+        return uart;
+    if (pipe(uart->wake) < 0)
+        fatal("create the UART wake pipe");
     pthread_create(&uart->tid, NULL, uart_thread_func, (void *) uart);
+    pthread_create(&uart->tx_tid, NULL, uart_tx_thread_func, (void *) uart);
     return uart;
 }
 
+/* Send the output to fd from now on, flushing it as flush says. */
+void uart_console(struct uart *uart,
+                  const int fd,
+                  const enum uart_flush flush)
+{
+    pthread_mutex_lock(&uart->lock);
+    uart->tx_fd = fd, uart->tx_flush = flush;
+    pthread_cond_signal(&uart->tx_cond);
+    pthread_mutex_unlock(&uart->lock);
+}
+
+/* Write out the whole ring, on the thread of a pooled hart. The caller
+ * holds the lock.
+ */
+static void uart_drain(struct uart *uart)
+{
+    while (uart_tx_len(uart) > 0) {
+        unsigned start = uart->tx_head % UART_TX_SIZE;
+        unsigned len = uart_tx_len(uart);
+        if (len > UART_TX_SIZE - start)
+            len = UART_TX_SIZE - start;
+        uart_write(uart->tx_fd, &uart->tx[start], len);
+        uart->tx_head += len;
+    }
+    uart->tx_kick = false;
+}
+
+/* Write out the output of a pooled UART that its flush policy says is due.
+ * The thread running the machine calls this between quanta, so the idle
+ * time is only seen to that resolution.
+ */
+void uart_pump(struct uart *uart)
+{
+    pthread_mutex_lock(&uart->lock);
+    if (uart_tx_len(uart) > 0 && !uart->tx_kick &&
+        uart->tx_flush != UART_FLUSH_EXIT) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t ms = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+        if (uart->tx_tail != uart->tx_seen)
+            uart->tx_seen = uart->tx_tail, uart->tx_seen_ms = ms;
+        else if (ms - uart->tx_seen_ms >= UART_TX_IDLE_MS)
+            uart->tx_kick = true;
+    }
+    if (uart->tx_kick)
+        uart_drain(uart);
+    pthread_mutex_unlock(&uart->lock);
+}
+
+/* Stops both threads, once all pending output has been written. */
+void uart_close(struct uart *uart)
+{
+    pthread_mutex_lock(&uart->lock);
+    if (uart->sched->pooled) {
+        uart_drain(uart);
+        pthread_mutex_unlock(&uart->lock);
+        return;
+    }
+    uart->closing = true;
+    pthread_cond_signal(&uart->cond);
+    pthread_cond_signal(&uart->tx_cond);
+    pthread_mutex_unlock(&uart->lock);
+    pthread_join(uart->tx_tid, NULL);
+    if (write(uart->wake[1], "", 1) == 1)
+        pthread_join(uart->tid, NULL);
+    close(uart->wake[0]);
+    close(uart->wake[1]);
+}
+
 exception_t uart_load(struct uart *uart,
                       const uint64_t addr,
                       const uint64_t size,
@@ -290,8 +845,20 @@ exception_t uart_load(struct uart *uart,
     pthread_mutex_lock(&uart->lock);
     switch (addr) {
     case UART_RHR:
-        pthread_cond_broadcast(&uart->cond);
-        uart->data[UART_LSR - UART_BASE] &= ~UART_LSR_RX;
+        if (uart_fifo_len(uart) == UART_FIFO_SIZE)
+            pthread_cond_signal(&uart->cond);
+        if (uart_fifo_len(uart) > 0)
+            uart->data[0] = uart->fifo[uart->fifo_head++ % UART_FIFO_SIZE];
+        /* Like a level-triggered line, interrupt again while there is
+         * input left.
+         */
+        if (uart_fifo_len(uart) > 0) {
+            uart->interrupting = true;
+            sched_kick(uart->sched);
+        } else {
+            uart->data[UART_LSR - UART_BASE] &= ~UART_LSR_RX;
+        }
+        /* fall through */
     default:
         *result = uart->data[addr - UART_BASE];
     }
@@ -310,8 +877,21 @@ exception_t uart_store(struct uart *uart,
     pthread_mutex_lock(&uart->lock);
     switch (addr) {
     case UART_THR:
-        putchar(value & 0xff);
-        fflush(stdout);
+        if (uart_tx_len(uart) == UART_TX_SIZE && uart->sched->pooled)
+            uart_drain(uart);
+        while (uart_tx_len(uart) == UART_TX_SIZE) {
+            uart->tx_kick = true;
+            pthread_cond_signal(&uart->tx_cond);
+            pthread_cond_wait(&uart->tx_room, &uart->lock);
+        }
+        uart->tx[uart->tx_tail++ % UART_TX_SIZE] = value;
+        if ((uart->tx_flush == UART_FLUSH_LINE && (value & 0xff) == '\n') ||
+            uart_tx_len(uart) >= UART_TX_SIZE / 2) {
+            uart->tx_kick = true;
+            pthread_cond_signal(&uart->tx_cond);
+        } else if (uart_tx_len(uart) == 1) {
+            pthread_cond_signal(&uart->tx_cond); /* start the idle timer */
+        }
         break;
     default:
         uart->data[addr - UART_BASE] = value & 0xff;
@@ -320,6 +900,35 @@ exception_t uart_store(struct uart *uart,
     return OK;
 }
 
+/* Whether uart_is_interrupting might return true, without taking the lock. */
+static inline bool uart_may_interrupt(const struct uart *uart)
+{
+    return __atomic_load_n(&uart->interrupting, __ATOMIC_RELAXED);
+}
+
+/* Make input visible to the guest, on hart 0. There is always room. */
+static void uart_put(struct uart *uart, const uint8_t *buf, const unsigned len)
+{
+    for (unsigned i = 0; i < len && uart_fifo_len(uart) < UART_FIFO_SIZE; i++)
+        uart->fifo[uart->fifo_tail++ % UART_FIFO_SIZE] = buf[i];
+    uart->data[UART_LSR - UART_BASE] |= UART_LSR_RX;
+}
+
+/* EVENT_UART: input has arrived. */
+static void uart_receive(struct uart *uart)
+{
+    pthread_mutex_lock(&uart->lock);
+    if (uart->stage_len) {
+        replay_log(uart->sched->replay, REPLAY_UART, sched_now(uart->sched),
+                   uart->stage, uart->stage_len);
+        uart_put(uart, uart->stage, uart->stage_len);
+        uart->stage_len = 0;
+    }
+    if (uart_fifo_len(uart) > 0)
+        uart->interrupting = true;
+    pthread_mutex_unlock(&uart->lock);
+}
+
 bool uart_is_interrupting(struct uart *uart)
 {
     pthread_mutex_lock(&uart->lock);
@@ -329,18 +938,294 @@ bool uart_is_interrupting(struct uart *uart)
     return interrupting;
 }
 
-struct disk *disk_new(FILE *disk)
+/* Move a whole request between the disk image and RAM at once (DMA). */
+static void disk_serve(struct disk *vio, const struct disk_request *req)
+{
+    uint8_t *buffer = vio->ram->data + (req->address - RAM_BASE);
+
+    if (req->flush) {
+        if (!disk_flush(vio->image))
+            fatal("flush the disk");
+    } else if (!req->length) {
+        return;
+    } else if (req->direction == 1) {
+        /* Read RAM data and write it to a disk directly (DMA). */
+        if (!disk_write(vio->image, buffer, req->length, req->offset))
+            fatal("write to disk");
+    } else {
+        /* Read disk data and write it to RAM directly (DMA). */
+        if (!disk_read(vio->image, buffer, req->length, req->offset))
+            fatal("read from disk");
+    }
+}
+
+static void *disk_thread_func(void *priv)
+{
+    struct disk *vio = (struct disk *) priv;
+    pthread_mutex_lock(&vio->lock);
+    while (1) {
+        while (vio->finished == vio->submitted)
+            pthread_cond_wait(&vio->work, &vio->lock);
+        struct disk_request req = vio->queue[vio->finished % DISK_QUEUE_SIZE];
+        pthread_mutex_unlock(&vio->lock);
+
+        disk_serve(vio, &req);
+
+        pthread_mutex_lock(&vio->lock);
+        __atomic_store_n(&vio->finished, vio->finished + 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&vio->idle);
+        if (vio->sched->clock == SCHED_CLOCK_HOST) {
+            pthread_mutex_unlock(&vio->lock);
+            sched_set(vio->sched, EVENT_DISK, 0, false);
+            pthread_mutex_lock(&vio->lock);
+        }
+    }
+    return NULL;
+}
+
+struct disk *disk_new(struct disk_image *image,
+                      struct ram *ram,
+                      struct sched *sched)
 {
     struct disk *vio = calloc(1, sizeof(struct disk));
-    vio->disk = disk;
+    vio->image = image, vio->ram = ram, vio->sched = sched;
     vio->notify = -1;
+
+    pthread_mutex_init(&vio->lock, NULL);
+    pthread_cond_init(&vio->work, NULL);
+    pthread_cond_init(&vio->idle, NULL);
+    if (image && !sched->pooled)
+        pthread_create(&vio->tid, NULL, disk_thread_func, (void *) vio);
     return vio;
 }
 
-exception_t disk_load(const struct disk *vio,
-                        const uint64_t addr,
-                        const uint64_t size,
-                        uint64_t *result)
+static inline bool ram_holds(const struct ram *ram,
+                             const uint64_t addr,
+                             const uint64_t len)
+{
+    return len <= ram->size && addr - RAM_BASE <= ram->size - len;
+}
+
+/* Split virtqueue layout and the parts of virtio-blk that are implemented. */
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_DRIVER_OK 4
+
+#define VIRTIO_BLK_F_FLUSH (1ULL << 9)
+#define VIRTIO_RING_F_EVENT_IDX (1ULL << 29)
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+#define VIRTIO_BLK_FEATURES \
+    (VIRTIO_BLK_F_FLUSH | VIRTIO_RING_F_EVENT_IDX | VIRTIO_F_VERSION_1)
+
+enum { VIRTIO_BLK_T_IN = 0, VIRTIO_BLK_T_OUT = 1, VIRTIO_BLK_T_FLUSH = 4 };
+enum { VIRTIO_BLK_S_OK = 0, VIRTIO_BLK_S_IOERR = 1, VIRTIO_BLK_S_UNSUPP = 2 };
+
+/* Rings are in guest RAM; a driver that puts them elsewhere is broken. */
+static uint64_t vring_load(const struct disk *vio,
+                           const uint64_t addr,
+                           const uint64_t size)
+{
+    uint64_t value;
+    if (!ram_holds(vio->ram, addr, size / 8))
+        fatal("access the virtqueue: ring outside RAM");
+    ram_load(vio->ram, addr, size, &value);
+    return value;
+}
+
+static void vring_store(struct disk *vio,
+                        const uint64_t addr,
+                        const uint64_t size,
+                        const uint64_t value)
+{
+    if (!ram_holds(vio->ram, addr, size / 8))
+        fatal("access the virtqueue: ring outside RAM");
+    uint8_t *p = vio->ram->data + (addr - RAM_BASE);
+    if (size == 8) {
+        *p = value;
+    } else if (size == 16) {
+        uint16_t v = LE16((uint16_t) value);
+        memcpy(p, &v, sizeof(v));
+    } else {
+        uint32_t v = LE32((uint32_t) value);
+        memcpy(p, &v, sizeof(v));
+    }
+    ram_mark_written(vio->ram, addr - RAM_BASE, size / 8);
+}
+
+/* Store the status of a finished chain and put it on the used ring. */
+static void vblk_complete(struct disk *vio, const struct disk_request *req)
+{
+    struct virtio_blk *vq = &vio->virtio;
+    vring_store(vio, req->status_address, 8, req->status);
+    uint64_t elem = vq->used + 4 + 8 * (vq->used_idx % vq->queue_num);
+    vring_store(vio, elem, 32, req->tag);
+    vring_store(vio, elem + 4, 32, req->used_len);
+    vq->used_idx++;
+}
+
+/* Publish the chains completed since the used index was old, and interrupt
+ * unless the driver asked not to be, or with VIRTIO_RING_F_EVENT_IDX, has
+ * not yet reached the one it waits for.
+ */
+static void vblk_publish(struct disk *vio, const uint16_t old)
+{
+    struct virtio_blk *vq = &vio->virtio;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    vring_store(vio, vq->used + 2, 16, vq->used_idx);
+
+    bool notify;
+    if (vq->features & VIRTIO_RING_F_EVENT_IDX) {
+        uint16_t event = vring_load(vio, vq->avail + 4 + 2 * vq->queue_num, 16);
+        notify = (uint16_t) (vq->used_idx - event - 1) <
+                 (uint16_t) (vq->used_idx - old);
+    } else {
+        notify = !(vring_load(vio, vq->avail, 16) & VIRTQ_AVAIL_F_NO_INTERRUPT);
+    }
+    if (notify) {
+        vq->interrupt_status |= 1;
+        vq->interrupting = true;
+    }
+}
+
+/* Retire the requests the I/O thread has finished, on a hart. RAM read into
+ * is only marked written here, so that the block cache is never touched from
+ * the I/O thread. Tags that the guest does not pick up are
+ * dropped, oldest first; chains from the virtqueue go on its used ring.
+ */
+static void disk_retire(struct disk *vio)
+{
+    uint32_t finished = __atomic_load_n(&vio->finished, __ATOMIC_ACQUIRE);
+    if (finished == vio->retired)
+        return;
+
+    if (vio->sched->replay)
+        replay_disk(vio->sched->replay, sched_now(vio->sched),
+                    finished - vio->retired);
+    bool legacy = false;
+    uint16_t used_idx = vio->virtio.used_idx;
+    for (; vio->retired != finished; vio->retired++) {
+        const struct disk_request *req =
+            &vio->queue[vio->retired % DISK_QUEUE_SIZE];
+        if (req->direction != 1 && req->length)
+            ram_mark_written(vio->ram, req->address - RAM_BASE, req->length);
+
+        if (req->virtio) {
+            if (req->last)
+                vblk_complete(vio, req);
+            continue;
+        }
+        vio->tags[vio->tags_tail++ % DISK_QUEUE_SIZE] = req->tag;
+        if (vio->tags_tail - vio->tags_head > DISK_QUEUE_SIZE)
+            vio->tags_head++;
+        legacy = true;
+    }
+    if (legacy) {
+        vio->done = 0;
+        vio->interrupting = true;
+    }
+    if (vio->virtio.used_idx != used_idx)
+        vblk_publish(vio, used_idx);
+    sched_wake(vio->sched);
+}
+
+/* Wait until at most count requests are left to the I/O thread. */
+static void disk_wait(struct disk *vio, const uint32_t count)
+{
+    pthread_mutex_lock(&vio->lock);
+    while (vio->submitted - vio->finished > count)
+        pthread_cond_wait(&vio->idle, &vio->lock);
+    pthread_mutex_unlock(&vio->lock);
+}
+
+void disk_drain(struct disk *vio)
+{
+    disk_wait(vio, 0);
+    disk_retire(vio);
+}
+
+/* Hand a request to the I/O thread. */
+static void disk_queue(struct disk *vio, const struct disk_request *req)
+{
+    /* The queue is full: let the oldest request finish and retire it. */
+    if (vio->submitted - vio->retired == DISK_QUEUE_SIZE) {
+        disk_wait(vio, DISK_QUEUE_SIZE - 1);
+        disk_retire(vio);
+    }
+
+    vio->queue[vio->submitted % DISK_QUEUE_SIZE] = *req;
+#if defined(STATS)
+    if (!req->virtio || req->last)
+        vio->stats->disk_requests++;
+    if (req->direction == 1)
+        vio->stats->disk_written_bytes += req->length;
+    else
+        vio->stats->disk_read_bytes += req->length;
+#endif
+
+    if (vio->sched->pooled) {
+        /* No I/O thread: serve it now, on the thread running the hart. */
+        disk_serve(vio, &vio->queue[vio->submitted % DISK_QUEUE_SIZE]);
+        vio->submitted++;
+        __atomic_store_n(&vio->finished, vio->submitted, __ATOMIC_RELEASE);
+        if (vio->sched->clock == SCHED_CLOCK_HOST)
+            sched_set(vio->sched, EVENT_DISK, 0, false);
+    } else {
+        pthread_mutex_lock(&vio->lock);
+        vio->submitted++;
+        pthread_cond_signal(&vio->work);
+        pthread_mutex_unlock(&vio->lock);
+    }
+
+    if (vio->sched->clock == SCHED_CLOCK_CYCLES)
+        sched_set(vio->sched, EVENT_DISK, sched_now(vio->sched) + DISK_LATENCY,
+                  false);
+}
+
+static void disk_submit(struct disk *vio, const uint32_t tag)
+{
+    if (!vio->image)
+        fatal("access the disk: no disk image given");
+
+    struct disk_request req = {
+        .address = (uint64_t) vio->buffer_address_high << 32 |
+                   vio->buffer_address_low,
+        .length = (uint64_t) vio->buffer_length_high << 32 |
+                  vio->buffer_length_low,
+        .offset = (uint64_t) vio->sector * 512,
+        .direction = vio->direction,
+        .tag = tag,
+    };
+    if (!ram_holds(vio->ram, req.address, req.length))
+        fatal("DMA: buffer outside RAM");
+    disk_queue(vio, &req);
+}
+
+/* EVENT_DISK: with the host clock, requests have finished; with the cycle
+ * clock, the outstanding ones are due, however long the host takes.
+ */
+static void disk_complete(struct disk *vio)
+{
+    if (vio->sched->clock == SCHED_CLOCK_CYCLES)
+        disk_wait(vio, 0);
+    disk_retire(vio);
+}
+
+/* Only pick up finished requests early when that cannot make a run differ
+ * from the next.
+ */
+static inline void disk_poll(struct disk *vio)
+{
+    if (vio->sched->clock == SCHED_CLOCK_HOST)
+        disk_retire(vio);
+}
+
+exception_t disk_load(struct disk *vio,
+                        const uint64_t addr,
+                        const uint64_t size,
+                        uint64_t *result)
 {
     if (size != 32)
         return LOAD_ACCESS_FAULT;
@@ -374,8 +1259,16 @@ exception_t disk_load(const struct disk *vio,
         *result = vio->sector;
         break;
     case DISK_DONE:
+        disk_poll(vio);
         *result = vio->done;
         break;
+    case DISK_COMPLETED:
+        disk_poll(vio);
+        if (vio->tags_head == vio->tags_tail)
+            *result = 0xffffffff; /* nothing completed */
+        else
+            *result = vio->tags[vio->tags_head++ % DISK_QUEUE_SIZE];
+        break;
     default:
         *result = 0;
     }
@@ -393,6 +1286,7 @@ exception_t disk_store(struct disk *vio,
     switch (addr) {
     case DISK_NOTIFY:
         vio->notify = value;
+        disk_submit(vio, value);
         break;
     case DISK_DIRECTION:
         vio->direction = value;
@@ -419,42 +1313,185 @@ exception_t disk_store(struct disk *vio,
     return OK;
 }
 
-static inline bool disk_is_interrupting(struct disk *vio)
+/* Queue the chain at head. A device may not assume how a request is split
+ * up, so the 16-byte header and the status byte may share descriptors with
+ * the data; each stretch of data in between becomes one request.
+ */
+static void vblk_submit(struct disk *vio, const uint16_t head)
 {
-    if (vio->notify != -1) {
-        vio->notify = -1;
-        return true;
+    struct virtio_blk *vq = &vio->virtio;
+    struct {
+        uint64_t addr, len;
+        bool write;
+    } seg[VIRTIO_QUEUE_MAX];
+    uint32_t n = 0;
+    for (uint16_t i = head;; n++) {
+        if (i >= vq->queue_num || n == vq->queue_num)
+            fatal("serve the virtqueue: malformed descriptor chain");
+        uint64_t desc = vq->desc + 16 * i;
+        uint16_t flags = vring_load(vio, desc + 12, 16);
+        seg[n].addr = vring_load(vio, desc, 64);
+        seg[n].len = vring_load(vio, desc + 8, 32);
+        seg[n].write = flags & VIRTQ_DESC_F_WRITE;
+        if (!ram_holds(vio->ram, seg[n].addr, seg[n].len))
+            fatal("DMA: buffer outside RAM");
+        if (!(flags & VIRTQ_DESC_F_NEXT)) {
+            n++;
+            break;
+        }
+        i = vring_load(vio, desc + 14, 16);
+    }
+
+    uint8_t header[16];
+    uint32_t first = 0, last = n;
+    for (uint64_t got = 0; got < sizeof(header);) {
+        if (first == n || seg[first].write)
+            fatal("serve the virtqueue: malformed block request");
+        uint64_t len = sizeof(header) - got;
+        if (len > seg[first].len)
+            len = seg[first].len;
+        memcpy(header + got, vio->ram->data + (seg[first].addr - RAM_BASE),
+               len);
+        got += len, seg[first].addr += len, seg[first].len -= len;
+        if (!seg[first].len)
+            first++;
+    }
+    while (last > first && !seg[last - 1].len)
+        last--;
+    if (last == first || !seg[last - 1].write)
+        fatal("serve the virtqueue: malformed block request");
+    struct disk_request end = {
+        .virtio = true,
+        .last = true,
+        .tag = head,
+        .status = VIRTIO_BLK_S_OK,
+        .used_len = 1,
+    };
+    end.status_address = seg[last - 1].addr + --seg[last - 1].len;
+
+    uint32_t type;
+    uint64_t sector, length = 0;
+    memcpy(&type, header, sizeof(type));
+    memcpy(&sector, header + 8, sizeof(sector));
+    type = LE32(type), sector = LE64(sector);
+    for (uint32_t i = first; i < last; i++) {
+        length += seg[i].len;
+        if (seg[i].len && seg[i].write != (type == VIRTIO_BLK_T_IN))
+            end.status = VIRTIO_BLK_S_IOERR;
+    }
+
+    uint64_t capacity = disk_size(vio->image) / 512;
+    if (type == VIRTIO_BLK_T_FLUSH) {
+        end.flush = true;
+    } else if (type != VIRTIO_BLK_T_IN && type != VIRTIO_BLK_T_OUT) {
+        end.status = VIRTIO_BLK_S_UNSUPP;
+    } else if (sector > capacity || length > (capacity - sector) * 512) {
+        end.status = VIRTIO_BLK_S_IOERR;
+    } else if (end.status == VIRTIO_BLK_S_OK) {
+        uint64_t offset = sector * 512;
+        for (uint32_t i = first; i < last; offset += seg[i++].len) {
+            if (!seg[i].len)
+                continue;
+            struct disk_request req = {
+                .address = seg[i].addr,
+                .length = seg[i].len,
+                .offset = offset,
+                .direction = type == VIRTIO_BLK_T_OUT,
+                .virtio = true,
+            };
+            disk_queue(vio, &req);
+        }
+        if (type == VIRTIO_BLK_T_IN)
+            end.used_len += length;
     }
-    return false;
+    disk_queue(vio, &end);
 }
 
-static inline uint64_t disk_read(const struct disk *vio, uint64_t addr)
+/* Queue every chain the driver has made available since the last notify. */
+static void vblk_notify(struct disk *vio)
 {
-    uint8_t buffer;
-    fseek(vio->disk, addr, SEEK_SET);
-    fread(&buffer, 1, 1, vio->disk);
-    return (uint64_t) buffer;
+    struct virtio_blk *vq = &vio->virtio;
+    if (!vio->image || !vq->queue_ready ||
+        !(vq->status & VIRTIO_STATUS_DRIVER_OK))
+        return;
+
+    uint16_t idx = vring_load(vio, vq->avail + 2, 16);
+    if ((uint16_t) (idx - vq->last_avail) > vq->queue_num)
+        fatal("serve the virtqueue: malformed available ring");
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    while (vq->last_avail != idx) {
+        uint64_t ring = vq->avail + 4 + 2 * (vq->last_avail++ % vq->queue_num);
+        vblk_submit(vio, vring_load(vio, ring, 16));
+    }
+    /* With VIRTIO_RING_F_EVENT_IDX, ask to be notified of the next one. */
+    if (vq->features & VIRTIO_RING_F_EVENT_IDX)
+        vring_store(vio, vq->used + 4 + 8 * vq->queue_num, 16, vq->last_avail);
 }
 
-static inline void disk_write(struct disk *vio,
-                                     uint64_t addr,
-                                     uint64_t value)
+/* Writing 0 to the status resets the device, once what is in flight has
+ * been served.
+ */
+static void vblk_reset(struct disk *vio)
 {
-    uint8_t buffer = (uint8_t) value;
-    fseek(vio->disk, addr, SEEK_SET);
-    fwrite(&buffer, 1, 1, vio->disk);
+    if (vio->image)
+        disk_wait(vio, 0);
+    disk_retire(vio);
+    memset(&vio->virtio, 0, sizeof(vio->virtio));
 }
 
-exception_t kbd_load(const uint64_t addr,
-                    const uint64_t size,
-                    uint64_t *result)
+exception_t vblk_load(struct disk *vio,
+                      const uint64_t addr,
+                      const uint64_t size,
+                      uint64_t *result)
 {
+    struct virtio_blk *vq = &vio->virtio;
+
+    /* The capacity, in reads of any width. */
+    if (addr >= VIRTIO_CONFIG) {
+        uint64_t offset = addr - VIRTIO_CONFIG;
+        uint64_t capacity = vio->image ? disk_size(vio->image) / 512 : 0;
+        if (offset + size / 8 > 8)
+            *result = 0;
+        else if (size == 64)
+            *result = capacity;
+        else
+            *result = capacity >> (8 * offset) & ((1ULL << size) - 1);
+        return OK;
+    }
     if (size != 32)
         return LOAD_ACCESS_FAULT;
 
     switch (addr) {
-    case KBD_GET:
-        *result = (uint64_t) key_take();
+    case VIRTIO_MAGIC:
+        *result = 0x74726976; /* "virt" */
+        break;
+    case VIRTIO_VERSION:
+        *result = 2;
+        break;
+    case VIRTIO_DEVICE_ID:
+        *result = vio->image ? 2 : 0; /* a block device, or none */
+        break;
+    case VIRTIO_VENDOR_ID:
+        *result = 0x666F7864;
+        break;
+    case VIRTIO_DEVICE_FEATURES:
+        *result = vq->device_features_sel < 2
+                      ? (uint32_t) (VIRTIO_BLK_FEATURES >>
+                                    (32 * vq->device_features_sel))
+                      : 0;
+        break;
+    case VIRTIO_QUEUE_NUM_MAX:
+        *result = vq->queue_sel ? 0 : VIRTIO_QUEUE_MAX;
+        break;
+    case VIRTIO_QUEUE_READY:
+        *result = vq->queue_sel ? 0 : vq->queue_ready;
+        break;
+    case VIRTIO_INTERRUPT_STATUS:
+        disk_poll(vio);
+        *result = vq->interrupt_status;
+        break;
+    case VIRTIO_STATUS:
+        *result = vq->status;
         break;
     default:
         *result = 0;
@@ -462,145 +1499,901 @@ exception_t kbd_load(const uint64_t addr,
     return OK;
 }
 
-struct bus *bus_new(struct ram *ram, struct disk *vio)
+exception_t vblk_store(struct disk *vio,
+                       const uint64_t addr,
+                       const uint64_t size,
+                       const uint64_t value)
 {
-    struct bus *bus = calloc(1, sizeof(struct bus));
-    bus->ram = ram, bus->disk = vio;
-    bus->clint = clint_new(), bus->plic = plic_new(), bus->uart = uart_new();
-    return bus;
+    struct virtio_blk *vq = &vio->virtio;
+    if (size != 32)
+        return STORE_AMO_ACCESS_FAULT;
+
+    /* The registers of queues other than 0 are ignored. */
+    uint64_t *queue_addr = NULL;
+    switch (addr) {
+    case VIRTIO_DEVICE_FEATURES_SEL:
+        vq->device_features_sel = value;
+        break;
+    case VIRTIO_DRIVER_FEATURES:
+        if (vq->driver_features_sel < 2) {
+            int shift = 32 * vq->driver_features_sel;
+            vq->features = (vq->features & ~(0xffffffffULL << shift)) |
+                           ((uint64_t) (uint32_t) value << shift &
+                            VIRTIO_BLK_FEATURES);
+        }
+        break;
+    case VIRTIO_DRIVER_FEATURES_SEL:
+        vq->driver_features_sel = value;
+        break;
+    case VIRTIO_QUEUE_SEL:
+        vq->queue_sel = value;
+        break;
+    case VIRTIO_QUEUE_NUM:
+        if (!vq->queue_sel && value >= 1 && value <= VIRTIO_QUEUE_MAX)
+            vq->queue_num = value;
+        break;
+    case VIRTIO_QUEUE_READY:
+        if (!vq->queue_sel)
+            vq->queue_ready = value & 1;
+        break;
+    case VIRTIO_QUEUE_NOTIFY:
+        if (value == 0)
+            vblk_notify(vio);
+        break;
+    case VIRTIO_INTERRUPT_ACK:
+        vq->interrupt_status &= ~value;
+        break;
+    case VIRTIO_STATUS:
+        /* Only the version 1 interface is offered. */
+        if (!value)
+            vblk_reset(vio);
+        else if ((value & VIRTIO_STATUS_FEATURES_OK) &&
+                 !(vq->features & VIRTIO_F_VERSION_1))
+            vq->status = value & ~VIRTIO_STATUS_FEATURES_OK;
+        else
+            vq->status = value;
+        break;
+    case VIRTIO_QUEUE_DESC_LOW:
+    case VIRTIO_QUEUE_DESC_HIGH:
+        queue_addr = &vq->desc;
+        break;
+    case VIRTIO_QUEUE_DRIVER_LOW:
+    case VIRTIO_QUEUE_DRIVER_HIGH:
+        queue_addr = &vq->avail;
+        break;
+    case VIRTIO_QUEUE_DEVICE_LOW:
+    case VIRTIO_QUEUE_DEVICE_HIGH:
+        queue_addr = &vq->used;
+        break;
+    }
+
+    /* The high half of each address follows the low one by 4. */
+    if (queue_addr && !vq->queue_sel) {
+        if (addr & 4)
+            *queue_addr = (*queue_addr & 0xffffffffULL) |
+                          (uint64_t) (uint32_t) value << 32;
+        else
+            *queue_addr = (*queue_addr & ~0xffffffffULL) | (uint32_t) value;
+    }
+    return OK;
 }
 
-exception_t bus_load(const struct bus *bus,
+/* Whether disk_is_interrupting might return true, without the bus lock. */
+static inline bool disk_may_interrupt(const struct disk *vio)
+{
+    return __atomic_load_n(&vio->interrupting, __ATOMIC_RELAXED);
+}
+
+static inline bool disk_is_interrupting(struct disk *vio)
+{
+    bool interrupting = vio->interrupting;
+    vio->interrupting = false;
+    return interrupting;
+}
+
+static inline bool vblk_may_interrupt(const struct disk *vio)
+{
+    return __atomic_load_n(&vio->virtio.interrupting, __ATOMIC_RELAXED);
+}
+
+static inline bool vblk_is_interrupting(struct disk *vio)
+{
+    bool interrupting = vio->virtio.interrupting;
+    vio->virtio.interrupting = false;
+    return interrupting;
+}
+
+exception_t kbd_load(struct keyboard *kbd,
                      const uint64_t addr,
                      const uint64_t size,
                      uint64_t *result)
 {
-    if (RANGE_CHECK(addr, CLINT_BASE, CLINT_SIZE))
-        return clint_load(bus->clint, addr, size, result);
-    if (RANGE_CHECK(addr, PLIC_BASE, PLIC_SIZE))
-        return plic_load(bus->plic, addr, size, result);
-    if (RANGE_CHECK(addr, UART_BASE, UART_SIZE))
-        return uart_load(bus->uart, addr, size, result);
-    if (RANGE_CHECK(addr, DISK_BASE, DISK_SIZE))
-        return disk_load(bus->disk, addr, size, result);
-    if (RANGE_CHECK(addr, KBD_BASE, KBD_SIZE))
-        return kbd_load(addr, size, result);
-    if (RAM_BASE <= addr)
-        return ram_load(bus->ram, addr, size, result);
+    if (size != 32)
+        return LOAD_ACCESS_FAULT;
 
-    return LOAD_ACCESS_FAULT;
+    switch (addr) {
+    case KBD_GET:
+        *result = (uint64_t) key_take(kbd);
+        break;
+    default:
+        *result = 0;
+    }
+    return OK;
 }
 
-exception_t bus_store(struct bus *bus,
-                      const uint64_t addr,
-                      const uint64_t size,
-                      const uint64_t value)
+/* Clip a span of len pixels at pos to the length of the screen, limit. */
+static inline uint32_t blit_clip(const uint32_t pos,
+                                 const uint32_t len,
+                                 const uint32_t limit)
 {
-    if (RANGE_CHECK(addr, CLINT_BASE, CLINT_SIZE))
-        return clint_store(bus->clint, addr, size, value);
-    if (RANGE_CHECK(addr, PLIC_BASE, PLIC_SIZE))
-        return plic_store(bus->plic, addr, size, value);
-    if (RANGE_CHECK(addr, UART_BASE, UART_SIZE))
-        return uart_store(bus->uart, addr, size, value);
-    if (RANGE_CHECK(addr, DISK_BASE, DISK_SIZE))
-        return disk_store(bus->disk, addr, size, value);
-    if (RAM_BASE <= addr)
-        return ram_store(bus->ram, addr, size, value);
-
-    return STORE_AMO_ACCESS_FAULT;
+    return pos >= limit ? 0 : len < limit - pos ? len : limit - pos;
 }
 
-void bus_disk_access(struct bus *bus)
+static inline uint32_t *blit_pixel(struct ram *ram,
+                                   const uint32_t x,
+                                   const uint32_t y)
 {
-    uint32_t address_high;
-    uint32_t address_low;
-    uint64_t address;
-    if (bus_load(bus, DISK_BUFFER_ADDR_HIGH, 32, &address_high) != OK)
-        fatal("read high address");
-    if (bus_load(bus, DISK_BUFFER_ADDR_LOW, 32, &address_low) != OK)
-        fatal("read low address");
-    address = address_high << 32 | address_low;
+    return (uint32_t *) (ram->data + (FRAMEBUFFER_BASE - RAM_BASE) +
+                         (uint64_t) y * FRAMEBUFFER_PITCH + x * 4);
+}
 
-    uint32_t length_high;
-    uint32_t length_low;
-    uint64_t length;
-    if (bus_load(bus, DISK_BUFFER_LEN_HIGH, 32, &length_high) != OK)
-        fatal("read high length");
-    if (bus_load(bus, DISK_BUFFER_LEN_LOW, 32, &length_low) != OK)
-        fatal("read low length");
-    length = length_high << 32 | length_low;
+static void blit_fill(struct ram *ram,
+                      const struct blit *blit,
+                      const uint32_t w,
+                      const uint32_t h)
+{
+    uint32_t color = LE32(blit->fg);
+    bool bytes = (color & 0xff) * 0x01010101u == color;
+    for (uint32_t y = 0; y < h; y++) {
+        uint32_t *row = blit_pixel(ram, blit->dst_x, blit->dst_y + y);
+        if (bytes) {
+            memset(row, color & 0xff, (size_t) w * 4);
+        } else {
+            for (uint32_t x = 0; x < w; x++)
+                row[x] = color;
+        }
+    }
+}
 
-    uint32_t sector;
-    if (bus_load(bus, DISK_SECTOR, 32, &sector) != OK)
-        fatal("read sector");
+/* Rows are copied in the order that reads each before it is overwritten. */
+static void blit_copy(struct ram *ram,
+                      const struct blit *blit,
+                      const uint32_t w,
+                      const uint32_t h)
+{
+    bool up = blit->dst_y > blit->src_y;
+    for (uint32_t i = 0; i < h; i++) {
+        uint32_t y = up ? h - 1 - i : i;
+        memmove(blit_pixel(ram, blit->dst_x, blit->dst_y + y),
+                blit_pixel(ram, blit->src_x, blit->src_y + y),
+                (size_t) w * 4);
+    }
+}
 
-    uint32_t direction;
-    if (bus_load(bus, DISK_DIRECTION, 32, &direction) != OK)
-        fatal("read direction");
+static bool blit_expand(struct ram *ram,
+                        const struct blit *blit,
+                        const uint32_t w,
+                        const uint32_t h)
+{
+    uint64_t row_bytes = ((uint64_t) blit->src_x + w + 7) / 8;
+    if (h && !ram_holds(ram, blit->src_addr,
+                        (uint64_t) (h - 1) * blit->src_pitch + row_bytes))
+        return false;
 
-    if (direction == 1) {
-        /* Read RAM data and write it to a disk directly (DMA). */
-        for (uint64_t i = 0; i < length; i++) {
-            uint64_t data;
-            if (bus_load(bus, address + i, 8, &data) != OK)
-                fatal("read from RAM");
-            disk_write(bus->disk, sector * 512 + i, data);
-        }
-    } else {
-        /* Read disk data and write it to RAM directly (DMA). */
-        for (uint64_t i = 0; i < length; i++) {
-            uint64_t data = disk_read(bus->disk, sector * 512 + i);
-            if (bus_store(bus, address + i, 8, data) != OK)
-                fatal("write to RAM");
+    uint32_t fg = LE32(blit->fg), bg = LE32(blit->bg);
+    bool opaque = !(blit->flags & BLIT_TRANSPARENT);
+    for (uint32_t y = 0; y < h; y++) {
+        const uint8_t *bits = ram->data + (blit->src_addr - RAM_BASE) +
+                              (uint64_t) y * blit->src_pitch;
+        uint32_t *row = blit_pixel(ram, blit->dst_x, blit->dst_y + y);
+        for (uint32_t x = 0; x < w; x++) {
+            uint32_t bit = blit->src_x + x;
+            if ((bits[bit / 8] << (bit % 8)) & 0x80)
+                row[x] = fg;
+            else if (opaque)
+                row[x] = bg;
         }
     }
+    return true;
+}
+
+/* Run an operation on the framebuffer in RAM. Its lines are marked for the
+ * next frame, and decoded blocks on its pages dropped, as for any store.
+ */
+static void blit_run(struct blit *blit, struct bus *bus, const uint32_t op)
+{
+    struct ram *ram = bus->ram;
+    uint32_t w = blit_clip(blit->dst_x, blit->width, FRAMEBUFFER_WIDTH);
+    uint32_t h = blit_clip(blit->dst_y, blit->height, FRAMEBUFFER_HEIGHT);
+    bool ok = true;
+
+    switch (op) {
+    case BLIT_FILL:
+        blit_fill(ram, blit, w, h);
+        break;
+    case BLIT_COPY:
+        w = blit_clip(blit->src_x, w, FRAMEBUFFER_WIDTH);
+        h = blit_clip(blit->src_y, h, FRAMEBUFFER_HEIGHT);
+        blit_copy(ram, blit, w, h);
+        break;
+    case BLIT_EXPAND:
+        ok = blit_expand(ram, blit, w, h);
+        break;
+    default:
+        ok = false;
+    }
 
-    if (bus_store(bus, DISK_DONE, 32, 0) != OK)
-        fatal("write done");
+    blit->error = !ok;
+    if (ok && w && h) {
+        uint64_t first = (uint8_t *) blit_pixel(ram, blit->dst_x, blit->dst_y) -
+                         ram->data;
+        ram_mark_written(ram, first,
+                         (uint64_t) (h - 1) * FRAMEBUFFER_PITCH + w * 4);
+#if defined(STATS)
+        bus->stats->blits++;
+        bus->stats->blit_pixels += (uint64_t) w * h;
+#endif
+    }
+    blit->done++;
+    blit->interrupting = true;
+    sched_wake(bus->sched);
 }
 
-struct cpu *cpu_new(uint8_t *code, const size_t code_size, FILE *disk)
+exception_t blit_load(struct blit *blit,
+                      const uint64_t addr,
+                      const uint64_t size,
+                      uint64_t *result)
 {
-    struct cpu *cpu = calloc(1, sizeof(struct cpu));
+    if (size != 32)
+        return LOAD_ACCESS_FAULT;
 
-    /* Initialize the sp(x2) register. */
-    cpu->regs[2] = RAM_BASE + RAM_SIZE;
+    switch (addr) {
+    case BLIT_DST_X:
+        *result = blit->dst_x;
+        break;
+    case BLIT_DST_Y:
+        *result = blit->dst_y;
+        break;
+    case BLIT_WIDTH:
+        *result = blit->width;
+        break;
+    case BLIT_HEIGHT:
+        *result = blit->height;
+        break;
+    case BLIT_SRC_X:
+        *result = blit->src_x;
+        break;
+    case BLIT_SRC_Y:
+        *result = blit->src_y;
+        break;
+    case BLIT_FG:
+        *result = blit->fg;
+        break;
+    case BLIT_BG:
+        *result = blit->bg;
+        break;
+    case BLIT_FLAGS:
+        *result = blit->flags;
+        break;
+    case BLIT_SRC_ADDR_LOW:
+        *result = (uint32_t) blit->src_addr;
+        break;
+    case BLIT_SRC_ADDR_HIGH:
+        *result = blit->src_addr >> 32;
+        break;
+    case BLIT_SRC_PITCH:
+        *result = blit->src_pitch;
+        break;
+    case BLIT_DONE:
+        *result = blit->done;
+        break;
+    case BLIT_ERROR:
+        *result = blit->error;
+        break;
+    default:
+        *result = 0;
+    }
+    return OK;
+}
 
-    cpu->bus = bus_new(ram_new(code, code_size), disk_new(disk));
-    cpu->pc = RAM_BASE, cpu->mode = MACHINE;
+static inline bool blit_may_interrupt(const struct blit *blit)
+{
+    return __atomic_load_n(&blit->interrupting, __ATOMIC_RELAXED);
+}
 
-    return cpu;
+static inline bool blit_is_interrupting(struct blit *blit)
+{
+    bool interrupting = blit->interrupting;
+    blit->interrupting = false;
+    return interrupting;
 }
 
-static uint64_t cpu_load_csr(const struct cpu *cpu, const uint16_t addr);
-static inline void cpu_update_paging(struct cpu *cpu, const uint16_t csr_addr)
+struct bus *bus_new(struct ram *ram, struct sched *sched, struct disk *vio)
 {
-    if (csr_addr != SATP)
-        return;
+    struct bus *bus = calloc(1, sizeof(struct bus));
+    bus->ram = ram, bus->sched = sched, bus->disk = vio;
+    bus->clint = clint_new(sched), bus->plic = plic_new();
+    bus->uart = uart_new(sched);
+    bus->blit = calloc(1, sizeof(struct blit));
+    bus->kbd = calloc(1, sizeof(struct keyboard));
+    bus->syscon = calloc(1, sizeof(struct syscon));
+    bus->nharts = 1;
+    pthread_mutex_init(&bus->lock, NULL);
+#if defined(STATS)
+    bus->stats = vio->stats = calloc(1, sizeof(struct bus_stats));
+#endif
+    return bus;
+}
 
-    cpu->pagetable =
-        (cpu_load_csr(cpu, SATP) & (((uint64_t) 1 << 44) - 1)) * PAGE_SIZE;
-    cpu->enable_paging = (8 == (cpu_load_csr(cpu, SATP) >> 60));
+/* Choose the guest clock, before any hart runs. mtime starts over at 0. */
+void bus_set_clock(struct bus *bus, const enum sched_clock clock)
+{
+    bus->sched->clock = clock;
+    bus->clint->mtime_base = sched_now(bus->sched);
 }
 
-exception_t cpu_translate(const struct cpu *cpu,
-                          const uint64_t addr,
-                          const exception_t e,
-                          uint64_t *result)
+/* Record, or replay, the inputs of the machine from now on. The caller has
+ * chosen the cycle clock.
+ */
+void bus_set_replay(struct bus *bus, struct replay *replay)
 {
-    if (!cpu->enable_paging) {
-        *result = addr;
-        return OK;
+    bus->sched->replay = replay;
+    if (!replay_recording(replay))
+        sched_set(bus->sched, EVENT_INPUT, replay_due(replay), true);
+}
+
+/* A key from the front end. When recording, hart 0 queues it at its next
+ * poll; when replaying, keys only come from the log.
+ */
+void bus_put_key(struct bus *bus, const uint8_t code)
+{
+    struct replay *replay = bus->sched->replay;
+    if (!replay) {
+        key_put(bus->kbd, code);
+    } else if (replay_recording(replay)) {
+        replay_stage_key(replay, code);
+        sched_set(bus->sched, EVENT_INPUT, 0, false);
     }
+}
 
-    const uint64_t vpn[] = {
-        (addr >> 12) & 0x1ff,
-        (addr >> 21) & 0x1ff,
-        (addr >> 30) & 0x1ff,
-    };
-    int level = sizeof(vpn) / sizeof(vpn[0]) - 1;
+/* EVENT_INPUT: queue the keys staged when recording, or deliver what is
+ * due when replaying.
+ */
+static void bus_input(struct bus *bus)
+{
+    struct replay *replay = bus->sched->replay;
+    uint64_t now = sched_now(bus->sched);
+    if (replay_recording(replay)) {
+        uint8_t codes[REPLAY_MAX_DATA];
+        uint32_t n = replay_take_keys(replay, codes);
+        for (uint32_t i = 0; i < n; i++)
+            key_put(bus->kbd, codes[i]);
+        if (n)
+            replay_log(replay, REPLAY_KEY, now, codes, n);
+        return;
+    }
 
-    uint64_t a = cpu->pagetable;
+    const struct replay_event *ev;
+    while ((ev = replay_next(replay, now))) {
+        if (ev->kind == REPLAY_UART) {
+            pthread_mutex_lock(&bus->uart->lock);
+            uart_put(bus->uart, ev->data, ev->len);
+            bus->uart->interrupting = true;
+            pthread_mutex_unlock(&bus->uart->lock);
+        } else if (ev->kind == REPLAY_KEY) {
+            for (uint32_t i = 0; i < ev->len; i++)
+                key_put(bus->kbd, ev->data[i]);
+        } else if (ev->kind == REPLAY_END) {
+            bus->syscon->off = true, bus->syscon->exit_code = 0;
+        }
+    }
+    sched_set(bus->sched, EVENT_INPUT, replay_due(replay), true);
+}
+
+static inline void bus_lock(const struct bus *bus)
+{
+    if (bus->nharts > 1)
+        pthread_mutex_lock((pthread_mutex_t *) &bus->lock);
+}
+
+static inline void bus_unlock(const struct bus *bus)
+{
+    if (bus->nharts > 1)
+        pthread_mutex_unlock((pthread_mutex_t *) &bus->lock);
+}
+
+/* Memory-mapped devices other than RAM, sorted by base address. */
+struct bus_region {
+    const char *name;
+    uint64_t base, size;
+    exception_t (*load)(const struct bus *bus,
+                        const uint64_t addr,
+                        const uint64_t size,
+                        uint64_t *result);
+    exception_t (*store)(struct bus *bus,
+                         const uint64_t addr,
+                         const uint64_t size,
+                         const uint64_t value);
+};
+
+#define BUS_DEVICE(dev)                                                 \
+    static exception_t bus_##dev##_load(const struct bus *bus,          \
+                                        const uint64_t addr,            \
+                                        const uint64_t size,            \
+                                        uint64_t *result)               \
+    {                                                                   \
+        return dev##_load(bus->dev, addr, size, result);                \
+    }                                                                   \
+    static exception_t bus_##dev##_store(struct bus *bus,               \
+                                         const uint64_t addr,           \
+                                         const uint64_t size,           \
+                                         const uint64_t value)          \
+    {                                                                   \
+        return dev##_store(bus->dev, addr, size, value);                \
+    }
+
+BUS_DEVICE(clint)
+BUS_DEVICE(plic)
+BUS_DEVICE(uart)
+BUS_DEVICE(disk)
+
+#undef BUS_DEVICE
+
+/* The virtio front end of the disk. */
+static exception_t bus_vblk_load(const struct bus *bus,
+                                 const uint64_t addr,
+                                 const uint64_t size,
+                                 uint64_t *result)
+{
+    return vblk_load(bus->disk, addr, size, result);
+}
+
+static exception_t bus_vblk_store(struct bus *bus,
+                                  const uint64_t addr,
+                                  const uint64_t size,
+                                  const uint64_t value)
+{
+    return vblk_store(bus->disk, addr, size, value);
+}
+
+static exception_t bus_syscon_store(struct bus *bus,
+                                    const uint64_t addr,
+                                    const uint64_t size,
+                                    const uint64_t value)
+{
+    if (addr != SYSCON_BASE || size != 32)
+        return STORE_AMO_ACCESS_FAULT;
+
+    switch (value & 0xffff) {
+    case SYSCON_PASS:
+        bus->syscon->off = true, bus->syscon->exit_code = 0;
+        break;
+    case SYSCON_FAIL:
+        bus->syscon->off = true, bus->syscon->exit_code = value >> 16;
+        break;
+    case SYSCON_SNAPSHOT:
+        bus->syscon->snapshot = true;
+        break;
+    }
+    return OK;
+}
+
+static exception_t bus_blit_load(const struct bus *bus,
+                                 const uint64_t addr,
+                                 const uint64_t size,
+                                 uint64_t *result)
+{
+    return blit_load(bus->blit, addr, size, result);
+}
+
+/* The blitter draws into RAM, so it is given the whole bus. */
+static exception_t bus_blit_store(struct bus *bus,
+                                  const uint64_t addr,
+                                  const uint64_t size,
+                                  const uint64_t value)
+{
+    struct blit *blit = bus->blit;
+    if (size != 32)
+        return STORE_AMO_ACCESS_FAULT;
+
+    switch (addr) {
+    case BLIT_OP:
+        blit_run(blit, bus, value);
+        break;
+    case BLIT_DST_X:
+        blit->dst_x = value;
+        break;
+    case BLIT_DST_Y:
+        blit->dst_y = value;
+        break;
+    case BLIT_WIDTH:
+        blit->width = value;
+        break;
+    case BLIT_HEIGHT:
+        blit->height = value;
+        break;
+    case BLIT_SRC_X:
+        blit->src_x = value;
+        break;
+    case BLIT_SRC_Y:
+        blit->src_y = value;
+        break;
+    case BLIT_FG:
+        blit->fg = value;
+        break;
+    case BLIT_BG:
+        blit->bg = value;
+        break;
+    case BLIT_FLAGS:
+        blit->flags = value;
+        break;
+    case BLIT_SRC_ADDR_LOW:
+        blit->src_addr = (blit->src_addr & ~0xffffffffULL) | (uint32_t) value;
+        break;
+    case BLIT_SRC_ADDR_HIGH:
+        blit->src_addr = (blit->src_addr & 0xffffffffULL) |
+                         (uint64_t) (uint32_t) value << 32;
+        break;
+    case BLIT_SRC_PITCH:
+        blit->src_pitch = value;
+        break;
+    }
+    return OK;
+}
+
+static exception_t bus_kbd_load(const struct bus *bus,
+                                const uint64_t addr,
+                                const uint64_t size,
+                                uint64_t *result)
+{
+    (void) bus;
+    return kbd_load(bus->kbd, addr, size, result);
+}
+
+static const struct bus_region bus_regions[] = {
+    {"syscon", SYSCON_BASE, SYSCON_SIZE, NULL, bus_syscon_store},
+    {"clint", CLINT_BASE, CLINT_SIZE, bus_clint_load, bus_clint_store},
+    {"plic", PLIC_BASE, PLIC_SIZE, bus_plic_load, bus_plic_store},
+    {"uart", UART_BASE, UART_SIZE, bus_uart_load, bus_uart_store},
+    {"disk", DISK_BASE, DISK_SIZE, bus_disk_load, bus_disk_store},
+    {"keyboard", KBD_BASE, KBD_SIZE, bus_kbd_load, NULL},
+    {"blitter", BLIT_BASE, BLIT_SIZE, bus_blit_load, bus_blit_store},
+    {"virtio", VIRTIO_BASE, VIRTIO_SIZE, bus_vblk_load, bus_vblk_store},
+};
+#define N_REGIONS (int) (sizeof(bus_regions) / sizeof(bus_regions[0]))
+
+static const struct bus_region *bus_find_region(const uint64_t addr)
+{
+    int lo = 0, hi = N_REGIONS;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const struct bus_region *r = &bus_regions[mid];
+        if (addr < r->base)
+            hi = mid;
+        else if (addr - r->base >= r->size)
+            lo = mid + 1;
+        else
+            return r;
+    }
+    return NULL;
+}
+
+/* True if the whole access lies in RAM, the most common case by far. */
+static inline bool bus_is_ram(const struct bus *bus,
+                              const uint64_t addr,
+                              const uint64_t size)
+{
+    return addr - RAM_BASE <= bus->ram->size - size / 8;
+}
+
+exception_t bus_load(const struct bus *bus,
+                     const uint64_t addr,
+                     const uint64_t size,
+                     uint64_t *result)
+{
+    if (bus_is_ram(bus, addr, size))
+        return ram_load(bus->ram, addr, size, result);
+
+    const struct bus_region *r = bus_find_region(addr);
+    if (!r || !r->load)
+        return LOAD_ACCESS_FAULT;
+    bus_lock(bus);
+#if defined(STATS)
+    bus->stats->loads[r - bus_regions]++;
+#endif
+    exception_t e = r->load(bus, addr, size, result);
+    bus_unlock(bus);
+    return e;
+}
+
+exception_t bus_store(struct bus *bus,
+                      const uint64_t addr,
+                      const uint64_t size,
+                      const uint64_t value)
+{
+    if (bus_is_ram(bus, addr, size))
+        return ram_store(bus->ram, addr, size, value);
+
+    const struct bus_region *r = bus_find_region(addr);
+    if (!r || !r->store)
+        return STORE_AMO_ACCESS_FAULT;
+    bus_lock(bus);
+#if defined(STATS)
+    bus->stats->stores[r - bus_regions]++;
+#endif
+    exception_t e = r->store(bus, addr, size, value);
+    bus_unlock(bus);
+    return e;
+}
+
+void cpu_flush_tlb(struct cpu *cpu)
+{
+    for (int i = 0; i < N_TLB; i++)
+        for (int j = 0; j < TLB_SIZE; j++)
+            cpu->tlb[i].entries[j].vpn = TLB_INVALID;
+}
+
+#if defined(STATS)
+#define INSN_NAME(name) #name,
+static const char *const op_names[N_OPS] = {INSN_LIST(INSN_NAME)};
+#undef INSN_NAME
+
+/* The nonzero counters by cause, "cause x count" in text. */
+static void print_causes(FILE *f,
+                         const char *key,
+                         const char *label,
+                         const uint64_t counts[N_CAUSES],
+                         const enum stats_format format)
+{
+    if (format == STATS_JSON) {
+        fprintf(f, ",\"%s\":{", key);
+        for (int i = 0, n = 0; i < N_CAUSES; i++)
+            if (counts[i])
+                fprintf(f, "%s\"%d\":%" PRIu64, n++ ? "," : "", i, counts[i]);
+        fputc('}', f);
+        return;
+    }
+    int n = 0;
+    fprintf(f, "%s:", label);
+    for (int i = 0; i < N_CAUSES; i++)
+        if (counts[i])
+            fprintf(f, " %d x %" PRIu64, i, counts[i]), n++;
+    fputs(n ? "\n" : " none\n", f);
+}
+
+static void cpu_print_counters(const struct cpu *cpu,
+                               FILE *f,
+                               const enum stats_format format)
+{
+    const struct cpu_stats *stats = cpu->stats;
+    /* Most frequent first. */
+    uint64_t total = 0;
+    int order[N_OPS];
+    for (int i = 0; i < N_OPS; i++) {
+        total += stats->ops[i];
+        int j = i;
+        for (; j > 0 && stats->ops[order[j - 1]] < stats->ops[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    if (format == STATS_JSON)
+        fputs(",\"instructions\":{", f);
+    else
+        fprintf(f, "Interpreted: %" PRIu64 " instructions\n", total);
+    for (int i = 0; i < N_OPS && stats->ops[order[i]]; i++) {
+        int op = order[i];
+        if (format == STATS_JSON)
+            fprintf(f, "%s\"%s\":%" PRIu64, i ? "," : "", op_names[op],
+                    stats->ops[op]);
+        else
+            fprintf(f, "  %-10s %12" PRIu64 " (%.2f%%)\n", op_names[op],
+                    stats->ops[op], 100.0 * stats->ops[op] / total);
+    }
+    if (format == STATS_JSON)
+        fputc('}', f);
+
+    print_causes(f, "exceptions", "Exceptions", stats->exceptions, format);
+    print_causes(f, "interrupts", "Interrupts", stats->interrupts, format);
+}
+#endif
+
+void cpu_print_stats(const struct cpu *cpu,
+                     FILE *f,
+                     const enum stats_format format)
+{
+    static const char *const names[N_TLB] = {"fetch", "load", "store"};
+    const struct bcache *bcache = cpu->bcache;
+    if (format == STATS_JSON) {
+        fprintf(f, "{\"hart\":%d,\"retired\":%" PRIu64 ",\"tlb\":{",
+                cpu->hartid, cpu->cycle);
+        for (int i = 0; i < N_TLB; i++)
+            fprintf(f,
+                    "%s\"%s\":{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64
+                    "}",
+                    i ? "," : "", names[i], cpu->tlb[i].hits,
+                    cpu->tlb[i].misses);
+        fprintf(f,
+                "},\"block_cache\":{\"hits\":%" PRIu64
+                ",\"misses\":%" PRIu64 "}",
+                bcache->hits, bcache->misses);
+    } else {
+        for (int i = 0; i < N_TLB; i++) {
+            const struct tlb *tlb = &cpu->tlb[i];
+            uint64_t total = tlb->hits + tlb->misses;
+            fprintf(f,
+                    "TLB %-5s: %" PRIu64 " hits, %" PRIu64 " misses (%.2f%%)\n",
+                    names[i], tlb->hits, tlb->misses,
+                    total ? 100.0 * tlb->hits / total : 0.0);
+        }
+
+        uint64_t total = bcache->hits + bcache->misses;
+        fprintf(f,
+                "Block cache: %" PRIu64 " hits, %" PRIu64 " misses (%.2f%%)\n",
+                bcache->hits, bcache->misses,
+                total ? 100.0 * bcache->hits / total : 0.0);
+    }
+#if defined(JIT)
+    if (cpu->jit)
+        jit_print_stats(cpu->jit, f, format);
+#endif
+#if defined(STATS)
+    cpu_print_counters(cpu, f, format);
+#endif
+    if (format == STATS_JSON)
+        fputc('}', f);
+}
+
+/* In JSON, the members of the enclosing object, each preceded by a comma. */
+void bus_print_stats(const struct bus *bus,
+                     FILE *f,
+                     const enum stats_format format)
+{
+#if defined(STATS)
+    const struct bus_stats *stats = bus->stats;
+    if (format == STATS_JSON) {
+        fputs(",\"mmio\":{", f);
+        for (int i = 0; i < N_REGIONS; i++)
+            fprintf(f,
+                    "%s\"%s\":{\"loads\":%" PRIu64 ",\"stores\":%" PRIu64
+                    "}",
+                    i ? "," : "", bus_regions[i].name, stats->loads[i],
+                    stats->stores[i]);
+        fprintf(f,
+                "},\"disk\":{\"requests\":%" PRIu64
+                ",\"read_bytes\":%" PRIu64 ",\"written_bytes\":%" PRIu64
+                "},\"blitter\":{\"operations\":%" PRIu64
+                ",\"pixels\":%" PRIu64 "},\"screen\":{\"frames\":%" PRIu64
+                ",\"draw_seconds\":%.6f}",
+                stats->disk_requests, stats->disk_read_bytes,
+                stats->disk_written_bytes, stats->blits, stats->blit_pixels,
+                stats->frames, stats->draw_ns / 1e9);
+        return;
+    }
+
+    fputs("MMIO:", f);
+    for (int i = 0; i < N_REGIONS; i++)
+        if (stats->loads[i] || stats->stores[i])
+            fprintf(f, " %s %" PRIu64 "/%" PRIu64, bus_regions[i].name,
+                    stats->loads[i], stats->stores[i]);
+    fputs(" (loads/stores)\n", f);
+    fprintf(f,
+            "Disk: %" PRIu64 " requests, %" PRIu64 " bytes read, %" PRIu64
+            " bytes written\n",
+            stats->disk_requests, stats->disk_read_bytes,
+            stats->disk_written_bytes);
+    if (stats->blits)
+        fprintf(f, "Blitter: %" PRIu64 " operations, %" PRIu64 " pixels\n",
+                stats->blits, stats->blit_pixels);
+    if (stats->frames)
+        fprintf(f, "Screen: %" PRIu64 " frames, %.2f ms per draw\n",
+                stats->frames, stats->draw_ns / 1e6 / stats->frames);
+#else
+    (void) bus, (void) f, (void) format;
+#endif
+}
+
+static struct cpu *machine_new(struct ram *ram,
+                               const uint64_t entry,
+                               struct disk_image *disk,
+                               const bool pooled)
+{
+    struct sched *sched = sched_new();
+    sched->pooled = pooled;
+    struct cpu boot = {.bus = bus_new(ram, sched, disk_new(disk, ram, sched)),
+                       .pc = entry};
+    boot.bus->nharts = 0;
+    return cpu_new_hart(&boot, 0);
+}
+
+struct cpu *cpu_new(struct ram *ram,
+                    const uint64_t entry,
+                    struct disk_image *disk)
+{
+    return machine_new(ram, entry, disk, false);
+}
+
+/* A machine that shares host threads with others: it starts no threads of
+ * its own, its harts do not sleep in wfi, and the thread running it writes
+ * out its console with uart_pump and serves its disk requests itself.
+ */
+struct cpu *cpu_new_pooled(struct ram *ram,
+                           const uint64_t entry,
+                           struct disk_image *disk)
+{
+    return machine_new(ram, entry, disk, true);
+}
+
+/* Another hart on the bus of boot. All harts start at the PC of boot, which
+ * has not run yet, in machine mode, with their hart ID in mhartid and a0.
+ * Harts must be added before any of them runs.
+ */
+struct cpu *cpu_new_hart(struct cpu *boot, const int hartid)
+{
+    struct cpu *cpu = calloc(1, sizeof(struct cpu));
+
+    /* Initialize the sp(x2) register, each hart with a stack of its own. */
+    cpu->regs[2] = RAM_BASE + boot->bus->ram->size -
+                   (uint64_t) hartid * HART_STACK_SIZE;
+    cpu->regs[10] = hartid;
+
+    cpu->bus = boot->bus;
+    cpu->bus->nharts++;
+    cpu->hartid = hartid;
+    cpu->csrs[MHARTID] = hartid;
+    cpu->csrs[MISA] = MISA_VALUE;
+    cpu->csrs[MSTATUS] = MSTATUS_FS_INITIAL;
+    cpu->pc = boot->pc, cpu->mode = MACHINE;
+    cpu->reserved_addr = UINT64_MAX;
+    cpu->pending = &cpu->bus->sched->pending[hartid];
+    *cpu->pending = 1;
+    cpu_flush_tlb(cpu);
+
+    cpu->bcache = calloc(1, sizeof(struct bcache));
+    cpu_flush_bcache(cpu);
+#if defined(STATS)
+    cpu->stats = calloc(1, sizeof(struct cpu_stats));
+#endif
+
+    return cpu;
+}
+
+static uint64_t cpu_load_csr(const struct cpu *cpu, const uint16_t addr);
+/* Writing these may let a pending interrupt through. */
+static inline void cpu_update_interrupts(struct cpu *cpu,
+                                         const uint16_t csr_addr)
+{
+    switch (csr_addr) {
+    case MSTATUS: case MIE: case MIP:
+    case SSTATUS: case SIE: case SIP:
+        __atomic_store_n(cpu->pending, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void cpu_update_paging(struct cpu *cpu, const uint16_t csr_addr)
+{
+    if (csr_addr != SATP)
+        return;
+
+    cpu->pagetable =
+        (cpu_load_csr(cpu, SATP) & (((uint64_t) 1 << 44) - 1)) * PAGE_SIZE;
+    cpu->enable_paging = (8 == (cpu_load_csr(cpu, SATP) >> 60));
+    cpu_flush_tlb(cpu);
+}
+
+static exception_t cpu_walk(const struct cpu *cpu,
+                            const uint64_t addr,
+                            const exception_t e,
+                            uint64_t *result)
+{
+    const uint64_t vpn[] = {
+        (addr >> 12) & 0x1ff,
+        (addr >> 21) & 0x1ff,
+        (addr >> 30) & 0x1ff,
+    };
+    int level = sizeof(vpn) / sizeof(vpn[0]) - 1;
+
+    uint64_t a = cpu->pagetable;
     uint64_t pte;
     while (1) {
         exception_t exc = bus_load(cpu->bus, a + vpn[level] * 8, 64, &pte);
@@ -641,723 +2434,1891 @@ exception_t cpu_translate(const struct cpu *cpu,
     }
 }
 
-/* Fetch an instruction from current PC from RAM. */
+exception_t cpu_translate(struct cpu *cpu,
+                          const uint64_t addr,
+                          const exception_t e,
+                          uint64_t *result)
+{
+    if (!cpu->enable_paging) {
+        *result = addr;
+        return OK;
+    }
+
+    struct tlb *tlb;
+    switch (e) {
+    case INSTRUCTION_PAGE_FAULT:
+        tlb = &cpu->tlb[TLB_FETCH];
+        break;
+    case LOAD_PAGE_FAULT:
+        tlb = &cpu->tlb[TLB_LOAD];
+        break;
+    default:
+        tlb = &cpu->tlb[TLB_STORE];
+    }
+
+    /* Superpages are cached one 4 KiB page at a time, so every entry maps
+     * exactly one virtual page number.
+     */
+    uint64_t vpn = addr / PAGE_SIZE;
+    struct tlb_entry *entry = &tlb->entries[vpn % TLB_SIZE];
+    if (entry->vpn == vpn) {
+        tlb->hits++;
+        *result = entry->ppage | (addr % PAGE_SIZE);
+        return OK;
+    }
+
+    tlb->misses++;
+    exception_t exc = cpu_walk(cpu, addr, e, result);
+    if (exc != OK)
+        return exc;
+
+    entry->vpn = vpn;
+    entry->ppage = *result & ~(uint64_t) (PAGE_SIZE - 1);
+    return OK;
+}
+
+/* Fetch the instruction at the current PC, a parcel at a time: the second
+ * half of a 32-bit instruction may be on the next page.
+ */
 exception_t cpu_fetch(struct cpu *cpu, uint64_t *result)
 {
-    uint64_t ppc;
+    uint64_t ppc, hi = 0;
     exception_t e = cpu_translate(cpu, cpu->pc, INSTRUCTION_PAGE_FAULT, &ppc);
     if (e != OK)
         return e;
+    if (bus_load(cpu->bus, ppc, 16, result) != OK)
+        return INSTRUCTION_ACCESS_FAULT;
+    if ((*result & 0x3) != 0x3)
+        return OK;
 
-    if (bus_load(cpu->bus, ppc, 32, result) != OK)
+    e = cpu_translate(cpu, cpu->pc + 2, INSTRUCTION_PAGE_FAULT, &ppc);
+    if (e != OK)
+        return e;
+    if (bus_load(cpu->bus, ppc, 16, &hi) != OK)
         return INSTRUCTION_ACCESS_FAULT;
+    *result |= hi << 16;
     return OK;
 }
 
 static inline uint64_t cpu_load_csr(const struct cpu *cpu, const uint16_t addr)
 {
-    if (addr == SIE)
-        return cpu->csrs[MIE] & cpu->csrs[MIDELEG];
-    return cpu->csrs[addr];
+    switch (addr) {
+    case SIE:
+        return cpu->csrs[MIE] & cpu->csrs[MIDELEG];
+    case SSTATUS:
+        return (cpu->csrs[SSTATUS] & ~(MSTATUS_FS | MSTATUS_SD)) |
+               (cpu->csrs[MSTATUS] & (MSTATUS_FS | MSTATUS_SD));
+    case FFLAGS:
+        return cpu->csrs[FCSR] & 0x1f;
+    case FRM:
+        return (cpu->csrs[FCSR] >> 5) & 7;
+    default:
+        return cpu->csrs[addr];
+    }
+}
+
+/* Mark the FP state dirty, so that the kernel knows to save it. */
+static inline void cpu_dirty_fs(struct cpu *cpu)
+{
+    cpu->csrs[MSTATUS] |= MSTATUS_FS | MSTATUS_SD;
+}
+
+static inline void cpu_store_csr(struct cpu *cpu,
+                                 const uint16_t addr,
+                                 uint64_t value)
+{
+    switch (addr) {
+    case SIE:
+        cpu->csrs[MIE] = (cpu->csrs[MIE] & ~cpu->csrs[MIDELEG]) |
+                         (value & cpu->csrs[MIDELEG]);
+        return;
+    case SSTATUS:
+        cpu->csrs[SSTATUS] = value & ~(MSTATUS_FS | MSTATUS_SD);
+        value = (cpu->csrs[MSTATUS] & ~MSTATUS_FS) | (value & MSTATUS_FS);
+        /* fall through */
+    case MSTATUS:
+        value &= ~MSTATUS_SD;
+        if ((value & MSTATUS_FS) == MSTATUS_FS)
+            value |= MSTATUS_SD;
+        cpu->csrs[MSTATUS] = value;
+        return;
+    case MISA:
+        return;
+    case FFLAGS:
+        cpu->csrs[FCSR] = (cpu->csrs[FCSR] & ~0x1fULL) | (value & 0x1f);
+        cpu_dirty_fs(cpu);
+        return;
+    case FRM:
+        cpu->csrs[FCSR] = (cpu->csrs[FCSR] & 0x1f) | (value & 7) << 5;
+        cpu_dirty_fs(cpu);
+        return;
+    case FCSR:
+        cpu->csrs[FCSR] = value & 0xff;
+        cpu_dirty_fs(cpu);
+        return;
+    default:
+        cpu->csrs[addr] = value;
+    }
+}
+
+/* The FP CSRs are only accessible while FS is not off. */
+static inline bool cpu_csr_accessible(const struct cpu *cpu,
+                                      const uint16_t addr)
+{
+    return addr > FCSR || addr < FFLAGS || (cpu->csrs[MSTATUS] & MSTATUS_FS);
+}
+
+static inline exception_t cpu_load(struct cpu *cpu,
+                                   const uint64_t addr,
+                                   const uint64_t size,
+                                   uint64_t *result)
+{
+    uint64_t pa;
+    exception_t e = cpu_translate(cpu, addr, LOAD_PAGE_FAULT, &pa);
+    if (e != OK)
+        return e;
+    return bus_load(cpu->bus, pa, size, result);
+}
+
+static inline exception_t cpu_store(struct cpu *cpu,
+                                    const uint64_t addr,
+                                    const uint64_t size,
+                                    const uint64_t value)
+{
+    uint64_t pa;
+    exception_t e = cpu_translate(cpu, addr, STORE_AMO_PAGE_FAULT, &pa);
+    if (e != OK)
+        return e;
+
+    return bus_store(cpu->bus, pa, size, value);
+}
+
+/* Instruction handlers. Each one implements a single concrete instruction on
+ * top of the fields pre-decoded by cpu_decode(). As in the original decoder,
+ * cpu->pc already points at the next instruction when a handler runs; it is
+ * moved back to the instruction if the handler raises an exception.
+ */
+#define INSN(name) \
+    static exception_t insn_##name(struct cpu *cpu, const struct insn *insn)
+
+#define INSN_LOAD(name, size, type)                               \
+    INSN(name)                                                    \
+    {                                                             \
+        uint64_t result;                                          \
+        uint64_t addr = cpu->regs[insn->rs1] + insn->imm;         \
+        exception_t e = cpu_load(cpu, addr, size, &result);       \
+        if (e != OK)                                              \
+            return e;                                             \
+        cpu->regs[insn->rd] = (type) result;                      \
+        return OK;                                                \
+    }
+
+#define INSN_STORE(name, size)                                    \
+    INSN(name)                                                    \
+    {                                                             \
+        uint64_t addr = cpu->regs[insn->rs1] + insn->imm;         \
+        return cpu_store(cpu, addr, size, cpu->regs[insn->rs2]);  \
+    }
+
+#define INSN_BRANCH(name, cond)                                   \
+    INSN(name)                                                    \
+    {                                                             \
+        uint64_t a = cpu->regs[insn->rs1], b = cpu->regs[insn->rs2]; \
+        if (cond)                                                 \
+            cpu->pc += insn->imm - insn->len;                     \
+        return OK;                                                \
+    }
+
+/* Atomic memory operations: t is the value loaded from memory, b the value of
+ * rs2, and op computes the value written back. In RAM the update is a host
+ * compare-and-swap loop, so that it is atomic with respect to other harts.
+ */
+#define INSN_AMO(name, size, type, op)                                    \
+    INSN(name)                                                            \
+    {                                                                     \
+        uint64_t addr = cpu->regs[insn->rs1], b = cpu->regs[insn->rs2];  \
+        if (!IS_ALIGNED(addr, size / 8))                                  \
+            return LOAD_ADDRESS_MISALIGNED;                               \
+        uint64_t pa, t;                                                   \
+        exception_t e =                                                   \
+            cpu_translate(cpu, addr, STORE_AMO_PAGE_FAULT, &pa);          \
+        if (e != OK)                                                      \
+            return e;                                                     \
+        if (bus_is_ram(cpu->bus, pa, size)) {                             \
+            struct ram *ram = cpu->bus->ram;                              \
+            uint##size##_t *p =                                           \
+                (uint##size##_t *) (ram->data + (pa - RAM_BASE));         \
+            uint##size##_t old = __atomic_load_n(p, __ATOMIC_RELAXED);    \
+            do {                                                          \
+                t = LE##size(old);                                        \
+                ram_will_store(ram, pa, size, (op));                      \
+            } while (!__atomic_compare_exchange_n(                        \
+                p, &old, LE##size((uint##size##_t) (op)), true,           \
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));                     \
+            ram_did_store(ram, pa, size);                                 \
+        } else {                                                          \
+            if ((e = bus_load(cpu->bus, pa, size, &t)) != OK)             \
+                return e;                                                 \
+            if ((e = bus_store(cpu->bus, pa, size, (op))) != OK)          \
+                return e;                                                 \
+        }                                                                 \
+        cpu->regs[insn->rd] = (type) t;                                   \
+        return OK;                                                        \
+    }
+
+/* LR remembers the value it loaded, and SC stores only if memory still holds
+ * that value, with a compare-and-swap. A store of the same value by another
+ * hart in between goes unnoticed, which is harmless for the usual lock-free
+ * sequences.
+ */
+#define INSN_LR(name, size, type)                                         \
+    INSN(name)                                                            \
+    {                                                                     \
+        uint64_t addr = cpu->regs[insn->rs1], pa, t;                      \
+        if (!IS_ALIGNED(addr, size / 8))                                  \
+            return LOAD_ADDRESS_MISALIGNED;                               \
+        exception_t e = cpu_translate(cpu, addr, LOAD_PAGE_FAULT, &pa);   \
+        if (e != OK)                                                      \
+            return e;                                                     \
+        if ((e = bus_load(cpu->bus, pa, size, &t)) != OK)                 \
+            return e;                                                     \
+        cpu->reserved_addr = pa, cpu->reserved_value = t;                 \
+        cpu->regs[insn->rd] = (type) t;                                   \
+        return OK;                                                        \
+    }
+
+#define INSN_SC(name, size)                                               \
+    INSN(name)                                                            \
+    {                                                                     \
+        uint64_t addr = cpu->regs[insn->rs1], pa;                         \
+        if (!IS_ALIGNED(addr, size / 8))                                  \
+            return STORE_AMO_ADDRESS_MISALIGNED;                          \
+        exception_t e =                                                   \
+            cpu_translate(cpu, addr, STORE_AMO_PAGE_FAULT, &pa);          \
+        if (e != OK)                                                      \
+            return e;                                                     \
+        bool ok = false;                                                  \
+        if (cpu->reserved_addr == pa &&                                   \
+            bus_is_ram(cpu->bus, pa, size)) {                             \
+            struct ram *ram = cpu->bus->ram;                              \
+            uint##size##_t *p =                                           \
+                (uint##size##_t *) (ram->data + (pa - RAM_BASE));         \
+            uint##size##_t old =                                          \
+                LE##size((uint##size##_t) cpu->reserved_value);           \
+            ram_will_store(ram, pa, size, cpu->regs[insn->rs2]);          \
+            ok = __atomic_compare_exchange_n(                             \
+                p, &old, LE##size((uint##size##_t) cpu->regs[insn->rs2]), \
+                false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);               \
+            if (ok)                                                       \
+                ram_did_store(ram, pa, size);                             \
+        }                                                                 \
+        cpu->reserved_addr = UINT64_MAX;                                  \
+        cpu->regs[insn->rd] = !ok;                                        \
+        return OK;                                                        \
+    }
+
+#define X(r) cpu->regs[insn->r]
+
+INSN(illegal)
+{
+    (void) cpu, (void) insn;
+    return ILLEGAL_INSTRUCTION;
+}
+
+INSN_LOAD(lb, 8, int8_t)
+INSN_LOAD(lh, 16, int16_t)
+INSN_LOAD(lw, 32, int32_t)
+INSN_LOAD(ld, 64, uint64_t)
+INSN_LOAD(lbu, 8, uint8_t)
+INSN_LOAD(lhu, 16, uint16_t)
+INSN_LOAD(lwu, 32, uint32_t)
+
+INSN(fence)
+{
+    (void) cpu, (void) insn;
+    return OK;
+}
+
+INSN(fence_i)
+{
+    (void) insn;
+    cpu_flush_bcache(cpu);
+    return OK;
+}
+
+INSN(addi)
+{
+    X(rd) = X(rs1) + insn->imm;
+    return OK;
+}
+
+INSN(slli)
+{
+    X(rd) = X(rs1) << insn->imm;
+    return OK;
+}
+
+INSN(slti)
+{
+    X(rd) = !!((int64_t) X(rs1) < (int64_t) insn->imm);
+    return OK;
+}
+
+INSN(sltiu)
+{
+    X(rd) = !!(X(rs1) < insn->imm);
+    return OK;
+}
+
+INSN(xori)
+{
+    X(rd) = X(rs1) ^ insn->imm;
+    return OK;
+}
+
+INSN(srli)
+{
+    X(rd) = X(rs1) >> insn->imm;
+    return OK;
+}
+
+INSN(srai)
+{
+    X(rd) = (int64_t) X(rs1) >> insn->imm;
+    return OK;
+}
+
+INSN(ori)
+{
+    X(rd) = X(rs1) | insn->imm;
+    return OK;
+}
+
+INSN(andi)
+{
+    X(rd) = X(rs1) & insn->imm;
+    return OK;
+}
+
+INSN(auipc)
+{
+    X(rd) = cpu->pc + insn->imm - insn->len;
+    return OK;
+}
+
+INSN(addiw)
+{
+    X(rd) = (int32_t) (X(rs1) + insn->imm);
+    return OK;
+}
+
+INSN(slliw)
+{
+    X(rd) = (int32_t) (X(rs1) << insn->imm);
+    return OK;
+}
+
+INSN(srliw)
+{
+    X(rd) = (int32_t) ((uint32_t) X(rs1) >> insn->imm);
+    return OK;
+}
+
+INSN(sraiw)
+{
+    X(rd) = (int32_t) X(rs1) >> insn->imm;
+    return OK;
+}
+
+INSN_STORE(sb, 8)
+INSN_STORE(sh, 16)
+INSN_STORE(sw, 32)
+INSN_STORE(sd, 64)
+
+INSN_LR(lr_w, 32, int32_t)
+INSN_SC(sc_w, 32)
+INSN_LR(lr_d, 64, uint64_t)
+INSN_SC(sc_d, 64)
+INSN_AMO(amoadd_w, 32, int32_t, t + b)
+INSN_AMO(amoswap_w, 32, int32_t, b)
+INSN_AMO(amoxor_w, 32, int32_t, t ^ b)
+INSN_AMO(amoor_w, 32, int32_t, t | b)
+INSN_AMO(amoand_w, 32, int32_t, t & b)
+INSN_AMO(amomin_w, 32, int32_t, MIN((int32_t) t, (int32_t) b))
+INSN_AMO(amomax_w, 32, int32_t, MAX((int32_t) t, (int32_t) b))
+INSN_AMO(amominu_w, 32, int32_t, MIN((uint32_t) t, (uint32_t) b))
+INSN_AMO(amomaxu_w, 32, int32_t, MAX((uint32_t) t, (uint32_t) b))
+INSN_AMO(amoadd_d, 64, uint64_t, t + b)
+INSN_AMO(amoswap_d, 64, uint64_t, b)
+INSN_AMO(amoxor_d, 64, uint64_t, t ^ b)
+INSN_AMO(amoor_d, 64, uint64_t, t | b)
+INSN_AMO(amoand_d, 64, uint64_t, t & b)
+INSN_AMO(amomin_d, 64, uint64_t, MIN((int64_t) t, (int64_t) b))
+INSN_AMO(amomax_d, 64, uint64_t, MAX((int64_t) t, (int64_t) b))
+INSN_AMO(amominu_d, 64, uint64_t, MIN(t, b))
+INSN_AMO(amomaxu_d, 64, uint64_t, MAX(t, b))
+
+INSN(add)
+{
+    X(rd) = X(rs1) + X(rs2);
+    return OK;
+}
+
+INSN(mul)
+{
+    X(rd) = X(rs1) * X(rs2);
+    return OK;
+}
+
+INSN(sub)
+{
+    X(rd) = X(rs1) - X(rs2);
+    return OK;
+}
+
+INSN(sll)
+{
+    X(rd) = X(rs1) << (X(rs2) & 0x3f);
+    return OK;
+}
+
+INSN(mulh)
+{
+#if defined(__SIZEOF_INT128__) && __SIZEOF_INT128__
+    X(rd) = ((__int128) (int64_t) X(rs1) * (__int128) (int64_t) X(rs2)) >> 64;
+#else
+    X(rd) = mulh((int64_t) X(rs1), (int64_t) X(rs2));
+#endif
+    return OK;
+}
+
+INSN(slt)
+{
+    X(rd) = !!((int64_t) X(rs1) < (int64_t) X(rs2));
+    return OK;
+}
+
+INSN(mulhsu)
+{
+#if defined(__SIZEOF_INT128__) && __SIZEOF_INT128__
+    X(rd) = ((__int128) (int64_t) X(rs1) * (unsigned __int128) X(rs2)) >> 64;
+#else
+    X(rd) = mulhsu((int64_t) X(rs1), (uint64_t) X(rs2));
+#endif
+    return OK;
+}
+
+INSN(sltu)
+{
+    X(rd) = !!(X(rs1) < X(rs2));
+    return OK;
+}
+
+INSN(mulhu)
+{
+#if defined(__SIZEOF_INT128__) && __SIZEOF_INT128__
+    X(rd) = ((unsigned __int128) X(rs1) * (unsigned __int128) X(rs2)) >> 64;
+#else
+    X(rd) = mulhu((uint64_t) X(rs1), (uint64_t) X(rs2));
+#endif
+    return OK;
+}
+
+INSN(xor)
+{
+    X(rd) = X(rs1) ^ X(rs2);
+    return OK;
+}
+
+INSN(div)
+{
+    int64_t dividend = (int64_t) X(rs1);
+    int64_t divisor = (int64_t) X(rs2);
+    if (divisor == 0) {
+        X(rd) = -1;
+    } else if (dividend == INT64_MIN && divisor == -1) { /* overflow */
+        X(rd) = INT64_MIN;
+    } else {
+        X(rd) = dividend / divisor;
+    }
+    return OK;
+}
+
+INSN(srl)
+{
+    X(rd) = X(rs1) >> (X(rs2) & 0x3f);
+    return OK;
+}
+
+INSN(divu)
+{
+    X(rd) = (X(rs2) == 0) ? UINT64_MAX : (X(rs1) / X(rs2));
+    return OK;
+}
+
+INSN(sra)
+{
+    X(rd) = (int64_t) X(rs1) >> (X(rs2) & 0x3f);
+    return OK;
+}
+
+INSN(rem)
+{
+    if (X(rs2) == 0) {
+        X(rd) = X(rs1);
+    } else if ((int64_t) X(rs1) == INT64_MIN &&
+               (int64_t) X(rs2) == -1) { /* overflow */
+        X(rd) = 0;
+    } else {
+        X(rd) = (int64_t) X(rs1) % (int64_t) X(rs2);
+    }
+    return OK;
+}
+
+INSN(or)
+{
+    X(rd) = X(rs1) | X(rs2);
+    return OK;
+}
+
+INSN(and)
+{
+    X(rd) = X(rs1) & X(rs2);
+    return OK;
+}
+
+INSN(remu)
+{
+    X(rd) = (X(rs2) == 0) ? X(rs1) : (X(rs1) % X(rs2));
+    return OK;
+}
+
+INSN(lui)
+{
+    X(rd) = insn->imm;
+    return OK;
+}
+
+INSN(addw)
+{
+    X(rd) = (int32_t) (X(rs1) + X(rs2));
+    return OK;
+}
+
+INSN(mulw)
+{
+    X(rd) = (int32_t) X(rs1) * (int32_t) X(rs2);
+    return OK;
+}
+
+INSN(subw)
+{
+    X(rd) = (int32_t) (X(rs1) - X(rs2));
+    return OK;
+}
+
+INSN(sllw)
+{
+    X(rd) = (int32_t) ((uint32_t) X(rs1) << (X(rs2) & 0x1f));
+    return OK;
+}
+
+INSN(divw)
+{
+    if (X(rs2) == 0) {
+        X(rd) = -1;
+    } else if ((int32_t) X(rs1) == INT32_MIN &&
+               (int32_t) X(rs2) == -1) { /* overflow */
+        X(rd) = INT32_MIN;
+    } else {
+        X(rd) = (int32_t) X(rs1) / (int32_t) X(rs2);
+    }
+    return OK;
+}
+
+INSN(srlw)
+{
+    X(rd) = (int32_t) ((uint32_t) X(rs1) >> (X(rs2) & 0x1f));
+    return OK;
+}
+
+INSN(divuw)
+{
+    X(rd) = (X(rs2) == 0)
+                ? UINT64_MAX
+                : (uint64_t) (int32_t) ((uint32_t) X(rs1) / (uint32_t) X(rs2));
+    return OK;
+}
+
+INSN(sraw)
+{
+    X(rd) = (int32_t) X(rs1) >> (int32_t) (X(rs2) & 0x1f);
+    return OK;
+}
+
+INSN(remw)
+{
+    if (X(rs2) == 0) {
+        X(rd) = X(rs1);
+    } else if ((int32_t) X(rs1) == INT32_MIN &&
+               (int32_t) X(rs2) == -1) { /* overflow */
+        X(rd) = 0;
+    } else {
+        X(rd) = (int32_t) X(rs1) % (int32_t) X(rs2);
+    }
+    return OK;
+}
+
+INSN(remuw)
+{
+    X(rd) = (X(rs2) == 0)
+                ? X(rs1)
+                : (uint64_t) (int32_t) ((uint32_t) X(rs1) % (uint32_t) X(rs2));
+    return OK;
+}
+
+INSN_BRANCH(beq, a == b)
+INSN_BRANCH(bne, a != b)
+INSN_BRANCH(blt, (int64_t) a < (int64_t) b)
+INSN_BRANCH(bge, (int64_t) a >= (int64_t) b)
+INSN_BRANCH(bltu, a < b)
+INSN_BRANCH(bgeu, a >= b)
+
+INSN(jalr)
+{
+    uint64_t t = cpu->pc;
+    cpu->pc = (X(rs1) + insn->imm) & ~1;
+    X(rd) = t;
+    return OK;
+}
+
+INSN(jal)
+{
+    X(rd) = cpu->pc;
+    cpu->pc += insn->imm - insn->len;
+    return OK;
+}
+
+INSN(ecall)
+{
+    (void) insn;
+    return 8 + cpu->mode; /* ECALL_FROM_{U,S,M}MODE */
+}
+
+INSN(ebreak)
+{
+    (void) cpu, (void) insn;
+    return BREAKPOINT;
+}
+
+INSN(sret)
+{
+    (void) insn;
+    cpu->pc = cpu_load_csr(cpu, SEPC);
+    cpu->mode = ((cpu_load_csr(cpu, SSTATUS) >> 8) & 1) ? SUPERVISOR : USER;
+    cpu_store_csr(cpu, SSTATUS,
+                  ((cpu_load_csr(cpu, SSTATUS) >> 5) & 1)
+                      ? cpu_load_csr(cpu, SSTATUS) | (1 << 1)
+                      : cpu_load_csr(cpu, SSTATUS) & ~(1 << 1));
+    cpu_store_csr(cpu, SSTATUS, cpu_load_csr(cpu, SSTATUS) | (1 << 5));
+    cpu_store_csr(cpu, SSTATUS, cpu_load_csr(cpu, SSTATUS) & ~(1 << 8));
+    cpu_update_interrupts(cpu, SSTATUS);
+    return OK;
+}
+
+INSN(mret)
+{
+    (void) insn;
+    cpu->pc = cpu_load_csr(cpu, MEPC);
+    uint64_t mpp = (cpu_load_csr(cpu, MSTATUS) >> 11) & 3;
+    cpu->mode = mpp == 2 ? MACHINE : (mpp == 1 ? SUPERVISOR : USER);
+    cpu_store_csr(cpu, MSTATUS,
+                  ((cpu_load_csr(cpu, MSTATUS) >> 7) & 1)
+                      ? cpu_load_csr(cpu, MSTATUS) | (1 << 3)
+                      : cpu_load_csr(cpu, MSTATUS) & ~(1 << 3));
+    cpu_store_csr(cpu, MSTATUS, cpu_load_csr(cpu, MSTATUS) | (1 << 7));
+    cpu_store_csr(cpu, MSTATUS, cpu_load_csr(cpu, MSTATUS) & ~(3 << 11));
+    cpu_update_interrupts(cpu, MSTATUS);
+    return OK;
+}
+
+/* The hart stalls between blocks, see cpu_wait. */
+INSN(wfi)
+{
+    (void) insn;
+    cpu->wfi = true;
+    return OK;
+}
+
+INSN(sfence_vma)
+{
+    (void) insn;
+    cpu_flush_tlb(cpu);
+    if (cpu->bus->nharts > 1) {
+        cpu->tlb_epoch =
+            __atomic_add_fetch(&cpu->bus->tlb_epoch, 1, __ATOMIC_RELEASE);
+        sched_kick(cpu->bus->sched);
+    }
+    return OK;
+}
+
+/* For CSR instructions the immediate holds the CSR address, and the *i forms
+ * use the rs1 field as a 5-bit unsigned immediate.
+ */
+INSN(csrrw)
+{
+    if (!cpu_csr_accessible(cpu, insn->imm))
+        return ILLEGAL_INSTRUCTION;
+    uint64_t t = cpu_load_csr(cpu, insn->imm);
+    cpu_store_csr(cpu, insn->imm, X(rs1));
+    X(rd) = t;
+    cpu_update_paging(cpu, insn->imm);
+    cpu_update_interrupts(cpu, insn->imm);
+    return OK;
+}
+
+INSN(csrrs)
+{
+    if (!cpu_csr_accessible(cpu, insn->imm))
+        return ILLEGAL_INSTRUCTION;
+    uint64_t t = cpu_load_csr(cpu, insn->imm);
+    cpu_store_csr(cpu, insn->imm, t | X(rs1));
+    X(rd) = t;
+    cpu_update_paging(cpu, insn->imm);
+    cpu_update_interrupts(cpu, insn->imm);
+    return OK;
+}
+
+INSN(csrrc)
+{
+    if (!cpu_csr_accessible(cpu, insn->imm))
+        return ILLEGAL_INSTRUCTION;
+    uint64_t t = cpu_load_csr(cpu, insn->imm);
+    cpu_store_csr(cpu, insn->imm, t & ~X(rs1));
+    X(rd) = t;
+    cpu_update_paging(cpu, insn->imm);
+    cpu_update_interrupts(cpu, insn->imm);
+    return OK;
+}
+
+INSN(csrrwi)
+{
+    if (!cpu_csr_accessible(cpu, insn->imm))
+        return ILLEGAL_INSTRUCTION;
+    X(rd) = cpu_load_csr(cpu, insn->imm);
+    cpu_store_csr(cpu, insn->imm, insn->rs1);
+    cpu_update_paging(cpu, insn->imm);
+    cpu_update_interrupts(cpu, insn->imm);
+    return OK;
+}
+
+INSN(csrrsi)
+{
+    if (!cpu_csr_accessible(cpu, insn->imm))
+        return ILLEGAL_INSTRUCTION;
+    uint64_t t = cpu_load_csr(cpu, insn->imm);
+    cpu_store_csr(cpu, insn->imm, t | insn->rs1);
+    X(rd) = t;
+    cpu_update_paging(cpu, insn->imm);
+    cpu_update_interrupts(cpu, insn->imm);
+    return OK;
+}
+
+INSN(csrrci)
+{
+    if (!cpu_csr_accessible(cpu, insn->imm))
+        return ILLEGAL_INSTRUCTION;
+    uint64_t t = cpu_load_csr(cpu, insn->imm);
+    cpu_store_csr(cpu, insn->imm, t & ~(uint64_t) insn->rs1);
+    X(rd) = t;
+    cpu_update_paging(cpu, insn->imm);
+    cpu_update_interrupts(cpu, insn->imm);
+    return OK;
+}
+
+/* F and D. Singles are NaN-boxed in the 64-bit registers: one whose upper
+ * half is not all ones reads as the canonical NaN. Arithmetic runs on the
+ * host FPU, in the rounding mode of the instruction, and the exceptions it
+ * raises accrue in fflags. NaN results are made canonical, since the default
+ * NaN of the host differs. The host cannot round to nearest with ties away
+ * from zero, so RMM only differs from RNE in conversions to integers.
+ */
+#define F_NAN_S 0x7fc00000U
+#define F_NAN_D 0x7ff8000000000000ULL
+enum { FFLAG_NX = 1, FFLAG_UF = 2, FFLAG_OF = 4, FFLAG_DZ = 8, FFLAG_NV = 16 };
+enum { RM_RNE, RM_RTZ, RM_RDN, RM_RUP, RM_RMM, RM_DYN = 7 };
+
+static inline bool fpu_enabled(const struct cpu *cpu)
+{
+    return cpu->csrs[MSTATUS] & MSTATUS_FS;
+}
+
+static inline void fpu_raise(struct cpu *cpu, const uint64_t flags)
+{
+    cpu->csrs[FCSR] |= flags;
+    cpu_dirty_fs(cpu);
+}
+
+/* The accessors of registers holding values of type ftype, with bits of type
+ * utype: the raw bits, the value, setting either, and classifying them.
+ */
+#define FPU_PRECISION(t, ftype, utype, nan, quiet, sign, box)                    \
+    static inline utype fpu_bits_##t(const struct cpu *cpu, const int r)    \
+    {                                                                       \
+        uint64_t v = cpu->fregs[r];                                         \
+        return (v | ~(box)) == ~(uint64_t) 0 ? (utype) v : (nan);           \
+    }                                                                       \
+                                                                            \
+    static inline ftype fpu_##t(const struct cpu *cpu, const int r)         \
+    {                                                                       \
+        utype b = fpu_bits_##t(cpu, r);                                     \
+        ftype f;                                                            \
+        memcpy(&f, &b, sizeof(f));                                          \
+        return f;                                                           \
+    }                                                                       \
+                                                                            \
+    static inline void fpu_set_bits_##t(struct cpu *cpu, const int r,       \
+                                        const utype b)                      \
+    {                                                                       \
+        cpu->fregs[r] = (box) | b;                                          \
+        cpu_dirty_fs(cpu);                                                  \
+    }                                                                       \
+                                                                            \
+    static inline void fpu_set_##t(struct cpu *cpu, const int r,            \
+                                   const ftype f)                           \
+    {                                                                       \
+        utype b = (nan);                                                    \
+        if (!isnan(f))                                                      \
+            memcpy(&b, &f, sizeof(b));                                      \
+        fpu_set_bits_##t(cpu, r, b);                                        \
+    }                                                                       \
+                                                                            \
+    static inline bool fpu_is_snan_##t(const utype b)                       \
+    {                                                                       \
+        return (b & (nan)) == ((nan) & ~(quiet)) && (b & ~(nan) & ~(sign)); \
+    }                                                                       \
+                                                                            \
+    /* fmin and fmax: a NaN yields the other operand, and -0 < +0. */       \
+    static inline void fpu_minmax_##t(struct cpu *cpu,                      \
+                                      const struct insn *insn,              \
+                                      const bool max)                       \
+    {                                                                       \
+        utype a = fpu_bits_##t(cpu, insn->rs1);                             \
+        utype b = fpu_bits_##t(cpu, insn->rs2);                             \
+        ftype x = fpu_##t(cpu, insn->rs1), y = fpu_##t(cpu, insn->rs2);     \
+        if (fpu_is_snan_##t(a) || fpu_is_snan_##t(b))                       \
+            fpu_raise(cpu, FFLAG_NV);                                       \
+        utype r;                                                            \
+        if (isnan(x) && isnan(y))                                           \
+            r = (nan);                                                      \
+        else if (isnan(x))                                                  \
+            r = b;                                                          \
+        else if (isnan(y))                                                  \
+            r = a;                                                          \
+        else if (x == y) /* only differ in sign if both are zero */         \
+            r = max ? a & b : a | b;                                        \
+        else                                                                \
+            r = (x < y) != max ? a : b;                                     \
+        fpu_set_bits_##t(cpu, insn->rd, r);                                 \
+    }                                                                       \
+                                                                            \
+    /* feq only signals on signaling NaNs, flt and fle on any NaN. */       \
+    static inline uint64_t fpu_compare_##t(struct cpu *cpu,                 \
+                                           const struct insn *insn,         \
+                                           const int op)                    \
+    {                                                                       \
+        utype a = fpu_bits_##t(cpu, insn->rs1);                             \
+        utype b = fpu_bits_##t(cpu, insn->rs2);                             \
+        ftype x = fpu_##t(cpu, insn->rs1), y = fpu_##t(cpu, insn->rs2);     \
+        if (isnan(x) || isnan(y)) {                                         \
+            if (op != 2 || fpu_is_snan_##t(a) || fpu_is_snan_##t(b))        \
+                fpu_raise(cpu, FFLAG_NV);                                   \
+            return 0;                                                       \
+        }                                                                   \
+        return op == 0 ? x <= y : op == 1 ? x < y : x == y;                 \
+    }                                                                       \
+                                                                            \
+    static inline uint64_t fpu_class_##t(const struct cpu *cpu, const int r) \
+    {                                                                       \
+        utype b = fpu_bits_##t(cpu, r);                                     \
+        bool neg = b & (sign);                                              \
+        switch (fpclassify(fpu_##t(cpu, r))) {                              \
+        case FP_INFINITE:                                                   \
+            return neg ? 1 << 0 : 1 << 7;                                   \
+        case FP_NORMAL:                                                     \
+            return neg ? 1 << 1 : 1 << 6;                                   \
+        case FP_SUBNORMAL:                                                  \
+            return neg ? 1 << 2 : 1 << 5;                                   \
+        case FP_ZERO:                                                       \
+            return neg ? 1 << 3 : 1 << 4;                                   \
+        default:                                                            \
+            return fpu_is_snan_##t(b) ? 1 << 8 : 1 << 9;                    \
+        }                                                                   \
+    }
+
+FPU_PRECISION(s, float, uint32_t, F_NAN_S, 1U << 22, 1U << 31, 0xffffffff00000000ULL)
+FPU_PRECISION(d, double, uint64_t, F_NAN_D, 1ULL << 51, 1ULL << 63, 0)
+
+/* Start an instruction that rounds: check that the FPU is on and the
+ * rounding mode valid, switch the host to it and clear the host flags.
+ */
+static inline exception_t fpu_enter(const struct cpu *cpu,
+                                    const struct insn *insn,
+                                    int *rm)
+{
+    static const int modes[] = {
+        [RM_RNE] = FE_TONEAREST, [RM_RTZ] = FE_TOWARDZERO,
+        [RM_RDN] = FE_DOWNWARD,  [RM_RUP] = FE_UPWARD,
+        [RM_RMM] = FE_TONEAREST,
+    };
+    if (!fpu_enabled(cpu))
+        return ILLEGAL_INSTRUCTION;
+    *rm = insn->imm & 7;
+    if (*rm == RM_DYN)
+        *rm = (cpu->csrs[FCSR] >> 5) & 7;
+    if (*rm > RM_RMM)
+        return ILLEGAL_INSTRUCTION;
+    feclearexcept(FE_ALL_EXCEPT);
+    if (modes[*rm] != FE_TONEAREST)
+        fesetround(modes[*rm]);
+    return OK;
+}
+
+static inline void fpu_leave(struct cpu *cpu, const int rm)
+{
+    int raised = fetestexcept(FE_ALL_EXCEPT);
+    if (raised)
+        fpu_raise(cpu, (raised & FE_INVALID ? FFLAG_NV : 0) |
+                           (raised & FE_DIVBYZERO ? FFLAG_DZ : 0) |
+                           (raised & FE_OVERFLOW ? FFLAG_OF : 0) |
+                           (raised & FE_UNDERFLOW ? FFLAG_UF : 0) |
+                           (raised & FE_INEXACT ? FFLAG_NX : 0));
+    if (rm != RM_RNE && rm != RM_RMM)
+        fesetround(FE_TONEAREST);
+}
+
+/* Round x to an integer and convert it to one in [lo, hi), as a signed or
+ * unsigned value. Out of range and NaN inputs saturate to min or max and
+ * only raise NV.
+ */
+static uint64_t fpu_to_int(const double x,
+                           const int rm,
+                           const double lo,
+                           const double hi,
+                           const uint64_t min,
+                           const uint64_t max,
+                           const bool is_signed)
+{
+    double r = rint(x);
+    if (rm == RM_RMM && (r = round(x)) != x)
+        feraiseexcept(FE_INEXACT);
+    if (isnan(r) || r >= hi || r < lo) {
+        feclearexcept(FE_ALL_EXCEPT);
+        feraiseexcept(FE_INVALID);
+        return !isnan(r) && r < lo ? min : max;
+    }
+    return is_signed ? (uint64_t) (int64_t) r : (uint64_t) r;
+}
+
+#define FS(r) fpu_s(cpu, insn->r)
+#define FD(r) fpu_d(cpu, insn->r)
+#define FS3 fpu_s(cpu, insn->imm >> 3)
+#define FD3 fpu_d(cpu, insn->imm >> 3)
+#define SET_S(v) fpu_set_s(cpu, insn->rd, v)
+#define SET_D(v) fpu_set_d(cpu, insn->rd, v)
+
+/* An instruction that rounds; the rounding mode is in rm. */
+#define INSN_FP(name, body)                                       \
+    INSN(name)                                                    \
+    {                                                             \
+        int rm;                                                   \
+        exception_t e = fpu_enter(cpu, insn, &rm);                \
+        if (e != OK)                                              \
+            return e;                                             \
+        body;                                                     \
+        fpu_leave(cpu, rm);                                       \
+        return OK;                                                \
+    }
+
+/* One that does not, and sets its flags itself. */
+#define INSN_FP_EXACT(name, body)                                 \
+    INSN(name)                                                    \
+    {                                                             \
+        if (!fpu_enabled(cpu))                                    \
+            return ILLEGAL_INSTRUCTION;                           \
+        body;                                                     \
+        return OK;                                                \
+    }
+
+#define INSN_FP_LOAD(name, size, t)                               \
+    INSN(name)                                                    \
+    {                                                             \
+        if (!fpu_enabled(cpu))                                    \
+            return ILLEGAL_INSTRUCTION;                           \
+        uint64_t result;                                          \
+        uint64_t addr = cpu->regs[insn->rs1] + insn->imm;         \
+        exception_t e = cpu_load(cpu, addr, size, &result);       \
+        if (e != OK)                                              \
+            return e;                                             \
+        fpu_set_bits_##t(cpu, insn->rd, result);                  \
+        return OK;                                                \
+    }
+
+#define INSN_FP_STORE(name, size)                                 \
+    INSN(name)                                                    \
+    {                                                             \
+        if (!fpu_enabled(cpu))                                    \
+            return ILLEGAL_INSTRUCTION;                           \
+        uint64_t addr = cpu->regs[insn->rs1] + insn->imm;         \
+        return cpu_store(cpu, addr, size, cpu->fregs[insn->rs2]); \
+    }
+
+INSN_FP_LOAD(flw, 32, s)
+INSN_FP_LOAD(fld, 64, d)
+INSN_FP_STORE(fsw, 32)
+INSN_FP_STORE(fsd, 64)
+
+INSN_FP(fmadd_s, SET_S(fmaf(FS(rs1), FS(rs2), FS3)))
+INSN_FP(fmsub_s, SET_S(fmaf(FS(rs1), FS(rs2), -FS3)))
+INSN_FP(fnmsub_s, SET_S(fmaf(-FS(rs1), FS(rs2), FS3)))
+INSN_FP(fnmadd_s, SET_S(fmaf(-FS(rs1), FS(rs2), -FS3)))
+INSN_FP(fadd_s, SET_S(FS(rs1) + FS(rs2)))
+INSN_FP(fsub_s, SET_S(FS(rs1) - FS(rs2)))
+INSN_FP(fmul_s, SET_S(FS(rs1) * FS(rs2)))
+INSN_FP(fdiv_s, SET_S(FS(rs1) / FS(rs2)))
+INSN_FP(fsqrt_s, SET_S(sqrtf(FS(rs1))))
+INSN_FP_EXACT(fsgnj_s,
+              fpu_set_bits_s(cpu, insn->rd,
+                             (fpu_bits_s(cpu, insn->rs1) & 0x7fffffff) |
+                                 (fpu_bits_s(cpu, insn->rs2) & 0x80000000)))
+INSN_FP_EXACT(fsgnjn_s,
+              fpu_set_bits_s(cpu, insn->rd,
+                             (fpu_bits_s(cpu, insn->rs1) & 0x7fffffff) |
+                                 (~fpu_bits_s(cpu, insn->rs2) & 0x80000000)))
+INSN_FP_EXACT(fsgnjx_s,
+              fpu_set_bits_s(cpu, insn->rd,
+                             fpu_bits_s(cpu, insn->rs1) ^
+                                 (fpu_bits_s(cpu, insn->rs2) & 0x80000000)))
+INSN_FP_EXACT(fmin_s, fpu_minmax_s(cpu, insn, false))
+INSN_FP_EXACT(fmax_s, fpu_minmax_s(cpu, insn, true))
+INSN_FP(fcvt_w_s,
+        X(rd) = (int32_t) fpu_to_int(FS(rs1), rm, -2147483648.0, 2147483648.0,
+                                     INT32_MIN, INT32_MAX, true))
+INSN_FP(fcvt_wu_s,
+        X(rd) = (int32_t) fpu_to_int(FS(rs1), rm, 0, 4294967296.0, 0,
+                                     UINT32_MAX, false))
+INSN_FP(fcvt_l_s,
+        X(rd) = fpu_to_int(FS(rs1), rm, -9223372036854775808.0,
+                           9223372036854775808.0, INT64_MIN, INT64_MAX, true))
+INSN_FP(fcvt_lu_s,
+        X(rd) = fpu_to_int(FS(rs1), rm, 0, 18446744073709551616.0, 0,
+                           UINT64_MAX, false))
+INSN_FP_EXACT(fmv_x_w, X(rd) = (int32_t) cpu->fregs[insn->rs1])
+INSN_FP_EXACT(feq_s, X(rd) = fpu_compare_s(cpu, insn, 2))
+INSN_FP_EXACT(flt_s, X(rd) = fpu_compare_s(cpu, insn, 1))
+INSN_FP_EXACT(fle_s, X(rd) = fpu_compare_s(cpu, insn, 0))
+INSN_FP_EXACT(fclass_s, X(rd) = fpu_class_s(cpu, insn->rs1))
+INSN_FP(fcvt_s_w, SET_S((float) (int32_t) X(rs1)))
+INSN_FP(fcvt_s_wu, SET_S((float) (uint32_t) X(rs1)))
+INSN_FP(fcvt_s_l, SET_S((float) (int64_t) X(rs1)))
+INSN_FP(fcvt_s_lu, SET_S((float) X(rs1)))
+INSN_FP_EXACT(fmv_w_x, fpu_set_bits_s(cpu, insn->rd, X(rs1)))
+
+INSN_FP(fmadd_d, SET_D(fma(FD(rs1), FD(rs2), FD3)))
+INSN_FP(fmsub_d, SET_D(fma(FD(rs1), FD(rs2), -FD3)))
+INSN_FP(fnmsub_d, SET_D(fma(-FD(rs1), FD(rs2), FD3)))
+INSN_FP(fnmadd_d, SET_D(fma(-FD(rs1), FD(rs2), -FD3)))
+INSN_FP(fadd_d, SET_D(FD(rs1) + FD(rs2)))
+INSN_FP(fsub_d, SET_D(FD(rs1) - FD(rs2)))
+INSN_FP(fmul_d, SET_D(FD(rs1) * FD(rs2)))
+INSN_FP(fdiv_d, SET_D(FD(rs1) / FD(rs2)))
+INSN_FP(fsqrt_d, SET_D(sqrt(FD(rs1))))
+INSN_FP_EXACT(fsgnj_d,
+              fpu_set_bits_d(cpu, insn->rd,
+                             (cpu->fregs[insn->rs1] & ~(1ULL << 63)) |
+                                 (cpu->fregs[insn->rs2] & 1ULL << 63)))
+INSN_FP_EXACT(fsgnjn_d,
+              fpu_set_bits_d(cpu, insn->rd,
+                             (cpu->fregs[insn->rs1] & ~(1ULL << 63)) |
+                                 (~cpu->fregs[insn->rs2] & 1ULL << 63)))
+INSN_FP_EXACT(fsgnjx_d,
+              fpu_set_bits_d(cpu, insn->rd,
+                             cpu->fregs[insn->rs1] ^
+                                 (cpu->fregs[insn->rs2] & 1ULL << 63)))
+INSN_FP_EXACT(fmin_d, fpu_minmax_d(cpu, insn, false))
+INSN_FP_EXACT(fmax_d, fpu_minmax_d(cpu, insn, true))
+INSN_FP(fcvt_s_d, SET_S((float) FD(rs1)))
+INSN_FP(fcvt_d_s, SET_D((double) FS(rs1)))
+INSN_FP(fcvt_w_d,
+        X(rd) = (int32_t) fpu_to_int(FD(rs1), rm, -2147483648.0, 2147483648.0,
+                                     INT32_MIN, INT32_MAX, true))
+INSN_FP(fcvt_wu_d,
+        X(rd) = (int32_t) fpu_to_int(FD(rs1), rm, 0, 4294967296.0, 0,
+                                     UINT32_MAX, false))
+INSN_FP(fcvt_l_d,
+        X(rd) = fpu_to_int(FD(rs1), rm, -9223372036854775808.0,
+                           9223372036854775808.0, INT64_MIN, INT64_MAX, true))
+INSN_FP(fcvt_lu_d,
+        X(rd) = fpu_to_int(FD(rs1), rm, 0, 18446744073709551616.0, 0,
+                           UINT64_MAX, false))
+INSN_FP_EXACT(fmv_x_d, X(rd) = cpu->fregs[insn->rs1])
+INSN_FP_EXACT(feq_d, X(rd) = fpu_compare_d(cpu, insn, 2))
+INSN_FP_EXACT(flt_d, X(rd) = fpu_compare_d(cpu, insn, 1))
+INSN_FP_EXACT(fle_d, X(rd) = fpu_compare_d(cpu, insn, 0))
+INSN_FP_EXACT(fclass_d, X(rd) = fpu_class_d(cpu, insn->rs1))
+INSN_FP(fcvt_d_w, SET_D((double) (int32_t) X(rs1)))
+INSN_FP(fcvt_d_wu, SET_D((double) (uint32_t) X(rs1)))
+INSN_FP(fcvt_d_l, SET_D((double) (int64_t) X(rs1)))
+INSN_FP(fcvt_d_lu, SET_D((double) X(rs1)))
+INSN_FP_EXACT(fmv_d_x, fpu_set_bits_d(cpu, insn->rd, X(rs1)))
+
+#undef SET_D
+#undef SET_S
+#undef FD3
+#undef FS3
+#undef FD
+#undef FS
+
+#undef X
+
+/* Every instruction handler, in the order of enum insn_op. */
+#define INSN_HANDLER(name) insn_##name,
+static const insn_handler_t insn_handlers[N_OPS] = {INSN_LIST(INSN_HANDLER)};
+#undef INSN_HANDLER
+
+/* Encoders of the 32-bit formats, for expanding compressed instructions. */
+#define ENC_R(op, f3, f7, rd, rs1, rs2)                                  \
+    ((f7) << 25 | (rs2) << 20 | (rs1) << 15 | (f3) << 12 | (rd) << 7 | (op))
+#define ENC_I(op, f3, rd, rs1, imm) \
+    ((uint32_t) (imm) << 20 | (rs1) << 15 | (f3) << 12 | (rd) << 7 | (op))
+#define ENC_S(op, f3, rs1, rs2, imm)                                 \
+    (((uint32_t) (imm) >> 5 & 0x7f) << 25 | (rs2) << 20 | (rs1) << 15 | \
+     (f3) << 12 | ((imm) & 0x1f) << 7 | (op))
+#define ENC_B(f3, rs1, rs2, imm)                                     \
+    (((imm) >> 12 & 1) << 31 | ((imm) >> 5 & 0x3f) << 25 | (rs2) << 20 | \
+     (rs1) << 15 | (f3) << 12 | ((imm) >> 1 & 0xf) << 8 |              \
+     ((imm) >> 11 & 1) << 7 | 0x63)
+#define ENC_J(rd, imm)                                                 \
+    (((imm) >> 20 & 1) << 31 | ((imm) >> 1 & 0x3ff) << 21 |             \
+     ((imm) >> 11 & 1) << 20 | ((imm) >> 12 & 0xff) << 12 | (rd) << 7 | \
+     0x6f)
+
+/* Sign-extend the low bits of x. */
+static inline uint32_t sext(const uint32_t x, const int bits)
+{
+    return (uint32_t) ((int32_t) (x << (32 - bits)) >> (32 - bits));
 }
 
-static inline void cpu_store_csr(struct cpu *cpu,
-                                 const uint16_t addr,
-                                 const uint64_t value)
+/* Expand a compressed instruction into the 32-bit instruction it stands
+ * for, or into C_RESERVED, which no opcode matches, for reserved encodings.
+ */
+#define C_RESERVED 0xffffffff
+static uint32_t cpu_expand_compressed(const uint32_t c)
 {
-    if (addr == SIE) {
-        cpu->csrs[MIE] = (cpu->csrs[MIE] & ~cpu->csrs[MIDELEG]) |
-                         (value & cpu->csrs[MIDELEG]);
-        return;
+    uint32_t funct3 = c >> 13 & 0x7;
+    uint32_t rd = c >> 7 & 0x1f, rs2 = c >> 2 & 0x1f;
+    uint32_t rd_ = (c >> 2 & 0x7) + 8, rs1_ = (c >> 7 & 0x7) + 8;
+    uint32_t imm6 = sext((c >> 7 & 0x20) | (c >> 2 & 0x1f), 6);
+    uint32_t imm;
+
+    switch ((c & 0x3) << 3 | funct3) {
+    case 0x00: /* c.addi4spn */
+        imm = (c >> 7 & 0x30) | (c >> 1 & 0x3c0) | (c >> 4 & 0x4) |
+              (c >> 2 & 0x8);
+        return imm ? ENC_I(0x13, 0x0, rd_, 2, imm) : C_RESERVED;
+    case 0x01: /* c.fld */
+    case 0x03: /* c.ld */
+        imm = (c >> 7 & 0x38) | (c << 1 & 0xc0);
+        return ENC_I(funct3 == 0x1 ? 0x07 : 0x03, 0x3, rd_, rs1_, imm);
+    case 0x02: /* c.lw */
+        imm = (c >> 7 & 0x38) | (c >> 4 & 0x4) | (c << 1 & 0x40);
+        return ENC_I(0x03, 0x2, rd_, rs1_, imm);
+    case 0x05: /* c.fsd */
+    case 0x07: /* c.sd */
+        imm = (c >> 7 & 0x38) | (c << 1 & 0xc0);
+        return ENC_S(funct3 == 0x5 ? 0x27 : 0x23, 0x3, rs1_, rd_, imm);
+    case 0x06: /* c.sw */
+        imm = (c >> 7 & 0x38) | (c >> 4 & 0x4) | (c << 1 & 0x40);
+        return ENC_S(0x23, 0x2, rs1_, rd_, imm);
+
+    case 0x08: /* c.addi */
+        return ENC_I(0x13, 0x0, rd, rd, imm6);
+    case 0x09: /* c.addiw */
+        return rd ? ENC_I(0x1b, 0x0, rd, rd, imm6) : C_RESERVED;
+    case 0x0a: /* c.li */
+        return ENC_I(0x13, 0x0, rd, 0, imm6);
+    case 0x0b:
+        if (rd == 2) { /* c.addi16sp */
+            imm = sext((c >> 3 & 0x200) | (c >> 2 & 0x10) | (c << 1 & 0x40) |
+                           (c << 4 & 0x180) | (c << 3 & 0x20),
+                       10);
+            return imm ? ENC_I(0x13, 0x0, 2, 2, imm) : C_RESERVED;
+        }
+        /* c.lui */
+        return imm6 ? (imm6 << 12) | rd << 7 | 0x37 : C_RESERVED;
+    case 0x0c:
+        rd = rs1_;
+        switch (c >> 10 & 0x3) {
+        case 0x0: /* c.srli */
+            return ENC_I(0x13, 0x5, rd, rd, imm6 & 0x3f);
+        case 0x1: /* c.srai */
+            return ENC_I(0x13, 0x5, rd, rd, (imm6 & 0x3f) | 0x400);
+        case 0x2: /* c.andi */
+            return ENC_I(0x13, 0x7, rd, rd, imm6);
+        }
+        switch ((c >> 10 & 0x4) | (c >> 5 & 0x3)) {
+        case 0x0: /* c.sub */
+            return ENC_R(0x33, 0x0, 0x20, rd, rd, rd_);
+        case 0x1: /* c.xor */
+            return ENC_R(0x33, 0x4, 0x00, rd, rd, rd_);
+        case 0x2: /* c.or */
+            return ENC_R(0x33, 0x6, 0x00, rd, rd, rd_);
+        case 0x3: /* c.and */
+            return ENC_R(0x33, 0x7, 0x00, rd, rd, rd_);
+        case 0x4: /* c.subw */
+            return ENC_R(0x3b, 0x0, 0x20, rd, rd, rd_);
+        case 0x5: /* c.addw */
+            return ENC_R(0x3b, 0x0, 0x00, rd, rd, rd_);
+        }
+        return C_RESERVED;
+    case 0x0d: /* c.j */
+        imm = sext((c >> 1 & 0x800) | (c >> 7 & 0x10) | (c >> 1 & 0x300) |
+                       (c << 2 & 0x400) | (c >> 1 & 0x40) | (c << 1 & 0x80) |
+                       (c >> 2 & 0xe) | (c << 3 & 0x20),
+                   12);
+        return ENC_J(0, imm);
+    case 0x0e: /* c.beqz */
+    case 0x0f: /* c.bnez */
+        imm = sext((c >> 4 & 0x100) | (c >> 7 & 0x18) | (c << 1 & 0xc0) |
+                       (c >> 2 & 0x6) | (c << 3 & 0x20),
+                   9);
+        return ENC_B(funct3 & 0x1, rs1_, 0, imm);
+
+    case 0x10: /* c.slli */
+        return ENC_I(0x13, 0x1, rd, rd, imm6 & 0x3f);
+    case 0x11: /* c.fldsp */
+    case 0x13: /* c.ldsp */
+        imm = (c >> 7 & 0x20) | (c >> 2 & 0x18) | (c << 4 & 0x1c0);
+        if (funct3 == 0x3 && !rd)
+            return C_RESERVED;
+        return ENC_I(funct3 == 0x1 ? 0x07 : 0x03, 0x3, rd, 2, imm);
+    case 0x12: /* c.lwsp */
+        imm = (c >> 7 & 0x20) | (c >> 2 & 0x1c) | (c << 4 & 0xc0);
+        return rd ? ENC_I(0x03, 0x2, rd, 2, imm) : C_RESERVED;
+    case 0x14:
+        if (!(c & 0x1000)) {
+            if (rs2) /* c.mv */
+                return ENC_R(0x33, 0x0, 0x00, rd, 0, rs2);
+            return rd ? ENC_I(0x67, 0x0, 0, rd, 0) : C_RESERVED; /* c.jr */
+        }
+        if (rs2) /* c.add */
+            return ENC_R(0x33, 0x0, 0x00, rd, rd, rs2);
+        if (rd) /* c.jalr */
+            return ENC_I(0x67, 0x0, 1, rd, 0);
+        return 0x00100073; /* c.ebreak */
+    case 0x15: /* c.fsdsp */
+    case 0x17: /* c.sdsp */
+        imm = (c >> 7 & 0x38) | (c >> 1 & 0x1c0);
+        return ENC_S(funct3 == 0x5 ? 0x27 : 0x23, 0x3, 2, rs2, imm);
+    case 0x16: /* c.swsp */
+        imm = (c >> 7 & 0x3c) | (c >> 1 & 0xc0);
+        return ENC_S(0x23, 0x2, 2, rs2, imm);
     }
-    cpu->csrs[addr] = value;
+    return C_RESERVED;
 }
 
-static inline exception_t cpu_load(struct cpu *cpu,
-                                   const uint64_t addr,
-                                   const uint64_t size,
-                                   uint64_t *result)
-{
-    uint64_t pa;
-    exception_t e = cpu_translate(cpu, addr, LOAD_PAGE_FAULT, &pa);
-    if (e != OK)
-        return e;
-    return bus_load(cpu->bus, pa, size, result);
-}
+#undef C_RESERVED
+#undef ENC_J
+#undef ENC_B
+#undef ENC_S
+#undef ENC_I
+#undef ENC_R
 
-static inline exception_t cpu_store(struct cpu *cpu,
-                                    const uint64_t addr,
-                                    const uint64_t size,
-                                    const uint64_t value)
+/* The OP-FP major opcode, by funct5 and then format. */
+static uint8_t cpu_decode_fp(const uint32_t funct7,
+                             const uint32_t funct3,
+                             const uint32_t rs2)
 {
-    uint64_t pa;
-    exception_t e = cpu_translate(cpu, addr, STORE_AMO_PAGE_FAULT, &pa);
-    if (e != OK)
-        return e;
+#define FP_OP(name) (d ? OP_##name##_d : OP_##name##_s)
+    static const uint8_t to_int[2][4] = {
+        {OP_fcvt_w_s, OP_fcvt_wu_s, OP_fcvt_l_s, OP_fcvt_lu_s},
+        {OP_fcvt_w_d, OP_fcvt_wu_d, OP_fcvt_l_d, OP_fcvt_lu_d},
+    };
+    static const uint8_t from_int[2][4] = {
+        {OP_fcvt_s_w, OP_fcvt_s_wu, OP_fcvt_s_l, OP_fcvt_s_lu},
+        {OP_fcvt_d_w, OP_fcvt_d_wu, OP_fcvt_d_l, OP_fcvt_d_lu},
+    };
+    if ((funct7 & 0x3) > 1)
+        return OP_illegal;
+    bool d = funct7 & 0x1;
 
-    return bus_store(cpu->bus, pa, size, value);
+    switch (funct7 >> 2) {
+    case 0x00:
+        return FP_OP(fadd);
+    case 0x01:
+        return FP_OP(fsub);
+    case 0x02:
+        return FP_OP(fmul);
+    case 0x03:
+        return FP_OP(fdiv);
+    case 0x0b:
+        return rs2 == 0 ? FP_OP(fsqrt) : OP_illegal;
+    case 0x04:
+        if (funct3 == 0x0)
+            return FP_OP(fsgnj);
+        if (funct3 == 0x1)
+            return FP_OP(fsgnjn);
+        if (funct3 == 0x2)
+            return FP_OP(fsgnjx);
+        break;
+    case 0x05:
+        if (funct3 == 0x0)
+            return FP_OP(fmin);
+        if (funct3 == 0x1)
+            return FP_OP(fmax);
+        break;
+    case 0x08:
+        if (!d && rs2 == 1)
+            return OP_fcvt_s_d;
+        if (d && rs2 == 0)
+            return OP_fcvt_d_s;
+        break;
+    case 0x14:
+        if (funct3 == 0x0)
+            return FP_OP(fle);
+        if (funct3 == 0x1)
+            return FP_OP(flt);
+        if (funct3 == 0x2)
+            return FP_OP(feq);
+        break;
+    case 0x18:
+        if (rs2 < 4)
+            return to_int[d][rs2];
+        break;
+    case 0x1a:
+        if (rs2 < 4)
+            return from_int[d][rs2];
+        break;
+    case 0x1c:
+        if (rs2 == 0 && funct3 == 0x0)
+            return d ? OP_fmv_x_d : OP_fmv_x_w;
+        if (rs2 == 0 && funct3 == 0x1)
+            return FP_OP(fclass);
+        break;
+    case 0x1e:
+        if (rs2 == 0 && funct3 == 0x0)
+            return d ? OP_fmv_d_x : OP_fmv_w_x;
+        break;
+    }
+    return OP_illegal;
+#undef FP_OP
 }
 
-exception_t cpu_execute(struct cpu *cpu, const uint64_t insn)
+/* Decode a raw instruction into *insn. Returns true if the instruction ends a
+ * basic block, i.e. it may change the PC, the privilege mode or the address
+ * translation, or it always traps. Unlisted encodings decode to OP_illegal.
+ */
+static bool cpu_decode(const uint32_t raw, struct insn *insn)
 {
-    uint64_t opcode = insn & 0x7f;
-    uint64_t rd = (insn >> 7) & 0x1f;
-    uint64_t rs1 = (insn >> 15) & 0x1f, rs2 = (insn >> 20) & 0x1f;
-    uint64_t funct3 = (insn >> 12) & 0x7, funct7 = (insn >> 25) & 0x7f;
+    uint32_t opcode = raw & 0x7f;
+    uint32_t funct3 = (raw >> 12) & 0x7, funct7 = (raw >> 25) & 0x7f;
+    bool ends_block = false;
 
-    cpu->regs[0] = 0; /* x0 register is always zero */
+    if ((raw & 0x3) != 0x3) {
+        ends_block = cpu_decode(cpu_expand_compressed(raw & 0xffff), insn);
+        insn->len = 2;
+        return ends_block;
+    }
+
+    insn->len = 4;
+    insn->rd = (raw >> 7) & 0x1f;
+    insn->rs1 = (raw >> 15) & 0x1f, insn->rs2 = (raw >> 20) & 0x1f;
+    insn->imm = 0;
+    insn->op = OP_illegal;
 
-    exception_t e;
     switch (opcode) {
     case 0x03: {
-        uint64_t imm = (int32_t) insn >> 20;
-        uint64_t addr = cpu->regs[rs1] + imm;
-        switch (funct3) {
-        case 0x0: /* lb */ {
-            uint64_t result;
-            if ((e = cpu_load(cpu, addr, 8, &result)) != OK)
-                return e;
-            cpu->regs[rd] = (int8_t) result;
-            break;
-        }
-        case 0x1: /* lh */ {
-            uint64_t result;
-            if ((e = cpu_load(cpu, addr, 16, &result)) != OK)
-                return e;
-            cpu->regs[rd] = (int16_t) result;
-            break;
-        }
-        case 0x2: /* lw */ {
-            uint64_t result;
-            if ((e = cpu_load(cpu, addr, 32, &result)) != OK)
-                return e;
-            cpu->regs[rd] = (int32_t) result;
-            break;
-        }
-        case 0x3: /* ld */ {
-            uint64_t result;
-            if ((e = cpu_load(cpu, addr, 64, &result)) != OK)
-                return e;
-            cpu->regs[rd] = result;
-            break;
-        }
-        case 0x4: /* lbu */ {
-            uint64_t result;
-            if ((e = cpu_load(cpu, addr, 8, &result)) != OK)
-                return e;
-            cpu->regs[rd] = result;
-            break;
-        }
-        case 0x5: /* lhu */ {
-            uint64_t result;
-            if ((e = cpu_load(cpu, addr, 16, &result)) != OK)
-                return e;
-            cpu->regs[rd] = result;
-            break;
-        }
-        case 0x6: /* lwu */ {
-            uint64_t result;
-            if ((e = cpu_load(cpu, addr, 32, &result)) != OK)
-                return e;
-            cpu->regs[rd] = result;
-            break;
-        }
-        default:
-            return ILLEGAL_INSTRUCTION;
-        }
+        static const uint8_t loads[8] = {
+            OP_lb, OP_lh, OP_lw, OP_ld, OP_lbu, OP_lhu, OP_lwu,
+        };
+        insn->imm = (int32_t) raw >> 20;
+        insn->op = loads[funct3];
         break;
     }
+    case 0x07:
+        insn->imm = (int32_t) raw >> 20;
+        if (funct3 == 0x2)
+            insn->op = OP_flw;
+        else if (funct3 == 0x3)
+            insn->op = OP_fld;
+        break;
     case 0x0f:
-        switch (funct3) {
-        case 0x0: /* fence */
-            /* TODO: implemented */
-            break;
-        default:
-            return ILLEGAL_INSTRUCTION;
+        if (funct3 == 0x0) {
+            insn->op = OP_fence;
+        } else if (funct3 == 0x1) {
+            insn->op = OP_fence_i;
+            ends_block = true;
         }
         break;
     case 0x13: {
-        uint64_t imm = (int32_t) (insn & 0xfff00000) >> 20;
-        uint32_t shamt = imm & 0x3f;
-
-        switch (funct3) {
-        case 0x0: /* addi */
-            cpu->regs[rd] = cpu->regs[rs1] + imm;
-            break;
-        case 0x1: /* slli */
-            cpu->regs[rd] = cpu->regs[rs1] << shamt;
-            break;
-        case 0x2: /* slti */
-            cpu->regs[rd] = !!((int64_t) cpu->regs[rs1] < (int64_t) imm);
-            break;
-        case 0x3: /* sltiu */
-            cpu->regs[rd] = !!(cpu->regs[rs1] < imm);
-            break;
-        case 0x4: /* xori */
-            cpu->regs[rd] = cpu->regs[rs1] ^ imm;
-            break;
-        case 0x5:
-            switch (funct7 >> 1) {
-            case 0x00: /* srli */
-                cpu->regs[rd] = cpu->regs[rs1] >> shamt;
-                break;
-            case 0x10: /* srai */
-                cpu->regs[rd] = (int64_t) (cpu->regs[rs1]) >> shamt;
-                break;
-            default:
-                return ILLEGAL_INSTRUCTION;
-            }
-            break;
-        case 0x6: /* ori */
-            cpu->regs[rd] = cpu->regs[rs1] | imm;
-            break;
-        case 0x7: /* andi */
-            cpu->regs[rd] = cpu->regs[rs1] & imm;
-            break;
-        default:
-            return ILLEGAL_INSTRUCTION;
+        static const uint8_t alu[8] = {
+            OP_addi, OP_slli, OP_slti, OP_sltiu,
+            OP_xori, OP_srli, OP_ori,  OP_andi,
+        };
+        insn->imm = (int32_t) (raw & 0xfff00000) >> 20;
+        insn->op = alu[funct3];
+        if (funct3 == 0x1) {
+            insn->imm &= 0x3f;
+        } else if (funct3 == 0x5) {
+            if (funct7 >> 1 == 0x10)
+                insn->op = OP_srai;
+            else if (funct7 >> 1 != 0x00)
+                insn->op = OP_illegal;
+            insn->imm &= 0x3f;
         }
         break;
     }
-    case 0x17: /* auipc */ {
-        uint64_t imm = (int32_t) (insn & 0xfffff000);
-        cpu->regs[rd] = cpu->pc + imm - 4;
+    case 0x17:
+        insn->imm = (int32_t) (raw & 0xfffff000);
+        insn->op = OP_auipc;
         break;
-    }
-    case 0x1b: {
-        uint64_t imm = (int32_t) insn >> 20;
-        uint32_t shamt = imm & 0x1f;
-        switch (funct3) {
-        case 0x0: /* addiw */
-            cpu->regs[rd] = (int32_t) (cpu->regs[rs1] + imm);
-            break;
-        case 0x1: /* slliw */
-            cpu->regs[rd] = (int32_t) (cpu->regs[rs1] << shamt);
-            break;
-        case 0x5: {
-            switch (funct7) {
-            case 0x00: /* srliw */
-                cpu->regs[rd] = (int32_t) ((uint32_t) cpu->regs[rs1] >> shamt);
-                break;
-            case 0x20: /* sraiw */
-                cpu->regs[rd] = (int32_t) (cpu->regs[rs1]) >> shamt;
-                break;
-            default:
-                return ILLEGAL_INSTRUCTION;
-            }
-            break;
-        }
-        default:
-            return ILLEGAL_INSTRUCTION;
+    case 0x1b:
+        insn->imm = (int32_t) raw >> 20;
+        if (funct3 == 0x0) {
+            insn->op = OP_addiw;
+        } else if (funct3 == 0x1) {
+            insn->op = OP_slliw, insn->imm &= 0x1f;
+        } else if (funct3 == 0x5) {
+            if (funct7 == 0x00)
+                insn->op = OP_srliw;
+            else if (funct7 == 0x20)
+                insn->op = OP_sraiw;
+            insn->imm &= 0x1f;
         }
         break;
-    }
     case 0x23: {
-        uint64_t imm = (uint64_t) ((int32_t) (insn & 0xfe000000) >> 20) |
-                       ((insn >> 7) & 0x1f);
-        uint64_t addr = cpu->regs[rs1] + imm;
-        switch (funct3) {
-        case 0x0: /* sb */
-            if ((e = cpu_store(cpu, addr, 8, cpu->regs[rs2])) != OK)
-                return e;
-            break;
-        case 0x1: /* sh */
-            if ((e = cpu_store(cpu, addr, 16, cpu->regs[rs2])) != OK)
-                return e;
-            break;
-        case 0x2: /* sw */
-            if ((e = cpu_store(cpu, addr, 32, cpu->regs[rs2])) != OK)
-                return e;
-            break;
-        case 0x3: /* sd */
-            if ((e = cpu_store(cpu, addr, 64, cpu->regs[rs2])) != OK)
-                return e;
-            break;
-        default:
-            return ILLEGAL_INSTRUCTION;
-        }
+        static const uint8_t stores[8] = {OP_sb, OP_sh, OP_sw, OP_sd};
+        insn->imm = (uint64_t) ((int32_t) (raw & 0xfe000000) >> 20) |
+                    ((raw >> 7) & 0x1f);
+        insn->op = stores[funct3];
         break;
     }
+    case 0x27:
+        insn->imm = (uint64_t) ((int32_t) (raw & 0xfe000000) >> 20) |
+                    ((raw >> 7) & 0x1f);
+        if (funct3 == 0x2)
+            insn->op = OP_fsw;
+        else if (funct3 == 0x3)
+            insn->op = OP_fsd;
+        break;
     case 0x2f: {
-        uint64_t funct5 = (funct7 & 0x7c) >> 2;
-        if (funct3 == 0x2 && funct5 == 0x00) { /* amoadd.w */
-            if (!IS_ALIGNED(cpu->regs[rs1], 4))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK)
-                return e;
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 32, t + cpu->regs[rs2])) !=
-                OK)
-                return e;
-            cpu->regs[rd] = (int32_t) t;
-        } else if (funct3 == 0x2 && funct5 == 0x01) { /* amoswap.w */
-            if (!IS_ALIGNED(cpu->regs[rs1], 4))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK)
-                return e;
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 32, cpu->regs[rs2])) != OK)
-                return e;
-            cpu->regs[rd] = (int32_t) t;
-        } else if (funct3 == 0x2 && funct5 == 0x04) { /* amoxor.w */
-            if (!IS_ALIGNED(cpu->regs[rs1], 4))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK)
-                return e;
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 32, t ^ cpu->regs[rs2])) !=
-                OK)
-                return e;
-            cpu->regs[rd] = (int32_t) t;
-        } else if (funct3 == 0x2 && funct5 == 0x08) { /* amoor.w */
-            if (!IS_ALIGNED(cpu->regs[rs1], 4))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK)
-                return e;
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 32, t | cpu->regs[rs2])) !=
-                OK)
-                return e;
-            cpu->regs[rd] = (int32_t) t;
-        } else if (funct3 == 0x2 && funct5 == 0x0c) { /* amoand.w */
-            if (!IS_ALIGNED(cpu->regs[rs1], 4))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK)
-                return e;
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 32, t & cpu->regs[rs2])) !=
-                OK)
-                return e;
-            cpu->regs[rd] = (int32_t) t;
-        } else if (funct3 == 0x2 && funct5 == 0x10) { /* amomin.w */
-            if (!IS_ALIGNED(cpu->regs[rs1], 4))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK)
-                return e;
-            int32_t min = MIN((int32_t) t, (int32_t) cpu->regs[rs2]);
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 32, min)) != OK)
-                return e;
-            cpu->regs[rd] = (int32_t) t;
-        } else if (funct3 == 0x2 && funct5 == 0x14) { /* amomax.w */
-            if (!IS_ALIGNED(cpu->regs[rs1], 4))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK)
-                return e;
-            int32_t max = MAX((int32_t) t, (int32_t) cpu->regs[rs2]);
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 32, max)) != OK)
-                return e;
-            cpu->regs[rd] = (int32_t) t;
-        } else if (funct3 == 0x2 && funct5 == 0x18) { /* amominu.w */
-            if (!IS_ALIGNED(cpu->regs[rs1], 4))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK)
-                return e;
-            uint32_t min = MIN((uint32_t) t, (uint32_t) cpu->regs[rs2]);
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 32, min)) != OK)
-                return e;
-            cpu->regs[rd] = (int32_t) t;
-        } else if (funct3 == 0x2 && funct5 == 0x1c) { /* amomaxu.w */
-            if (!IS_ALIGNED(cpu->regs[rs1], 4))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 32, &t)) != OK)
-                return e;
-            uint32_t max = MAX((uint32_t) t, (uint32_t) cpu->regs[rs2]);
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 32, max)) != OK)
-                return e;
-            cpu->regs[rd] = (int32_t) t;
-        } else if (funct3 == 0x3 && funct5 == 0x00) { /* amoadd.d */
-            if (!IS_ALIGNED(cpu->regs[rs1], 8))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK)
-                return e;
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 64, t + cpu->regs[rs2])) !=
-                OK)
-                return e;
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x3 && funct5 == 0x01) { /* amoswap.d */
-            if (!IS_ALIGNED(cpu->regs[rs1], 8))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK)
-                return e;
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 64, cpu->regs[rs2])) != OK)
-                return e;
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x3 && funct5 == 0x04) { /* amoxor.d */
-            if (!IS_ALIGNED(cpu->regs[rs1], 8))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK)
-                return e;
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 64, t ^ cpu->regs[rs2])) !=
-                OK)
-                return e;
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x3 && funct5 == 0x08) { /* amoor.d */
-            if (!IS_ALIGNED(cpu->regs[rs1], 8))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK)
-                return e;
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 64, t | cpu->regs[rs2])) !=
-                OK)
-                return e;
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x3 && funct5 == 0x0c) { /* amoand.d */
-            if (!IS_ALIGNED(cpu->regs[rs1], 8))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK)
-                return e;
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 64, t & cpu->regs[rs2])) !=
-                OK)
-                return e;
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x3 && funct5 == 0x10) { /* amomin.d */
-            if (!IS_ALIGNED(cpu->regs[rs1], 8))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK)
-                return e;
-            int64_t min = MIN((int64_t) t, (int64_t) cpu->regs[rs2]);
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 64, min)) != OK)
-                return e;
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x3 && funct5 == 0x14) { /* amomax.d */
-            if (!IS_ALIGNED(cpu->regs[rs1], 8))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK)
-                return e;
-            int64_t max = MAX((int64_t) t, (int64_t) cpu->regs[rs2]);
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 64, max)) != OK)
-                return e;
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x3 && funct5 == 0x18) { /* amominu.d */
-            if (!IS_ALIGNED(cpu->regs[rs1], 8))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t, min;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK)
-                return e;
-            min = MIN((uint64_t) t, (uint64_t) cpu->regs[rs2]);
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 64, min)) != OK)
-                return e;
-            cpu->regs[rd] = t;
-        } else if (funct3 == 0x3 && funct5 == 0x1c) { /* amomaxu.d */
-            if (!IS_ALIGNED(cpu->regs[rs1], 8))
-                return LOAD_ADDRESS_MISALIGNED;
-            uint64_t t, max;
-            if ((e = cpu_load(cpu, cpu->regs[rs1], 64, &t)) != OK)
-                return e;
-            max = MAX((uint64_t) t, (uint64_t) cpu->regs[rs2]);
-            if ((e = cpu_store(cpu, cpu->regs[rs1], 64, max)) != OK)
-                return e;
-            cpu->regs[rd] = t;
-        } else {
-            return ILLEGAL_INSTRUCTION;
-        }
+        static const uint8_t amo_w[32] = {
+            [0x00] = OP_amoadd_w,  [0x01] = OP_amoswap_w,
+            [0x02] = OP_lr_w,      [0x03] = OP_sc_w,
+            [0x04] = OP_amoxor_w,  [0x08] = OP_amoor_w,
+            [0x0c] = OP_amoand_w,  [0x10] = OP_amomin_w,
+            [0x14] = OP_amomax_w,  [0x18] = OP_amominu_w,
+            [0x1c] = OP_amomaxu_w,
+        };
+        static const uint8_t amo_d[32] = {
+            [0x00] = OP_amoadd_d,  [0x01] = OP_amoswap_d,
+            [0x02] = OP_lr_d,      [0x03] = OP_sc_d,
+            [0x04] = OP_amoxor_d,  [0x08] = OP_amoor_d,
+            [0x0c] = OP_amoand_d,  [0x10] = OP_amomin_d,
+            [0x14] = OP_amomax_d,  [0x18] = OP_amominu_d,
+            [0x1c] = OP_amomaxu_d,
+        };
+        uint32_t funct5 = (funct7 & 0x7c) >> 2;
+        if (funct3 == 0x2)
+            insn->op = amo_w[funct5];
+        else if (funct3 == 0x3)
+            insn->op = amo_d[funct5];
         break;
     }
     case 0x33: {
-        uint32_t shamt = cpu->regs[rs2] & 0x3f;
-        if (funct3 == 0x0 && funct7 == 0x00) { /* add */
-            cpu->regs[rd] = cpu->regs[rs1] + cpu->regs[rs2];
-        } else if (funct3 == 0x0 && funct7 == 0x01) { /* mul */
-            cpu->regs[rd] = cpu->regs[rs1] * cpu->regs[rs2];
-        } else if (funct3 == 0x0 && funct7 == 0x20) { /* sub */
-            cpu->regs[rd] = cpu->regs[rs1] - cpu->regs[rs2];
-        } else if (funct3 == 0x1 && funct7 == 0x00) { /* sll */
-            cpu->regs[rd] = cpu->regs[rs1] << shamt;
-        } else if (funct3 == 0x1 && funct7 == 0x01) { /* mulh */
-#if defined(__SIZEOF_INT128__) && __SIZEOF_INT128__
-            cpu->regs[rd] = ((__int128) (int64_t) cpu->regs[rs1] *
-                             (__int128) (int64_t) cpu->regs[rs2]) >>
-                            64;
-#else
-            cpu->regs[rd] =
-                mulh((int64_t) cpu->regs[rs1], (int64_t) cpu->regs[rs2]);
-#endif
-        } else if (funct3 == 0x2 && funct7 == 0x00) { /* slt */
-            cpu->regs[rd] =
-                !!((int64_t) cpu->regs[rs1] < (int64_t) cpu->regs[rs2]);
-        } else if (funct3 == 0x2 && funct7 == 0x01) { /* mulhsu */
-#if defined(__SIZEOF_INT128__) && __SIZEOF_INT128__
-            cpu->regs[rd] = ((__int128) (int64_t) cpu->regs[rs1] *
-                             (unsigned __int128) cpu->regs[rs2]) >>
-                            64;
-#else
-            cpu->regs[rd] =
-                mulhsu((int64_t) cpu->regs[rs1], (uint64_t) cpu->regs[rs2]);
-#endif
-        } else if (funct3 == 0x3 && funct7 == 0x00) { /* sltu */
-            cpu->regs[rd] = !!(cpu->regs[rs1] < cpu->regs[rs2]);
-        } else if (funct3 == 0x3 && funct7 == 0x01) { /* mulhu */
-#if defined(__SIZEOF_INT128__) && __SIZEOF_INT128__
-            cpu->regs[rd] = ((unsigned __int128) cpu->regs[rs1] *
-                             (unsigned __int128) cpu->regs[rs2]) >>
-                            64;
-#else
-            cpu->regs[rd] =
-                mulhu((uint64_t) cpu->regs[rs1], (uint64_t) cpu->regs[rs2]);
-
-#endif
-        } else if (funct3 == 0x4 && funct7 == 0x00) { /* xor */
-            cpu->regs[rd] = cpu->regs[rs1] ^ cpu->regs[rs2];
-        } else if (funct3 == 0x4 && funct7 == 0x01) { /* div */
-            int64_t dividend = (int64_t) cpu->regs[rs1];
-            int64_t divisor = (int64_t) cpu->regs[rs2];
-            if (divisor == 0) {
-                cpu->regs[rd] = -1;
-            } else if (dividend == INT64_MIN && divisor == -1) { /* overflow */
-                cpu->regs[rd] = INT64_MIN;
-            } else {
-                cpu->regs[rd] = dividend / divisor;
-            }
-        } else if (funct3 == 0x5 && funct7 == 0x00) { /* srl */
-            cpu->regs[rd] = cpu->regs[rs1] >> shamt;
-        } else if (funct3 == 0x5 && funct7 == 0x01) { /* divu */
-            cpu->regs[rd] = (cpu->regs[rs2] == 0)
-                                ? UINT64_MAX
-                                : (cpu->regs[rs1] / cpu->regs[rs2]);
-        } else if (funct3 == 0x5 && funct7 == 0x20) { /* sra */
-            cpu->regs[rd] = (int64_t) cpu->regs[rs1] >> shamt;
-        } else if (funct3 == 0x6 && funct7 == 0x01) { /* rem */
-            if (cpu->regs[rs2] == 0) {
-                cpu->regs[rd] = cpu->regs[rs1];
-            } else if ((int64_t) cpu->regs[rs1] == INT64_MIN &&
-                       (int64_t) cpu->regs[rs2] == -1) { /* overflow */
-                cpu->regs[rd] = 0;
-            } else {
-                cpu->regs[rd] =
-                    (int64_t) cpu->regs[rs1] % (int64_t) cpu->regs[rs2];
-            }
-        } else if (funct3 == 0x6 && funct7 == 0x00) { /* or */
-            cpu->regs[rd] = cpu->regs[rs1] | cpu->regs[rs2];
-        } else if (funct3 == 0x7 && funct7 == 0x00) { /* and */
-            cpu->regs[rd] = cpu->regs[rs1] & cpu->regs[rs2];
-        } else if (funct3 == 0x7 && funct7 == 0x01) { /* remu */
-            cpu->regs[rd] = (cpu->regs[rs2] == 0)
-                                ? cpu->regs[rs1]
-                                : (cpu->regs[rs1] % cpu->regs[rs2]);
-        } else {
-            return ILLEGAL_INSTRUCTION;
-        }
+        static const uint8_t base[8] = {
+            OP_add, OP_sll, OP_slt, OP_sltu, OP_xor, OP_srl, OP_or, OP_and,
+        };
+        static const uint8_t muldiv[8] = {
+            OP_mul, OP_mulh, OP_mulhsu, OP_mulhu,
+            OP_div, OP_divu, OP_rem,    OP_remu,
+        };
+        if (funct7 == 0x00)
+            insn->op = base[funct3];
+        else if (funct7 == 0x01)
+            insn->op = muldiv[funct3];
+        else if (funct7 == 0x20 && funct3 == 0x0)
+            insn->op = OP_sub;
+        else if (funct7 == 0x20 && funct3 == 0x5)
+            insn->op = OP_sra;
         break;
     }
-    case 0x37: /* lui */
-        cpu->regs[rd] = (int32_t) (insn & 0xfffff000);
+    case 0x37:
+        insn->imm = (int32_t) (raw & 0xfffff000);
+        insn->op = OP_lui;
         break;
     case 0x3b: {
-        uint32_t shamt = cpu->regs[rs2] & 0x1f;
-        if (funct3 == 0x0 && funct7 == 0x00) { /* addw */
-            cpu->regs[rd] = (int32_t) (cpu->regs[rs1] + cpu->regs[rs2]);
-        } else if (funct3 == 0x0 && funct7 == 0x01) { /* mulw */
-            cpu->regs[rd] = (int32_t) cpu->regs[rs1] * (int32_t) cpu->regs[rs2];
-        } else if (funct3 == 0x0 && funct7 == 0x20) { /* subw */
-            cpu->regs[rd] = (int32_t) (cpu->regs[rs1] - cpu->regs[rs2]);
-        } else if (funct3 == 0x1 && funct7 == 0x00) { /* sllw */
-            cpu->regs[rd] = (int32_t) ((uint32_t) cpu->regs[rs1] << shamt);
-        } else if (funct3 == 0x4 && funct7 == 0x01) { /* divw */
-            if (cpu->regs[rs2] == 0) {
-                cpu->regs[rd] = -1;
-            } else if ((int32_t) cpu->regs[rs1] == INT32_MIN &&
-                       (int32_t) cpu->regs[rs2] == -1) { /* overflow */
-                cpu->regs[rd] = INT32_MIN;
-            } else {
-                cpu->regs[rd] =
-                    (int32_t) cpu->regs[rs1] / (int32_t) cpu->regs[rs2];
-            }
-        } else if (funct3 == 0x5 && funct7 == 0x00) { /* srlw */
-            cpu->regs[rd] = (int32_t) ((uint32_t) cpu->regs[rs1] >> shamt);
-        } else if (funct3 == 0x5 && funct7 == 0x01) { /* divuw */
-            cpu->regs[rd] = (cpu->regs[rs2] == 0)
-                                ? UINT64_MAX
-                                : (int32_t) ((uint32_t) cpu->regs[rs1] /
-                                             (uint32_t) cpu->regs[rs2]);
-        } else if (funct3 == 0x5 && funct7 == 0x20) { /* sraw */
-            cpu->regs[rd] = (int32_t) cpu->regs[rs1] >> (int32_t) shamt;
-        } else if (funct3 == 0x6 && funct7 == 0x01) { /* remw */
-            if (cpu->regs[rs2] == 0) {
-                cpu->regs[rd] = cpu->regs[rs1];
-            } else if ((int32_t) cpu->regs[rs1] == INT32_MIN &&
-                       (int32_t) cpu->regs[rs2] == -1) { /* overflow */
-                cpu->regs[rd] = 0;
-            } else {
-                cpu->regs[rd] =
-                    (int32_t) cpu->regs[rs1] % (int32_t) cpu->regs[rs2];
-            }
-        } else if (funct3 == 0x7 && funct7 == 0x01) { /* remuw */
-            cpu->regs[rd] = (cpu->regs[rs2] == 0)
-                                ? cpu->regs[rs1]
-                                : (int32_t) ((uint32_t) cpu->regs[rs1] %
-                                             (uint32_t) cpu->regs[rs2]);
-        } else {
-            return ILLEGAL_INSTRUCTION;
-        }
+        static const uint8_t base[8] = {
+            [0x0] = OP_addw, [0x1] = OP_sllw, [0x5] = OP_srlw,
+        };
+        static const uint8_t muldiv[8] = {
+            [0x0] = OP_mulw, [0x4] = OP_divw, [0x5] = OP_divuw,
+            [0x6] = OP_remw, [0x7] = OP_remuw,
+        };
+        if (funct7 == 0x00)
+            insn->op = base[funct3];
+        else if (funct7 == 0x01)
+            insn->op = muldiv[funct3];
+        else if (funct7 == 0x20 && funct3 == 0x0)
+            insn->op = OP_subw;
+        else if (funct7 == 0x20 && funct3 == 0x5)
+            insn->op = OP_sraw;
+        break;
+    }
+    case 0x43: /* fmadd, fmsub, fnmsub and fnmadd; rs3 goes above rm */
+    case 0x47:
+    case 0x4b:
+    case 0x4f: {
+        static const uint8_t fma[4][2] = {
+            {OP_fmadd_s, OP_fmadd_d},
+            {OP_fmsub_s, OP_fmsub_d},
+            {OP_fnmsub_s, OP_fnmsub_d},
+            {OP_fnmadd_s, OP_fnmadd_d},
+        };
+        insn->imm = funct3 | (raw >> 27) << 3;
+        if ((funct7 & 0x3) < 2)
+            insn->op = fma[(opcode >> 2) & 0x3][funct7 & 0x1];
         break;
     }
+    case 0x53:
+        insn->imm = funct3;
+        insn->op = cpu_decode_fp(funct7, funct3, insn->rs2);
+        break;
     case 0x63: {
-        uint64_t imm = (uint64_t) ((int32_t) (insn & 0x80000000) >> 19) |
-                       ((insn & 0x80) << 4) | ((insn >> 20) & 0x7e0) |
-                       ((insn >> 7) & 0x1e);
-
-        switch (funct3) {
-        case 0x0: /* beq */
-            if (cpu->regs[rs1] == cpu->regs[rs2])
-                cpu->pc += imm - 4;
-            break;
-        case 0x1: /* bne */
-            if (cpu->regs[rs1] != cpu->regs[rs2])
-                cpu->pc += imm - 4;
-            break;
-        case 0x4: /* blt */
-            if ((int64_t) cpu->regs[rs1] < (int64_t) cpu->regs[rs2])
-                cpu->pc += imm - 4;
-            break;
-        case 0x5: /* bge */
-            if ((int64_t) cpu->regs[rs1] >= (int64_t) cpu->regs[rs2])
-                cpu->pc += imm - 4;
-            break;
-        case 0x6: /* bltu */
-            if (cpu->regs[rs1] < cpu->regs[rs2])
-                cpu->pc += imm - 4;
-            break;
-        case 0x7: /* bgeu */
-            if (cpu->regs[rs1] >= cpu->regs[rs2])
-                cpu->pc += imm - 4;
-            break;
-        default:
-            return ILLEGAL_INSTRUCTION;
-        }
+        static const uint8_t branches[8] = {
+            [0x0] = OP_beq, [0x1] = OP_bne,  [0x4] = OP_blt,
+            [0x5] = OP_bge, [0x6] = OP_bltu, [0x7] = OP_bgeu,
+        };
+        insn->imm = (uint64_t) ((int32_t) (raw & 0x80000000) >> 19) |
+                    ((raw & 0x80) << 4) | ((raw >> 20) & 0x7e0) |
+                    ((raw >> 7) & 0x1e);
+        insn->op = branches[funct3];
+        ends_block = true;
         break;
     }
-    case 0x67: { /* jalr */
-        uint64_t t = cpu->pc;
-        uint64_t imm = (int32_t) (insn & 0xfff00000) >> 20;
-        cpu->pc = (cpu->regs[rs1] + imm) & ~1;
-
-        cpu->regs[rd] = t;
+    case 0x67:
+        insn->imm = (int32_t) (raw & 0xfff00000) >> 20;
+        insn->op = OP_jalr;
+        ends_block = true;
         break;
+    case 0x6f:
+        insn->imm = (uint64_t) ((int32_t) (raw & 0x80000000) >> 11) |
+                    (raw & 0xff000) | ((raw >> 9) & 0x800) |
+                    ((raw >> 20) & 0x7fe);
+        insn->op = OP_jal;
+        ends_block = true;
+        break;
+    case 0x73: {
+        static const uint8_t csrs[8] = {
+            [0x1] = OP_csrrw,  [0x2] = OP_csrrs,  [0x3] = OP_csrrc,
+            [0x5] = OP_csrrwi, [0x6] = OP_csrrsi, [0x7] = OP_csrrci,
+        };
+        insn->imm = (raw & 0xfff00000) >> 20;
+        if (funct3 != 0x0)
+            insn->op = csrs[funct3];
+        else if (insn->rs2 == 0x0 && funct7 == 0x0)
+            insn->op = OP_ecall;
+        else if (insn->rs2 == 0x1 && funct7 == 0x0)
+            insn->op = OP_ebreak;
+        else if (insn->rs2 == 0x2 && funct7 == 0x8)
+            insn->op = OP_sret;
+        else if (insn->rs2 == 0x2 && funct7 == 0x18)
+            insn->op = OP_mret;
+        else if (insn->rs2 == 0x5 && funct7 == 0x8)
+            insn->op = OP_wfi;
+        else if (funct7 == 0x9)
+            insn->op = OP_sfence_vma;
+        ends_block = true;
+        break;
+    }
     }
-    case 0x6f: { /* jal */
-        cpu->regs[rd] = cpu->pc;
 
-        uint64_t imm = (uint64_t) ((int32_t) (insn & 0x80000000) >> 11) |
-                       (insn & 0xff000) | ((insn >> 9) & 0x800) |
-                       ((insn >> 20) & 0x7fe);
+    insn->handler = insn_handlers[insn->op];
+    return ends_block || insn->op == OP_illegal;
+}
 
-        cpu->pc += imm - 4;
-        break;
+exception_t cpu_execute(struct cpu *cpu, const uint64_t raw)
+{
+    struct insn insn;
+    cpu_decode(raw, &insn);
+
+    cpu->regs[0] = 0; /* x0 register is always zero */
+    cpu->pc += insn.len;
+    exception_t e = insn.handler(cpu, &insn);
+    if (e != OK)
+        cpu->pc -= insn.len;
+    return e;
+}
+
+void cpu_flush_bcache(struct cpu *cpu)
+{
+    for (int i = 0; i < BCACHE_SIZE; i++)
+        cpu->bcache->blocks[i].pa = BLOCK_INVALID;
+}
+
+/* Find the decoded block starting at physical address pa, decoding it if it
+ * is not cached yet. pa must point into RAM.
+ */
+static struct block *cpu_lookup_block(struct cpu *cpu, const uint64_t pa)
+{
+    struct ram *ram = cpu->bus->ram;
+    uint32_t *gen = &ram->page_gen[(pa - RAM_BASE) / PAGE_SIZE];
+    struct block *block = &cpu->bcache->blocks[(pa / 2) % BCACHE_SIZE];
+
+    if (block->pa == pa && block->gen == *gen) {
+        cpu->bcache->hits++;
+        return block;
     }
-    case 0x73: {
-        uint16_t addr = (insn & 0xfff00000) >> 20;
-        switch (funct3) {
-        case 0x0:
-            if (rs2 == 0x0 && funct7 == 0x0) { /* ecall */
-                switch (cpu->mode) {
-                case USER:
-                case SUPERVISOR:
-                case MACHINE:
-                    return 8 + cpu->mode; /* ECALL_FROM_{U,S,M}MODE */
-                }
-            } else if (rs2 == 0x1 && funct7 == 0x0) { /* ebreak */
-                return BREAKPOINT;
-            } else if (rs2 == 0x2 && funct7 == 0x8) { /* sret */
-                cpu->pc = cpu_load_csr(cpu, SEPC);
-                cpu->mode =
-                    ((cpu_load_csr(cpu, SSTATUS) >> 8) & 1) ? SUPERVISOR : USER;
-                cpu_store_csr(cpu, SSTATUS,
-                              ((cpu_load_csr(cpu, SSTATUS) >> 5) & 1)
-                                  ? cpu_load_csr(cpu, SSTATUS) | (1 << 1)
-                                  : cpu_load_csr(cpu, SSTATUS) & ~(1 << 1));
-                cpu_store_csr(cpu, SSTATUS,
-                              cpu_load_csr(cpu, SSTATUS) | (1 << 5));
-                cpu_store_csr(cpu, SSTATUS,
-                              cpu_load_csr(cpu, SSTATUS) & ~(1 << 8));
-            } else if (rs2 == 0x2 && funct7 == 0x18) { /* mret */
-                cpu->pc = cpu_load_csr(cpu, MEPC);
-                uint64_t mpp = (cpu_load_csr(cpu, MSTATUS) >> 11) & 3;
-                cpu->mode = mpp == 2 ? MACHINE : (mpp == 1 ? SUPERVISOR : USER);
-                cpu_store_csr(cpu, MSTATUS,
-                              ((cpu_load_csr(cpu, MSTATUS) >> 7) & 1)
-                                  ? cpu_load_csr(cpu, MSTATUS) | (1 << 3)
-                                  : cpu_load_csr(cpu, MSTATUS) & ~(1 << 3));
-                cpu_store_csr(cpu, MSTATUS,
-                              cpu_load_csr(cpu, MSTATUS) | (1 << 7));
-                cpu_store_csr(cpu, MSTATUS,
-                              cpu_load_csr(cpu, MSTATUS) & ~(3 << 11));
-            } else if (funct7 == 0x9) { /* sfence.vma */
-                /* TODO: implemented */
-            } else {
-                return ILLEGAL_INSTRUCTION;
-            }
-            break;
-        case 0x1: { /* csrrw */
-            uint64_t t = cpu_load_csr(cpu, addr);
-            cpu_store_csr(cpu, addr, cpu->regs[rs1]);
-            cpu->regs[rd] = t;
-            cpu_update_paging(cpu, addr);
-            break;
-        }
-        case 0x2: { /* csrrs */
-            uint64_t t = cpu_load_csr(cpu, addr);
-            cpu_store_csr(cpu, addr, t | cpu->regs[rs1]);
-            cpu->regs[rd] = t;
-            cpu_update_paging(cpu, addr);
-            break;
-        }
-        case 0x3: { /* csrrc */
-            uint64_t t = cpu_load_csr(cpu, addr);
-            cpu_store_csr(cpu, addr, t & ~cpu->regs[rs1]);
-            cpu->regs[rd] = t;
-            cpu_update_paging(cpu, addr);
-            break;
-        }
-        case 0x5: /* csrrwi */
-            cpu->regs[rd] = cpu_load_csr(cpu, addr);
-            cpu_store_csr(cpu, addr, rs1);
-            cpu_update_paging(cpu, addr);
-            break;
-        case 0x6: { /* csrrsi */
-            uint64_t t = cpu_load_csr(cpu, addr);
-            cpu_store_csr(cpu, addr, t | rs1);
-            cpu->regs[rd] = t;
-            cpu_update_paging(cpu, addr);
-            break;
+    cpu->bcache->misses++;
+
+    /* Mark the page as holding decoded code, so that the next store to it
+     * bumps the generation and invalidates every block decoded from it.
+     */
+    if (!(*gen & 1))
+        (*gen)++;
+
+    block->pa = pa;
+    block->gen = *gen;
+    block->len = 0;
+#if defined(INTERP_THREADED)
+    block->threaded = false;
+#endif
+#if defined(JIT)
+    block->heat = 0;
+    block->code = NULL;
+#endif
+
+    /* A block never crosses a page boundary, since the next virtual page
+     * may map to a different physical page. An instruction that does ends
+     * the block before it, to be run on its own.
+     */
+    uint64_t end = (pa & ~(uint64_t) (PAGE_SIZE - 1)) + PAGE_SIZE;
+    for (uint64_t a = pa; a < end && block->len < BLOCK_MAX_INSNS;) {
+        uint64_t raw, hi = 0;
+        ram_load(ram, a, 16, &raw);
+        if ((raw & 0x3) == 0x3) {
+            if (a + 2 == end)
+                break;
+            ram_load(ram, a + 2, 16, &hi);
         }
-        case 0x7: { /* csrrci */
-            uint64_t t = cpu_load_csr(cpu, addr);
-            cpu_store_csr(cpu, addr, t & ~rs1);
-            cpu->regs[rd] = t;
-            cpu_update_paging(cpu, addr);
+        struct insn *insn = &block->insns[block->len++];
+        bool ends_block = cpu_decode(raw | hi << 16, insn);
+        a += insn->len;
+        if (ends_block)
             break;
+    }
+    return block;
+}
+
+/* Find the block at the current PC. Returns NULL if there is none to run:
+ * either the fetch failed, or the code is outside RAM and has been run one
+ * instruction at a time. *e then holds the outcome of that one instruction.
+ */
+static struct block *cpu_enter_block(struct cpu *cpu, exception_t *e)
+{
+    uint64_t ppc, raw;
+    if ((*e = cpu_translate(cpu, cpu->pc, INSTRUCTION_PAGE_FAULT, &ppc)) !=
+        OK)
+        return NULL;
+
+    /* Code outside RAM is not cached, and neither is an instruction that
+     * crosses into the next page.
+     */
+    bool uncached = ppc < RAM_BASE || ppc - RAM_BASE >= cpu->bus->ram->size;
+    if (!uncached && ppc % PAGE_SIZE == PAGE_SIZE - 2) {
+        ram_load(cpu->bus->ram, ppc, 16, &raw);
+        uncached = (raw & 0x3) == 0x3;
+    }
+    if (uncached) {
+        if ((*e = cpu_fetch(cpu, &raw)) == OK)
+            *e = cpu_execute(cpu, raw);
+        return NULL;
+    }
+
+    return cpu_lookup_block(cpu, ppc);
+}
+
+#if !defined(INTERP_THREADED)
+
+/* Call-threaded core: every decoded instruction is run through its handler
+ * pointer. cpu_run_block() runs at most budget instructions of block, from
+ * insns[start] on, and returns how many retired, counting one that raised *e.
+ */
+static int cpu_run_insns(struct cpu *cpu,
+                         struct block *block,
+                         const int start,
+                         const int budget,
+                         exception_t *e)
+{
+    *e = OK;
+    int n = MIN((int) block->len - start, budget);
+    for (int i = 0; i < n; i++) {
+        const struct insn *insn = &block->insns[start + i];
+        cpu->regs[0] = 0; /* x0 register is always zero */
+        cpu->pc += insn->len;
+        if ((*e = insn->handler(cpu, insn)) != OK) {
+            cpu->pc -= insn->len;
+            return i + 1;
         }
-        default:
-            return ILLEGAL_INSTRUCTION;
-        }
-        break;
     }
-    default:
-        return ILLEGAL_INSTRUCTION;
+    return n;
+}
+
+#else
+
+/* Direct-threaded core: every decoded instruction carries the address of the
+ * code implementing it, and that code jumps straight to the next one's. The
+ * handlers are called directly, so the compiler inlines them into each case.
+ * Compilers without labels-as-values dispatch through a switch instead.
+ */
+#if defined(__GNUC__)
+#define CASE(name) L_##name:
+#define DISPATCH() goto *insn->label
+#else
+#define CASE(name) case OP_##name:
+#define DISPATCH() goto dispatch
+#endif
+
+static int cpu_run_insns(struct cpu *cpu,
+                         struct block *block,
+                         const int start,
+                         const int budget,
+                         exception_t *e)
+{
+#if defined(__GNUC__)
+#define INSN_LABEL(name) &&L_##name,
+    static const void *const labels[N_OPS] = {INSN_LIST(INSN_LABEL)};
+#undef INSN_LABEL
+
+    if (!block->threaded) {
+        for (uint32_t i = 0; i < block->len; i++)
+            block->insns[i].label = labels[block->insns[i].op];
+        block->threaded = true;
     }
+#endif
 
-    return OK;
+    const struct insn *const first = block->insns + start;
+    const struct insn *insn = first;
+    const struct insn *end = insn + MIN((int) block->len - start, budget);
+
+#define NEXT()                                \
+    do {                                      \
+        if (++insn == end)                    \
+            goto done;                        \
+        cpu->regs[0] = 0;                     \
+        cpu->pc += insn->len;                 \
+        DISPATCH();                           \
+    } while (0)
+
+#define INSN_CASE(name)                                \
+    CASE(name)                                         \
+    if ((*e = insn_##name(cpu, insn)) != OK) {         \
+        cpu->pc -= insn->len;                          \
+        return insn - first + 1;                       \
+    }                                                  \
+    NEXT();
+
+    if (insn == end)
+        goto done;
+    cpu->regs[0] = 0; /* x0 register is always zero */
+    cpu->pc += insn->len;
+#if defined(__GNUC__)
+    DISPATCH();
+    INSN_LIST(INSN_CASE)
+#else
+dispatch:
+    switch (insn->op) {
+        INSN_LIST(INSN_CASE)
+    }
+#endif
+
+done:
+    *e = OK;
+    return insn - first;
+}
+
+#undef INSN_CASE
+#undef NEXT
+#undef DISPATCH
+#undef CASE
+
+#endif
+
+int cpu_run_block(struct cpu *cpu,
+                  struct block *block,
+                  const int start,
+                  const int budget,
+                  exception_t *e)
+{
+    int retired = cpu_run_insns(cpu, block, start, budget, e);
+#if defined(STATS)
+    for (int i = start; i < start + retired; i++)
+        cpu->stats->ops[block->insns[i].op]++;
+#endif
+    return retired;
+}
+
+int cpu_execute_block(struct cpu *cpu, const int budget, exception_t *e)
+{
+    if (cpu->wfi) {
+        *e = OK;
+        return 0;
+    }
+
+    struct block *block = cpu_enter_block(cpu, e);
+    if (!block)
+        return 1;
+
+    /* With a replay, the block stops where the scheduler is due, however
+     * blocks have been formed.
+     */
+    int retired, n = budget;
+    if (cpu->bus->sched->replay && cpu->sched_due > cpu->cycle &&
+        cpu->sched_due - cpu->cycle < (uint64_t) n)
+        n = cpu->sched_due - cpu->cycle;
+#if defined(JIT)
+    if (cpu->jit)
+        retired = jit_execute_block(cpu, block, n, e);
+    else
+#endif
+        retired = cpu_run_block(cpu, block, 0, n, e);
+
+    cpu->cycle += retired;
+    if (cpu->hartid == 0)
+        __atomic_store_n(&cpu->bus->sched->cycles, cpu->cycle,
+                         __ATOMIC_RELAXED);
+    return retired;
 }
 
 void cpu_take_trap(struct cpu *cpu, const exception_t e, const interrupt_t intr)
 {
-    uint64_t exception_pc = cpu->pc - 4;
+    bool is_interrupt = (intr != NONE);
     cpu_mode_t prev_mode = cpu->mode;
 
-    bool is_interrupt = (intr != NONE);
+    /* Exceptions are taken with the PC at the faulting instruction, whatever
+     * its length, and interrupts between two instructions, with the PC where
+     * execution has to resume.
+     */
+    uint64_t exception_pc = cpu->pc;
     uint64_t cause = e;
     if (is_interrupt)
         cause = ((uint64_t) 1 << 63) | (uint64_t) intr;
+#if defined(STATS)
+    if (is_interrupt)
+        cpu->stats->interrupts[intr % N_CAUSES]++;
+    else
+        cpu->stats->exceptions[e % N_CAUSES]++;
+#endif
 
     if (prev_mode <= SUPERVISOR &&
         (((cpu_load_csr(cpu, MEDELEG) >> (uint32_t) cause) & 1) != 0)) {
@@ -1402,28 +4363,116 @@ void cpu_take_trap(struct cpu *cpu, const exception_t e, const interrupt_t intr)
     }
 }
 
-enum { DISK_IRQ = 1, UART_IRQ = 10 };
+enum {
+    DISK_IRQ = 1,
+    KBD_IRQ = 2,
+    VIRTIO_IRQ = 3,
+    BLIT_IRQ = 4,
+    UART_IRQ = 10
+};
 
-interrupt_t cpu_check_pending_interrupt(struct cpu *cpu)
+/* A device interrupt goes to the first hart that polls with the interrupt
+ * enabled in its PLIC context. A lone hart takes it regardless.
+ */
+static inline bool plic_routes(const struct bus *bus,
+                               const int hart,
+                               const int irq)
+{
+    return bus->nharts == 1 || (bus->plic->senable[hart] >> irq) & 1;
+}
+
+static void sched_fire(struct bus *bus, const int id)
+{
+    if (id >= EVENT_TIMER)
+        __atomic_store_n(&bus->clint->mtip[id - EVENT_TIMER], true,
+                         __ATOMIC_RELAXED);
+    else if (id == EVENT_DISK)
+        disk_complete(bus->disk);
+    else if (id == EVENT_UART)
+        uart_receive(bus->uart);
+    else if (id == EVENT_INPUT)
+        bus_input(bus);
+}
+
+/* Run the events that are due. Until the next poll, the clock is assumed
+ * to advance by one tick per instruction.
+ */
+static void sched_poll(struct cpu *cpu)
+{
+    struct bus *bus = cpu->bus;
+    uint64_t now = sched_now(bus->sched);
+    if (now >= __atomic_load_n(&bus->sched->next, __ATOMIC_ACQUIRE)) {
+        bus_lock(bus);
+        int id;
+        bool fired = false;
+        while ((id = sched_pop(bus->sched, now)) >= 0)
+            sched_fire(bus, id), fired = true;
+        bus_unlock(bus);
+        if (fired)
+            sched_wake(bus->sched);
+    }
+
+    uint64_t next = __atomic_load_n(&bus->sched->next, __ATOMIC_ACQUIRE);
+    uint64_t wait = SCHED_MAX_POLL;
+    if (next <= now)
+        wait = 0;
+    else if (next - now < wait)
+        wait = next - now;
+    cpu->sched_due = cpu->cycle + wait;
+}
+
+static interrupt_t cpu_pending_interrupt(struct cpu *cpu)
 {
+    struct bus *bus = cpu->bus;
+    if (bus->nharts > 1) {
+        uint32_t epoch = __atomic_load_n(&bus->tlb_epoch, __ATOMIC_ACQUIRE);
+        if (epoch != cpu->tlb_epoch) {
+            cpu_flush_tlb(cpu);
+            cpu->tlb_epoch = epoch;
+        }
+    }
+    sched_poll(cpu);
+    clint_update(bus->clint, cpu->hartid, &cpu->csrs[MIP]);
+
     if (cpu->mode == MACHINE && ((cpu_load_csr(cpu, MSTATUS) >> 3) & 1) == 0)
         return NONE;
     if (cpu->mode == SUPERVISOR && ((cpu_load_csr(cpu, SSTATUS) >> 1) & 1) == 0)
         return NONE;
 
-    do {
-        uint64_t irq;
-        if (uart_is_interrupting(cpu->bus->uart)) {
+    bool uart = plic_routes(bus, cpu->hartid, UART_IRQ) &&
+                uart_may_interrupt(bus->uart);
+    bool disk = plic_routes(bus, cpu->hartid, DISK_IRQ) &&
+                disk_may_interrupt(bus->disk);
+    bool vblk = plic_routes(bus, cpu->hartid, VIRTIO_IRQ) &&
+                vblk_may_interrupt(bus->disk);
+    bool blit = plic_routes(bus, cpu->hartid, BLIT_IRQ) &&
+                blit_may_interrupt(bus->blit);
+    /* The keyboard interrupts for as long as keys are queued, so it is
+     * only raised on harts that enable it, so as not to flood guests that
+     * poll KBD_GET instead.
+     */
+    bool kbd = ((bus->plic->senable[cpu->hartid] >> KBD_IRQ) & 1) &&
+               key_pending(bus->kbd);
+    if (uart || disk || vblk || blit || kbd) {
+        uint64_t irq = 0;
+        bus_lock(bus);
+        if (uart && uart_is_interrupting(bus->uart))
             irq = UART_IRQ;
-        } else if (disk_is_interrupting(cpu->bus->disk)) {
-            bus_disk_access(cpu->bus);
+        else if (disk && disk_is_interrupting(bus->disk))
             irq = DISK_IRQ;
-        } else
-            break;
+        else if (vblk && vblk_is_interrupting(bus->disk))
+            irq = VIRTIO_IRQ;
+        else if (blit && blit_is_interrupting(bus->blit))
+            irq = BLIT_IRQ;
+        else if (kbd && key_pending(bus->kbd))
+            irq = KBD_IRQ;
+        if (irq)
+            bus->plic->sclaim[cpu->hartid] = irq;
+        bus_unlock(bus);
 
-        bus_store(cpu->bus, PLIC_SCLAIM, 32, irq);
-        cpu_store_csr(cpu, MIP, cpu_load_csr(cpu, MIP) | MIP_SEIP);
-    } while (0);
+        if (irq)
+            cpu_store_csr(cpu, MIP, cpu_load_csr(cpu, MIP) | MIP_SEIP);
+    }
 
     uint64_t pending = cpu_load_csr(cpu, MIE) & cpu_load_csr(cpu, MIP);
     if (pending & MIP_MEIP) {
@@ -1454,18 +4503,82 @@ interrupt_t cpu_check_pending_interrupt(struct cpu *cpu)
     return NONE;
 }
 
-size_t read_file(FILE *f, uint8_t *r[])
+/* A hart in wfi sleeps until an interrupt it enables may be pending: an
+ * event is due or set by another thread, or WFI_MAX_SLEEP_MS have passed.
+ * With the cycle clock, hart 0 skips straight to the next deadline instead,
+ * since guest time only passes as it runs. A pooled hart does not sleep, and
+ * leaves its caller to run something else meanwhile.
+ */
+static void cpu_wait(struct cpu *cpu)
 {
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    struct bus *bus = cpu->bus;
+    struct sched *sched = bus->sched;
+    uint32_t posts = __atomic_load_n(&sched->posts, __ATOMIC_ACQUIRE);
+
+    uint64_t mie = cpu_load_csr(cpu, MIE);
+    if ((mie & cpu_load_csr(cpu, MIP)) ||
+        ((mie & MIP_SEIP) &&
+         (uart_may_interrupt(bus->uart) || disk_may_interrupt(bus->disk) ||
+          vblk_may_interrupt(bus->disk) || blit_may_interrupt(bus->blit) ||
+          key_pending(bus->kbd)))) {
+        cpu->wfi = false;
+        return;
+    }
+
+    uint64_t next = __atomic_load_n(&sched->next, __ATOMIC_ACQUIRE);
+    uint64_t ns = WFI_MAX_SLEEP_MS * 1000000ULL;
+    if (sched->clock == SCHED_CLOCK_CYCLES) {
+        if (cpu->hartid == 0 && next != UINT64_MAX) {
+            if (next > cpu->cycle) {
+                cpu->cycle = next;
+                __atomic_store_n(&sched->cycles, next, __ATOMIC_RELAXED);
+            }
+            sched_poll(cpu);
+            return;
+        }
+    } else if (next != UINT64_MAX) {
+        uint64_t now = host_ticks();
+        if (next <= now) {
+            sched_poll(cpu);
+            return;
+        }
+        if ((next - now) < ns / (1000000000 / CPU_HZ))
+            ns = (next - now) * 1000000000 / CPU_HZ;
+    }
+    if (sched->pooled)
+        return;
 
-    uint8_t *content = malloc(fsize + 1);
-    if (fread(content, fsize, 1, f) != 1) /* less than fsize bytes */
-        fatal("read file content");
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec += ns % 1000000000;
+    if (ts.tv_nsec >= 1000000000L)
+        ts.tv_sec++, ts.tv_nsec -= 1000000000L;
+
+    pthread_mutex_lock(&sched->lock);
+    if (sched->posts == posts)
+        pthread_cond_timedwait(&sched->wake, &sched->lock, &ts);
+    pthread_mutex_unlock(&sched->lock);
+    sched_poll(cpu);
+}
 
-    content[fsize] = 0;
-    *r = content;
+interrupt_t cpu_check_pending_interrupt(struct cpu *cpu)
+{
+    if (!cpu->wfi && cpu->cycle < cpu->sched_due &&
+        !__atomic_load_n(cpu->pending, __ATOMIC_ACQUIRE))
+        return NONE;
 
-    return fsize;
+    /* A full barrier, so that a device setting the word again after this
+     * is seen by the check below or by the next one.
+     */
+    __atomic_exchange_n(cpu->pending, 0, __ATOMIC_SEQ_CST);
+    interrupt_t intr = cpu_pending_interrupt(cpu);
+    if (intr != NONE) {
+        /* Others may be pending as well. */
+        __atomic_store_n(cpu->pending, 1, __ATOMIC_RELAXED);
+        cpu->wfi = false;
+    } else if (cpu->wfi) {
+        cpu_wait(cpu);
+    }
+    return intr;
 }
@@ -5,22 +5,52 @@
 #define N_REG 32
 #define N_CSR 4096
 
-#define RAM_SIZE (1024 * 1024 * 8)
 #define RAM_BASE 0x80000000
+#define RAM_DEFAULT_SIZE (1024 * 1024 * 8)
+#define RAM_HUGE_PAGE_SIZE (1024 * 1024 * 2)
+
+#define PAGE_SIZE 4096 /* should be configurable */
 
 #define FRAMEBUFFER_BASE 0x80600000
+#define FRAMEBUFFER_WIDTH 640
+#define FRAMEBUFFER_HEIGHT 480
+#define FRAMEBUFFER_PITCH (FRAMEBUFFER_WIDTH * 4)
+
+/* The framebuffer lives in RAM, so RAM has to reach past it. */
+#define RAM_MIN_SIZE                                                    \
+    (FRAMEBUFFER_BASE - RAM_BASE + FRAMEBUFFER_PITCH * FRAMEBUFFER_HEIGHT)
+
+/* A store of SYSCON_PASS powers the machine off with exit code 0, and one
+ * of SYSCON_FAIL | code << 16 with the given exit code. SYSCON_SNAPSHOT
+ * asks for a snapshot at the end of the current block.
+ */
+#define SYSCON_BASE 0x100000
+#define SYSCON_SIZE 0x1000
+#define SYSCON_PASS 0x5555
+#define SYSCON_FAIL 0x3333
+#define SYSCON_SNAPSHOT 0x5353
+
+#define MAX_HARTS 8
+/* Initial stack of each hart, below the top of RAM. */
+#define HART_STACK_SIZE (64 * 1024)
 
+/* Statistics are printed as lines of text, or as one JSON object. */
+enum stats_format { STATS_TEXT, STATS_JSON };
+
+/* Per-hart registers are at the base address plus hart * stride. */
 #define CLINT_BASE 0x2000000
 #define CLINT_SIZE 0x10000
-#define CLINT_MTIMECMP (CLINT_BASE + 0x4000)
+#define CLINT_MSIP CLINT_BASE /* stride 4 */
+#define CLINT_MTIMECMP (CLINT_BASE + 0x4000) /* stride 8 */
 #define CLINT_MTIME (CLINT_BASE + 0xbff8)
 
+/* Only the supervisor context of each hart is modelled. */
 #define PLIC_BASE 0xC000000
 #define PLIC_SIZE 0x4000000
 #define PLIC_PENDING (PLIC_BASE + 0x1000)
-#define PLIC_SENABLE (PLIC_BASE + 0x2080)
-#define PLIC_SPRIORITY (PLIC_BASE + 0x201000)
-#define PLIC_SCLAIM (PLIC_BASE + 0x201004)
+#define PLIC_SENABLE (PLIC_BASE + 0x2080) /* stride 0x100 */
+#define PLIC_SPRIORITY (PLIC_BASE + 0x201000) /* stride 0x2000 */
+#define PLIC_SCLAIM (PLIC_BASE + 0x201004) /* stride 0x2000 */
 
 #define UART_BASE 0x10000000
 #define UART_SIZE 0x100
@@ -40,11 +70,82 @@ enum { UART_LSR_RX = 1, UART_LSR_TX = 1 << 5 };
 #define DISK_BUFFER_LEN_LOW (DISK_BASE + 0x01C)
 #define DISK_SECTOR (DISK_BASE + 0x020)
 #define DISK_DONE (DISK_BASE + 0x024)
+#define DISK_COMPLETED (DISK_BASE + 0x028)
+
+#define DISK_QUEUE_SIZE 64 /* requests in flight at once */
+/* With SCHED_CLOCK_CYCLES, requests complete this many cycles after they
+ * are submitted.
+ */
+#define DISK_LATENCY (CPU_HZ / 10000)
 
 #define KBD_BASE 0x10002000
 #define KBD_SIZE 0x100
 #define KBD_GET (KBD_BASE + 0x000)
 
+/* A 2D blitter on the framebuffer. Storing an operation to BLIT_OP runs it
+ * there and then on the BLIT_WIDTH x BLIT_HEIGHT rectangle at (BLIT_DST_X,
+ * BLIT_DST_Y), clipped to the screen, counts it in BLIT_DONE and raises the
+ * blitter interrupt. BLIT_FILL fills the rectangle with BLIT_FG; BLIT_COPY
+ * copies the one at (BLIT_SRC_X, BLIT_SRC_Y) to it, however the two overlap;
+ * BLIT_EXPAND draws a bitmap of one bit per pixel at BLIT_SRC_ADDR in RAM,
+ * rows BLIT_SRC_PITCH bytes apart and most significant bit first, from bit
+ * BLIT_SRC_X of each row on: set bits in BLIT_FG, and clear ones in BLIT_BG
+ * unless BLIT_FLAGS has BLIT_TRANSPARENT. An operation that cannot be done
+ * sets BLIT_ERROR, and a successful one clears it.
+ */
+#define BLIT_BASE 0x10003000
+#define BLIT_SIZE 0x100
+#define BLIT_OP (BLIT_BASE + 0x000)
+#define BLIT_DST_X (BLIT_BASE + 0x004)
+#define BLIT_DST_Y (BLIT_BASE + 0x008)
+#define BLIT_WIDTH (BLIT_BASE + 0x00C)
+#define BLIT_HEIGHT (BLIT_BASE + 0x010)
+#define BLIT_SRC_X (BLIT_BASE + 0x014)
+#define BLIT_SRC_Y (BLIT_BASE + 0x018)
+#define BLIT_FG (BLIT_BASE + 0x01C)
+#define BLIT_BG (BLIT_BASE + 0x020)
+#define BLIT_FLAGS (BLIT_BASE + 0x024)
+#define BLIT_SRC_ADDR_LOW (BLIT_BASE + 0x028)
+#define BLIT_SRC_ADDR_HIGH (BLIT_BASE + 0x02C)
+#define BLIT_SRC_PITCH (BLIT_BASE + 0x030)
+#define BLIT_DONE (BLIT_BASE + 0x034)
+#define BLIT_ERROR (BLIT_BASE + 0x038)
+enum { BLIT_FILL = 1, BLIT_COPY = 2, BLIT_EXPAND = 3 };
+enum { BLIT_TRANSPARENT = 1 };
+
+/* A virtio-mmio (version 2) block device with a single split virtqueue, in
+ * front of the same image and I/O thread as the disk above. Its device
+ * configuration holds the capacity in 512-byte sectors.
+ */
+#define VIRTIO_BASE 0x10004000
+#define VIRTIO_SIZE 0x1000
+#define VIRTIO_MAGIC (VIRTIO_BASE + 0x000)
+#define VIRTIO_VERSION (VIRTIO_BASE + 0x004)
+#define VIRTIO_DEVICE_ID (VIRTIO_BASE + 0x008)
+#define VIRTIO_VENDOR_ID (VIRTIO_BASE + 0x00c)
+#define VIRTIO_DEVICE_FEATURES (VIRTIO_BASE + 0x010)
+#define VIRTIO_DEVICE_FEATURES_SEL (VIRTIO_BASE + 0x014)
+#define VIRTIO_DRIVER_FEATURES (VIRTIO_BASE + 0x020)
+#define VIRTIO_DRIVER_FEATURES_SEL (VIRTIO_BASE + 0x024)
+#define VIRTIO_QUEUE_SEL (VIRTIO_BASE + 0x030)
+#define VIRTIO_QUEUE_NUM_MAX (VIRTIO_BASE + 0x034)
+#define VIRTIO_QUEUE_NUM (VIRTIO_BASE + 0x038)
+#define VIRTIO_QUEUE_READY (VIRTIO_BASE + 0x044)
+#define VIRTIO_QUEUE_NOTIFY (VIRTIO_BASE + 0x050)
+#define VIRTIO_INTERRUPT_STATUS (VIRTIO_BASE + 0x060)
+#define VIRTIO_INTERRUPT_ACK (VIRTIO_BASE + 0x064)
+#define VIRTIO_STATUS (VIRTIO_BASE + 0x070)
+#define VIRTIO_QUEUE_DESC_LOW (VIRTIO_BASE + 0x080)
+#define VIRTIO_QUEUE_DESC_HIGH (VIRTIO_BASE + 0x084)
+#define VIRTIO_QUEUE_DRIVER_LOW (VIRTIO_BASE + 0x090)
+#define VIRTIO_QUEUE_DRIVER_HIGH (VIRTIO_BASE + 0x094)
+#define VIRTIO_QUEUE_DEVICE_LOW (VIRTIO_BASE + 0x0a0)
+#define VIRTIO_QUEUE_DEVICE_HIGH (VIRTIO_BASE + 0x0a4)
+#define VIRTIO_CONFIG_GENERATION (VIRTIO_BASE + 0x0fc)
+#define VIRTIO_CONFIG (VIRTIO_BASE + 0x100)
+
+#define VIRTIO_QUEUE_MAX 256 /* descriptors */
+
 /* USER is a mode for application which runs on operating system.
  * SUPERVISOR is a mode for operating system.
  * MACHINE is a mode for RISC-V hart internal operation, sometimes called
@@ -52,45 +153,219 @@ enum { UART_LSR_RX = 1, UART_LSR_TX = 1 << 5 };
  */
 typedef enum { USER = 0x0, SUPERVISOR = 0x1, MACHINE = 0x3 } cpu_mode_t;
 
+/* Software TLB: a direct-mapped cache of Sv39 translations keyed by virtual
+ * page number. Fetches, loads and stores each get their own array, so a
+ * translation cached for one kind of access is never used for another.
+ */
+#define TLB_SIZE 256
+#define TLB_INVALID UINT64_MAX
+
+enum { TLB_FETCH, TLB_LOAD, TLB_STORE, N_TLB };
+
+struct tlb_entry {
+    uint64_t vpn, ppage;
+};
+
+struct tlb {
+    struct tlb_entry entries[TLB_SIZE];
+    uint64_t hits, misses;
+};
+
 struct cpu {
     uint64_t regs[N_REG], pc;
+    uint64_t fregs[N_REG]; /* singles are NaN-boxed */
     uint64_t csrs[N_CSR];
     cpu_mode_t mode;
     struct bus *bus;
+    int hartid;
     bool enable_paging;
     uint64_t pagetable;
+    struct tlb tlb[N_TLB];
+    uint32_t tlb_epoch; /* bus->tlb_epoch when the TLB was last flushed */
+    struct bcache *bcache;
+
+    uint64_t cycle;     /* instructions retired */
+    uint64_t sched_due; /* cycle at which to poll the scheduler again */
+    uint32_t *pending;  /* &bus->sched->pending[hartid] */
+    bool wfi; /* stalled in wfi until an interrupt may be pending */
+
+    /* LR/SC reservation: the physical address and the value loaded. */
+    uint64_t reserved_addr, reserved_value;
+#if defined(JIT)
+    struct jit *jit; /* NULL when blocks are only interpreted */
+#endif
+#if defined(STATS)
+    struct cpu_stats *stats;
+#endif
 };
 
 struct bus {
     struct ram *ram;
+    struct sched *sched;
     struct clint *clint;
     struct plic *plic;
     struct uart *uart;
     struct disk *disk;
+    struct blit *blit;
+    struct keyboard *kbd;
+    struct syscon *syscon;
+
+    /* With more than one hart, device registers are only accessed with
+     * lock held, and an sfence.vma on any hart bumps tlb_epoch so that the
+     * others flush their TLBs too.
+     */
+    int nharts;
+    pthread_mutex_t lock;
+    uint32_t tlb_epoch;
+#if defined(STATS)
+    struct bus_stats *stats;
+#endif
 };
 
 struct ram {
     uint8_t *data;
+    uint64_t size; /* a multiple of PAGE_SIZE, at least RAM_MIN_SIZE */
+
+    /* Per-page code generation. An odd value means blocks have been decoded
+     * from the page; storing to such a page makes the value even again,
+     * which invalidates those blocks.
+     */
+    uint32_t *page_gen;
+
+    /* Framebuffer scanlines written since the frame was last drawn. */
+    uint64_t fb_dirty[(FRAMEBUFFER_HEIGHT + 63) / 64];
+#if defined(JIT)
+    struct jit_journal *journal; /* records stores while diffing the JIT */
+#endif
+};
+
+struct blit {
+    uint32_t dst_x, dst_y, width, height, src_x, src_y;
+    uint32_t fg, bg, flags, src_pitch;
+    uint64_t src_addr;
+    uint32_t done, error;
+    bool interrupting;
+};
+
+struct syscon {
+    bool off;
+    int exit_code;
+    bool snapshot;
+};
+
+/* Device events wait in a min-heap of deadlines on the guest clock, which
+ * counts host time at CPU_HZ or, with SCHED_CLOCK_CYCLES, the instructions
+ * retired by hart 0 (so that runs do not depend on host timing). Each event
+ * is pending at most once. Harts poll the scheduler when the earliest
+ * deadline may have passed, assuming one tick per instruction, and at least
+ * every SCHED_MAX_POLL instructions.
+ */
+enum sched_clock { SCHED_CLOCK_HOST, SCHED_CLOCK_CYCLES };
+enum {
+    EVENT_DISK,
+    EVENT_UART,
+    EVENT_INPUT, /* of a replay */
+    EVENT_TIMER,
+    N_EVENTS = EVENT_TIMER + MAX_HARTS
+};
+#define SCHED_MAX_POLL (CPU_HZ / 10000)
+
+struct sched {
+    enum sched_clock clock;
+    uint64_t cycles; /* of hart 0, for SCHED_CLOCK_CYCLES */
+
+    struct event {
+        uint64_t when;
+        int id; /* EVENT_TIMER + hart for the timer of a hart */
+    } heap[N_EVENTS];
+    int len, pos[N_EVENTS]; /* pos is -1 when the event is not pending */
+    uint64_t next; /* heap[0].when, or UINT64_MAX; read without the lock */
+    pthread_mutex_t lock;
+
+    /* Harts in wfi sleep on wake, which is broadcast, and posts bumped,
+     * whenever an event is set or fires.
+     */
+    pthread_cond_t wake;
+    uint32_t posts;
+
+    /* Set for a hart whenever something may have made an interrupt
+     * pending for it, so that between blocks it only has to look at this
+     * word, and at the clock once sched_due is reached.
+     */
+    uint32_t pending[MAX_HARTS];
+
+    /* Inputs are recorded or replayed, and blocks end at the deadline of
+     * the next event, so that each is seen at the same instruction every
+     * time. NULL otherwise.
+     */
+    struct replay *replay;
+
+    /* The harts share host threads with other machines, so one in wfi
+     * returns to its caller instead of sleeping, and the devices start no
+     * threads of their own.
+     */
+    bool pooled;
 };
 
+/* The longest a hart sleeps in wfi before looking around again, for
+ * interrupts that do not go through the scheduler (keys).
+ */
+#define WFI_MAX_SLEEP_MS 10
+
 struct clint {
-    uint64_t mtime, mtimecmp;
+    uint64_t mtime_base; /* clock at which mtime was 0 */
+    uint32_t msip[MAX_HARTS];
+    uint64_t mtimecmp[MAX_HARTS];
+    bool mtip[MAX_HARTS]; /* set once the timer event fires */
+    struct sched *sched;
 };
 
 struct plic {
     uint64_t pending;
-    uint64_t senable;
-    uint64_t spriority;
-    uint64_t sclaim;
+    uint64_t senable[MAX_HARTS];
+    uint64_t spriority[MAX_HARTS];
+    uint64_t sclaim[MAX_HARTS];
 };
 
+/* Received bytes wait in a FIFO until the guest reads them from RHR. */
+#define UART_FIFO_SIZE 64
+
+/* Transmitted bytes go to a ring that a writer thread empties with large
+ * writes: at the end of every line and once no byte has been written for
+ * UART_TX_IDLE_MS, only on the latter, or only when the ring fills up and on
+ * exit. It is also flushed whenever it is half full.
+ */
+#define UART_TX_SIZE 65536
+#define UART_TX_IDLE_MS 10
+enum uart_flush { UART_FLUSH_LINE, UART_FLUSH_IDLE, UART_FLUSH_EXIT };
+
 struct uart {
     uint8_t data[UART_SIZE];
     bool interrupting;
+    struct sched *sched;
 
-    pthread_t tid;
+    uint8_t fifo[UART_FIFO_SIZE];
+    unsigned fifo_head, fifo_tail; /* free running indices */
+    uint8_t stage[UART_FIFO_SIZE]; /* input not yet seen, when recording */
+    unsigned stage_len;
+
+    uint8_t tx[UART_TX_SIZE];
+    unsigned tx_head, tx_tail; /* free running indices */
+    int tx_fd;
+    enum uart_flush tx_flush;
+    bool tx_kick; /* flush without waiting for the output to go idle */
+
+    pthread_t tid, tx_tid;
     pthread_mutex_t lock;
-    pthread_cond_t cond;
+    pthread_cond_t cond;    /* signalled when the FIFO drains */
+    pthread_cond_t tx_cond; /* wakes the writer */
+    pthread_cond_t tx_room; /* signalled when the ring drains */
+    int wake[2];            /* a pipe to stop the input thread */
+    bool closing;
+
+    /* Pooled only: the tail uart_pump last saw, and when it moved. */
+    unsigned tx_seen;
+    uint64_t tx_seen_ms;
 };
 
 struct disk {
@@ -102,7 +377,55 @@ struct disk {
     uint32_t notify;
     uint32_t direction;
     uint32_t done;
-    FILE *disk;
+    struct disk_image *image; /* NULL if there is no disk */
+    struct ram *ram;
+    struct sched *sched;
+
+    /* A store to NOTIFY queues the request held in the registers, tagged
+     * with the stored value, for the I/O thread, which serves requests in
+     * order while the guest runs. Finished requests are retired by the
+     * harts, under the bus lock: DISK_IRQ is raised and their tags can be
+     * read, oldest first, from DISK_COMPLETED.
+     */
+    struct disk_request {
+        uint64_t address, length, offset;
+        uint32_t direction, tag;
+        /* From the virtqueue: a chain is queued as one request per data
+         * segment and a last one, which may flush the image, and which
+         * stores status to the byte at status_address and puts the chain,
+         * whose head is in tag, on the used ring.
+         */
+        bool virtio, flush, last;
+        uint8_t status;
+        uint64_t status_address;
+        uint32_t used_len;
+    } queue[DISK_QUEUE_SIZE];
+    uint32_t submitted, finished, retired;
+    uint32_t tags[DISK_QUEUE_SIZE];
+    uint32_t tags_head, tags_tail;
+    bool interrupting;
+
+    /* The virtio front end. The harts only put chains on the used ring as
+     * they retire them, so one interrupt covers all those that finished
+     * since the previous one.
+     */
+    struct virtio_blk {
+        uint32_t status;
+        uint32_t device_features_sel, driver_features_sel;
+        uint64_t features; /* accepted by the driver */
+        uint32_t queue_sel, queue_num, queue_ready;
+        uint64_t desc, avail, used;
+        uint16_t last_avail, used_idx;
+        uint32_t interrupt_status;
+        bool interrupting;
+    } virtio;
+
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t work, idle;
+#if defined(STATS)
+    struct bus_stats *stats;
+#endif
 };
 
 typedef enum {
@@ -130,11 +453,155 @@ typedef enum {
     MACHINE_EXTERNAL_INTERRUPT = 11,
 } interrupt_t;
 
+/* Every instruction the decoder knows about. */
+#define INSN_LIST(_)                                                        \
+    _(illegal) _(lb) _(lh) _(lw) _(ld) _(lbu) _(lhu) _(lwu) _(fence)        \
+    _(fence_i) _(addi) _(slli) _(slti) _(sltiu) _(xori) _(srli) _(srai)     \
+    _(ori) _(andi) _(auipc) _(addiw) _(slliw) _(srliw) _(sraiw) _(sb) _(sh) \
+    _(sw) _(sd) _(lr_w) _(sc_w) _(lr_d) _(sc_d) _(amoadd_w) _(amoswap_w)    \
+    _(amoxor_w) _(amoor_w) _(amoand_w) _(amomin_w) _(amomax_w) _(amominu_w) \
+    _(amomaxu_w) _(amoadd_d) _(amoswap_d) _(amoxor_d) _(amoor_d)            \
+    _(amoand_d) _(amomin_d) _(amomax_d) _(amominu_d) _(amomaxu_d) _(add)    \
+    _(mul) _(sub) _(sll) _(mulh) _(slt) _(mulhsu) _(sltu) _(mulhu) _(xor)   \
+    _(div) _(srl) _(divu) _(sra) _(rem) _(or) _(and) _(remu) _(lui) _(addw) \
+    _(mulw) _(subw) _(sllw) _(divw) _(srlw) _(divuw) _(sraw) _(remw)        \
+    _(remuw) _(beq) _(bne) _(blt) _(bge) _(bltu) _(bgeu) _(jalr) _(jal)     \
+    _(ecall) _(ebreak) _(sret) _(mret) _(sfence_vma) _(csrrw) _(csrrs)      \
+    _(csrrc) _(csrrwi) _(csrrsi) _(csrrci) _(wfi) _(flw) _(fld) _(fsw)      \
+    _(fsd) _(fmadd_s) _(fmsub_s) _(fnmsub_s) _(fnmadd_s) _(fadd_s)          \
+    _(fsub_s) _(fmul_s) _(fdiv_s) _(fsqrt_s) _(fsgnj_s) _(fsgnjn_s)         \
+    _(fsgnjx_s) _(fmin_s) _(fmax_s) _(fcvt_w_s) _(fcvt_wu_s) _(fcvt_l_s)    \
+    _(fcvt_lu_s) _(fmv_x_w) _(feq_s) _(flt_s) _(fle_s) _(fclass_s)          \
+    _(fcvt_s_w) _(fcvt_s_wu) _(fcvt_s_l) _(fcvt_s_lu) _(fmv_w_x) _(fmadd_d) \
+    _(fmsub_d) _(fnmsub_d) _(fnmadd_d) _(fadd_d) _(fsub_d) _(fmul_d)        \
+    _(fdiv_d) _(fsqrt_d) _(fsgnj_d) _(fsgnjn_d) _(fsgnjx_d) _(fmin_d)       \
+    _(fmax_d) _(fcvt_s_d) _(fcvt_d_s) _(fcvt_w_d) _(fcvt_wu_d) _(fcvt_l_d)  \
+    _(fcvt_lu_d) _(fmv_x_d) _(feq_d) _(flt_d) _(fle_d) _(fclass_d)          \
+    _(fcvt_d_w) _(fcvt_d_wu) _(fcvt_d_l) _(fcvt_d_lu) _(fmv_d_x)
+
+#define INSN_OP(name) OP_##name,
+enum insn_op { INSN_LIST(INSN_OP) N_OPS };
+#undef INSN_OP
+
+#if defined(STATS)
+#define BUS_MAX_REGIONS 16
+#define N_CAUSES 16
+
+/* Counters of STATS builds. Those of a hart are only updated by its own
+ * thread, those of the bus under the bus lock, and those of the screen by
+ * the main thread. Instructions are counted as the interpreter retires
+ * them, so ones run as translated code only appear in the total.
+ */
+struct cpu_stats {
+    uint64_t ops[N_OPS];
+    uint64_t exceptions[N_CAUSES], interrupts[N_CAUSES];
+};
+
+struct bus_stats {
+    uint64_t loads[BUS_MAX_REGIONS], stores[BUS_MAX_REGIONS];
+    uint64_t disk_requests, disk_read_bytes, disk_written_bytes;
+    uint64_t blits, blit_pixels;
+    uint64_t frames, draw_ns; /* time spent in ScreenDraw() */
+};
+#endif
+
+struct insn;
+typedef exception_t (*insn_handler_t)(struct cpu *cpu, const struct insn *insn);
+
+/* A pre-decoded instruction. The immediate is already sign-extended; shifts
+ * keep their shift amount and CSR instructions their CSR address in it.
+ */
+struct insn {
+    insn_handler_t handler;
+#if defined(INTERP_THREADED)
+    const void *label; /* entry point in the direct-threaded core */
+#endif
+    uint8_t op, rd, rs1, rs2;
+    uint8_t len; /* 4, or 2 for a compressed instruction */
+    uint64_t imm;
+};
+
+/* Decoded basic blocks, cached by the physical address of their first
+ * instruction. A block ends at the first control-transfer or system
+ * instruction, at a page boundary or after BLOCK_MAX_INSNS instructions.
+ */
+#define BLOCK_MAX_INSNS 32
+#define BCACHE_SIZE 4096
+#define BLOCK_INVALID UINT64_MAX
+
+struct block {
+    uint64_t pa;
+    uint32_t gen, len;
+#if defined(INTERP_THREADED)
+    bool threaded; /* labels of insns[] are filled in */
+#endif
+#if defined(JIT)
+    uint32_t heat;    /* times interpreted, to find hot blocks */
+    const void *code; /* translated host code, or NULL */
+#endif
+    struct insn insns[BLOCK_MAX_INSNS];
+};
+
+struct bcache {
+    struct block blocks[BCACHE_SIZE];
+    uint64_t hits, misses;
+};
+
 void fatal(const char *msg);
 bool exception_is_fatal(const exception_t e);
-size_t read_file(FILE *f, uint8_t *r[]);
-struct cpu *cpu_new(uint8_t *code, const size_t code_size, FILE *disk);
+exception_t bus_load(const struct bus *bus,
+                     const uint64_t addr,
+                     const uint64_t size,
+                     uint64_t *result);
+exception_t bus_store(struct bus *bus,
+                      const uint64_t addr,
+                      const uint64_t size,
+                      const uint64_t value);
+struct ram *ram_new(const uint64_t size, const bool huge);
+exception_t ram_load(const struct ram *ram,
+                     const uint64_t addr,
+                     const uint64_t size,
+                     uint64_t *result);
+exception_t ram_store(struct ram *ram,
+                      const uint64_t addr,
+                      const uint64_t size,
+                      const uint64_t value);
+bool ram_take_dirty_lines(struct ram *ram, uint64_t lines[]);
+void bus_set_clock(struct bus *bus, const enum sched_clock clock);
+void bus_set_replay(struct bus *bus, struct replay *replay);
+void bus_put_key(struct bus *bus, const uint8_t code);
+void uart_console(struct uart *uart,
+                  const int fd,
+                  const enum uart_flush flush);
+void uart_pump(struct uart *uart);
+void uart_close(struct uart *uart);
+void disk_drain(struct disk *vio);
+struct cpu *cpu_new(struct ram *ram,
+                    const uint64_t entry,
+                    struct disk_image *disk);
+struct cpu *cpu_new_pooled(struct ram *ram,
+                           const uint64_t entry,
+                           struct disk_image *disk);
+struct cpu *cpu_new_hart(struct cpu *boot, const int hartid);
+exception_t cpu_translate(struct cpu *cpu,
+                          const uint64_t addr,
+                          const exception_t e,
+                          uint64_t *result);
 exception_t cpu_fetch(struct cpu *cpu, uint64_t *result);
+void cpu_flush_tlb(struct cpu *cpu);
+void cpu_flush_bcache(struct cpu *cpu);
+void cpu_print_stats(const struct cpu *cpu,
+                     FILE *f,
+                     const enum stats_format format);
+void bus_print_stats(const struct bus *bus,
+                     FILE *f,
+                     const enum stats_format format);
 void cpu_take_trap(struct cpu *cpu, const exception_t e, const interrupt_t intr);
-exception_t cpu_execute(struct cpu *cpu, const uint64_t insn);
+exception_t cpu_execute(struct cpu *cpu, const uint64_t raw);
+int cpu_run_block(struct cpu *cpu,
+                  struct block *block,
+                  const int start,
+                  const int budget,
+                  exception_t *e);
+int cpu_execute_block(struct cpu *cpu, const int budget, exception_t *e);
 interrupt_t cpu_check_pending_interrupt(struct cpu *cpu);
@@ -0,0 +1,257 @@
+#define _DEFAULT_SOURCE /* ftruncate, fsync */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "semu.h"
+#include "io.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "VSSTATE"
+#define SNAPSHOT_VERSION 4
+
+/* RAM starts at a multiple of this, so that it can be mapped on hosts with
+ * pages of up to 64 KiB.
+ */
+#define SNAPSHOT_ALIGN 65536
+
+/* Everything but RAM, in host byte order. */
+struct snapshot_state {
+    char magic[8];
+    uint32_t version, nharts;
+    uint64_t ram_size, ram_offset;
+
+    struct {
+        uint64_t regs[N_REG], pc;
+        uint64_t fregs[N_REG];
+        uint64_t csrs[N_CSR];
+        uint64_t mode, pagetable, cycle;
+        uint64_t reserved_addr, reserved_value;
+        uint8_t enable_paging, wfi;
+    } hart;
+
+    struct {
+        uint64_t mtime;
+        uint32_t msip;
+        uint64_t mtimecmp;
+    } clint;
+
+    struct plic plic;
+
+    struct {
+        uint8_t data[UART_SIZE];
+        uint8_t interrupting;
+        uint32_t fifo_len;
+        uint8_t fifo[UART_FIFO_SIZE];
+    } uart;
+
+    struct {
+        uint32_t buffer_address_high, buffer_address_low;
+        uint32_t buffer_length_high, buffer_length_low;
+        uint32_t sector, notify, direction, done;
+        uint32_t tags[DISK_QUEUE_SIZE];
+        uint32_t tags_head, tags_tail;
+        uint8_t interrupting;
+        struct virtio_blk virtio;
+    } disk;
+
+    struct blit blit;
+};
+
+static bool page_is_zero(const uint8_t *page)
+{
+    static const uint8_t zero[PAGE_SIZE];
+    return !memcmp(page, zero, PAGE_SIZE);
+}
+
+/* Take the snapshot between two blocks. Outstanding disk requests are
+ * finished first, so that only the registers have to be saved.
+ */
+bool snapshot_save(struct cpu *cpu, const char *path)
+{
+    struct bus *bus = cpu->bus;
+    if (bus->nharts != 1)
+        return false;
+    disk_drain(bus->disk);
+
+    struct snapshot_state *st = calloc(1, sizeof(struct snapshot_state));
+    memcpy(st->magic, SNAPSHOT_MAGIC, sizeof(st->magic));
+    st->version = SNAPSHOT_VERSION;
+    st->nharts = 1;
+    st->ram_size = bus->ram->size;
+    st->ram_offset = (sizeof(struct snapshot_state) + SNAPSHOT_ALIGN - 1) /
+                     SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+
+    memcpy(st->hart.regs, cpu->regs, sizeof(cpu->regs));
+    memcpy(st->hart.fregs, cpu->fregs, sizeof(cpu->fregs));
+    memcpy(st->hart.csrs, cpu->csrs, sizeof(cpu->csrs));
+    st->hart.pc = cpu->pc;
+    st->hart.mode = cpu->mode;
+    st->hart.pagetable = cpu->pagetable;
+    st->hart.cycle = cpu->cycle;
+    st->hart.reserved_addr = cpu->reserved_addr;
+    st->hart.reserved_value = cpu->reserved_value;
+    st->hart.enable_paging = cpu->enable_paging;
+    st->hart.wfi = cpu->wfi;
+
+    uint64_t value;
+    bus_load(bus, CLINT_MTIME, 64, &st->clint.mtime);
+    bus_load(bus, CLINT_MSIP, 32, &value);
+    st->clint.msip = value;
+    bus_load(bus, CLINT_MTIMECMP, 64, &st->clint.mtimecmp);
+
+    st->plic = *bus->plic;
+
+    struct uart *uart = bus->uart;
+    pthread_mutex_lock(&uart->lock);
+    memcpy(st->uart.data, uart->data, UART_SIZE);
+    st->uart.interrupting = uart->interrupting;
+    st->uart.fifo_len = uart->fifo_tail - uart->fifo_head;
+    for (uint32_t i = 0; i < st->uart.fifo_len; i++)
+        st->uart.fifo[i] = uart->fifo[(uart->fifo_head + i) % UART_FIFO_SIZE];
+    pthread_mutex_unlock(&uart->lock);
+
+    const struct disk *vio = bus->disk;
+    st->disk.buffer_address_high = vio->buffer_address_high;
+    st->disk.buffer_address_low = vio->buffer_address_low;
+    st->disk.buffer_length_high = vio->buffer_length_high;
+    st->disk.buffer_length_low = vio->buffer_length_low;
+    st->disk.sector = vio->sector;
+    st->disk.notify = vio->notify;
+    st->disk.direction = vio->direction;
+    st->disk.done = vio->done;
+    memcpy(st->disk.tags, vio->tags, sizeof(vio->tags));
+    st->disk.tags_head = vio->tags_head;
+    st->disk.tags_tail = vio->tags_tail;
+    st->disk.interrupting = vio->interrupting;
+    st->disk.virtio = vio->virtio;
+    st->blit = *bus->blit;
+
+    /* RAM may still be mapped from the file at path, if the machine was
+     * restored from it, so write a new file and rename it over the old one,
+     * which lives on for as long as it is mapped.
+     */
+    bool ok = false;
+    size_t len = strlen(path);
+    char *tmp = malloc(len + sizeof(".tmp"));
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        goto out;
+    if (!write_all(fd, st, sizeof(*st), 0) ||
+        ftruncate(fd, st->ram_offset + st->ram_size) < 0)
+        goto out;
+    for (uint64_t off = 0; off < st->ram_size; off += PAGE_SIZE) {
+        const uint8_t *page = bus->ram->data + off;
+        if (!page_is_zero(page) &&
+            !write_all(fd, page, PAGE_SIZE, st->ram_offset + off))
+            goto out;
+    }
+    ok = fsync(fd) == 0 && rename(tmp, path) == 0;
+
+out:
+    if (fd >= 0)
+        close(fd);
+    if (fd >= 0 && !ok)
+        unlink(tmp);
+    free(tmp);
+    free(st);
+    return ok;
+}
+
+/* Restore into a machine that has just been created, before it runs. */
+bool snapshot_restore(struct cpu *cpu, const char *path)
+{
+    struct bus *bus = cpu->bus;
+    struct snapshot_state *st = calloc(1, sizeof(struct snapshot_state));
+    bool ok = false;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        goto out;
+    if (!read_all(fd, st, sizeof(*st), 0) ||
+        memcmp(st->magic, SNAPSHOT_MAGIC, sizeof(st->magic)) ||
+        st->version != SNAPSHOT_VERSION || st->nharts != 1 ||
+        st->nharts != (uint32_t) bus->nharts ||
+        st->ram_size < RAM_MIN_SIZE || st->ram_size % PAGE_SIZE ||
+        st->ram_offset % SNAPSHOT_ALIGN)
+        goto out;
+
+    /* Pages are only read from the file, and copied, as they are touched.
+     * RAM takes the size it had when the snapshot was saved.
+     */
+    struct ram *ram = bus->ram;
+    uint8_t *data = mmap(NULL, st->ram_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, st->ram_offset);
+    if (data == MAP_FAILED)
+        goto out;
+    munmap(ram->data, ram->size);
+    ram->data = data;
+    ram->size = st->ram_size;
+    free(ram->page_gen);
+    ram->page_gen = calloc(ram->size / PAGE_SIZE, sizeof(uint32_t));
+    memset(ram->fb_dirty, 0xff, sizeof(ram->fb_dirty));
+
+    memcpy(cpu->regs, st->hart.regs, sizeof(cpu->regs));
+    memcpy(cpu->fregs, st->hart.fregs, sizeof(cpu->fregs));
+    memcpy(cpu->csrs, st->hart.csrs, sizeof(cpu->csrs));
+    cpu->pc = st->hart.pc;
+    cpu->mode = st->hart.mode;
+    cpu->pagetable = st->hart.pagetable;
+    cpu->cycle = st->hart.cycle;
+    cpu->reserved_addr = st->hart.reserved_addr;
+    cpu->reserved_value = st->hart.reserved_value;
+    cpu->enable_paging = st->hart.enable_paging;
+    cpu->wfi = st->hart.wfi;
+    bus->sched->cycles = cpu->cycle;
+    cpu_flush_tlb(cpu);
+    cpu_flush_bcache(cpu);
+    *cpu->pending = 1;
+
+    /* Going through the registers also schedules the timer. */
+    bus_store(bus, CLINT_MSIP, 32, st->clint.msip);
+    bus_store(bus, CLINT_MTIMECMP, 64, st->clint.mtimecmp);
+    bus_store(bus, CLINT_MTIME, 64, st->clint.mtime);
+
+    *bus->plic = st->plic;
+
+    struct uart *uart = bus->uart;
+    pthread_mutex_lock(&uart->lock);
+    memcpy(uart->data, st->uart.data, UART_SIZE);
+    uart->interrupting = st->uart.interrupting;
+    uart->fifo_head = uart->fifo_tail = 0;
+    for (uint32_t i = 0; i < st->uart.fifo_len && i < UART_FIFO_SIZE; i++)
+        uart->fifo[uart->fifo_tail++] = st->uart.fifo[i];
+    pthread_mutex_unlock(&uart->lock);
+
+    struct disk *vio = bus->disk;
+    vio->buffer_address_high = st->disk.buffer_address_high;
+    vio->buffer_address_low = st->disk.buffer_address_low;
+    vio->buffer_length_high = st->disk.buffer_length_high;
+    vio->buffer_length_low = st->disk.buffer_length_low;
+    vio->sector = st->disk.sector;
+    vio->notify = st->disk.notify;
+    vio->direction = st->disk.direction;
+    vio->done = st->disk.done;
+    memcpy(vio->tags, st->disk.tags, sizeof(vio->tags));
+    vio->tags_head = st->disk.tags_head;
+    vio->tags_tail = st->disk.tags_tail;
+    vio->interrupting = st->disk.interrupting;
+    vio->virtio = st->disk.virtio;
+    *bus->blit = st->blit;
+    ok = true;
+
+out:
+    if (fd >= 0)
+        close(fd); /* the mapping stays */
+    free(st);
+    return ok;
+}
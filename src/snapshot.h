@@ -0,0 +1,13 @@
+#pragma once
+
+/* Machine snapshots: the state of the hart, CLINT, PLIC, UART and disk
+ * registers, and RAM. RAM is stored page by page at a page-aligned offset,
+ * with pages of zeroes left as holes, and is mapped copy-on-write when the
+ * snapshot is restored, so that only the pages the guest touches are read.
+ * The disk image is not part of the snapshot.
+ *
+ * Only machines with one hart are supported. Both return false on an I/O
+ * error or, when restoring, a file that is not a snapshot.
+ */
+bool snapshot_save(struct cpu *cpu, const char *path);
+bool snapshot_restore(struct cpu *cpu, const char *path);